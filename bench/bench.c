@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <libusb.h>
+
+#include "../src/crypto.h"
+#include "../src/stlink.h"
+#include "../src/image.h"
+#include "../src/layout.h"
+#include "../src/buffer_pool.h"
+#include "../src/profile.h"
+#include "../src/buffer_utils.h"
+#include "../src/timing.h"
+#include "../src/record.h"
+#include "simulator.h"
+
+/* Image sizes to flash, all of which fit the application area of both bootloaders */
+static const size_t bench_sizes[] = {
+	16U * 1024U,
+	64U * 1024U,
+	96U * 1024U,
+};
+
+static uint64_t cpu_time_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return ((uint64_t)now.tv_sec * 1000000U) + ((uint64_t)now.tv_nsec / 1000U);
+}
+
+/* Something firmware-like: a vector table (so it's taken as a raw binary) followed by incompressible noise */
+static void bench_fill_image(uint8_t *const image, const size_t length)
+{
+	uint32_t state = 0x12345678U;
+	for (size_t offset = 0U; offset < length; ++offset) {
+		state ^= state << 13U;
+		state ^= state >> 17U;
+		state ^= state << 5U;
+		image[offset] = (uint8_t)state;
+	}
+	write_le4(image, 0, 0x20005000U);
+	write_le4(image, 4, 0x08004101U);
+}
+
+/* Chunk lengths to check the kernels at, including ones that leave a tail short of a whole AES block */
+static const size_t bench_kernel_lengths[] = {
+	16U,
+	48U,
+	1024U,
+	1031U,
+	2048U,
+	STLINK_MAX_CHUNK_SIZE,
+};
+
+/* FIPS-197's example key, and the answers ST's word swapped AES-128 and byte sum give with it (as from OpenSSL) */
+static const uint8_t bench_kat_key[16U] = {
+	0x2bU, 0x7eU, 0x15U, 0x16U, 0x28U, 0xaeU, 0xd2U, 0xa6U, 0xabU, 0xf7U, 0x15U, 0x88U, 0x09U, 0xcfU, 0x4fU, 0x3cU,
+};
+#define BENCH_KAT_LENGTH 40U
+#define BENCH_KAT_V2_CHECKSUM 0x1374U
+#define BENCH_KAT_V3_CHECKSUM 0x12c7U
+static const uint8_t bench_kat_v2[BENCH_KAT_LENGTH] = {
+	0x46U, 0xa5U, 0x4bU, 0x4eU, 0x13U, 0xb0U, 0x68U, 0x58U, 0xf2U, 0x10U, 0x37U, 0x95U, 0x96U, 0x99U, 0x1fU, 0x92U,
+	0x18U, 0xb3U, 0x04U, 0xf7U, 0x10U, 0x6cU, 0xceU, 0x99U, 0x48U, 0x64U, 0xccU, 0xd3U, 0x12U, 0x41U, 0x3aU, 0xd1U,
+	0xa7U, 0xc4U, 0xe1U, 0xfeU, 0x1bU, 0x38U, 0x55U, 0x72U,
+};
+static const uint8_t bench_kat_v3[BENCH_KAT_LENGTH] = {
+	0xb7U, 0xc3U, 0x09U, 0xbdU, 0x58U, 0x1aU, 0x97U, 0xdfU, 0x90U, 0xbcU, 0xbeU, 0x88U, 0xb8U, 0xa0U, 0xf4U, 0xe3U,
+	0x10U, 0xeaU, 0x21U, 0x71U, 0xfaU, 0xe6U, 0xc9U, 0xcaU, 0xf3U, 0xf2U, 0x63U, 0x5cU, 0x4cU, 0xddU, 0xbfU, 0x52U,
+	0xa7U, 0xc4U, 0xe1U, 0xfeU, 0x1bU, 0x38U, 0x55U, 0x72U,
+};
+
+static void bench_kat_input(uint8_t *const data)
+{
+	for (size_t offset = 0U; offset < BENCH_KAT_LENGTH; ++offset)
+		data[offset] = (uint8_t)((offset * 0x1dU) + 7U);
+}
+
+static uint16_t bench_reference_checksum(const uint8_t *const data, const size_t length)
+{
+	uint16_t sum = 0U;
+	for (size_t offset = 0U; offset < length; ++offset)
+		sum += data[offset];
+	return sum;
+}
+
+/* What stlink_encrypt_chunk() should give: the generic kernel for each layer, summing the bytes in between */
+static uint16_t bench_reference_chunk(const stlink_aes_kernels_s *const reference,
+	const stlink_aes_ctx_s *const transport, const stlink_aes_ctx_s *const firmware, uint8_t *const data,
+	const size_t length)
+{
+	if (transport)
+		reference->kernel(&transport->ctx, data, length);
+	const uint16_t checksum = bench_reference_checksum(data, length);
+	reference->kernel(&firmware->ctx, data, length);
+	return checksum;
+}
+
+/*
+ * Check the reference against the known answers, and then every kernel this machine can run (plain and
+ * fused, without and with the V3 transport layer) and stlink_checksum() against the reference. The bench
+ * only measures, so this is what catches an accelerated path going wrong.
+ */
+static bool bench_check_kernels(void)
+{
+	const stlink_aes_kernels_s *kernels = NULL;
+	const size_t kernel_count = stlink_aes_available_kernels(&kernels);
+	stlink_aes_ctx_s transport;
+	stlink_aes_ctx_s firmware;
+	stlink_aes_init(&transport, " .ST-Link.ver.3.");
+	stlink_aes_init(&firmware, bench_kat_key);
+	bool ok = true;
+
+	uint8_t answer[BENCH_KAT_LENGTH];
+	bench_kat_input(answer);
+	ok &= bench_reference_chunk(&kernels[0], NULL, &firmware, answer, sizeof(answer)) == BENCH_KAT_V2_CHECKSUM &&
+		memcmp(answer, bench_kat_v2, sizeof(answer)) == 0;
+	bench_kat_input(answer);
+	ok &= bench_reference_chunk(&kernels[0], &transport, &firmware, answer, sizeof(answer)) ==
+			BENCH_KAT_V3_CHECKSUM &&
+		memcmp(answer, bench_kat_v3, sizeof(answer)) == 0;
+	if (!ok) {
+		fprintf(stderr, "Generic AES kernel doesn't give the known answers\n");
+		return false;
+	}
+
+	uint8_t *const input = malloc(STLINK_MAX_CHUNK_SIZE);
+	uint8_t *const expected = malloc(STLINK_MAX_CHUNK_SIZE);
+	uint8_t *const actual = malloc(STLINK_MAX_CHUNK_SIZE);
+	if (!input || !expected || !actual) {
+		fprintf(stderr, "Failed to allocate kernel check buffers\n");
+		free(input);
+		free(expected);
+		free(actual);
+		return false;
+	}
+	bench_fill_image(input, STLINK_MAX_CHUNK_SIZE);
+	for (size_t length = 0U; length <= STLINK_MAX_CHUNK_SIZE; length += length < 64U ? 1U : length) {
+		if (stlink_checksum(input, length) != bench_reference_checksum(input, length)) {
+			fprintf(stderr, "stlink_checksum() is wrong for %zu bytes\n", length);
+			ok = false;
+		}
+	}
+	for (size_t kernel = 0U; kernel < kernel_count; ++kernel) {
+		stlink_aes_ctx_s kernel_transport = transport;
+		stlink_aes_ctx_s kernel_firmware = firmware;
+		kernel_transport.kernel = kernel_firmware.kernel = kernels[kernel].kernel;
+		kernel_transport.chunk_kernel = kernel_firmware.chunk_kernel = kernels[kernel].chunk_kernel;
+		bool matches = true;
+		for (size_t i = 0U; i < sizeof(bench_kernel_lengths) / sizeof(*bench_kernel_lengths); ++i) {
+			const size_t length = bench_kernel_lengths[i];
+			memcpy(expected, input, length);
+			kernels[0].kernel(&firmware.ctx, expected, length);
+			memcpy(actual, input, length);
+			stlink_aes_run(&kernel_firmware, actual, length);
+			matches &= memcmp(actual, expected, length) == 0;
+			/* V2 loaders have just the firmware layer, V3 ones the transport layer under it too */
+			for (size_t layers = 0U; layers < 2U; ++layers) {
+				const stlink_aes_ctx_s *const reference_transport = layers ? &transport : NULL;
+				memcpy(expected, input, length);
+				const uint16_t checksum =
+					bench_reference_chunk(&kernels[0], reference_transport, &firmware, expected, length);
+				memcpy(actual, input, length);
+				matches &= stlink_aes_encrypt_chunk(layers ? &kernel_transport : NULL, &kernel_firmware, actual,
+							   length) == checksum &&
+					memcmp(actual, expected, length) == 0;
+			}
+		}
+		if (!matches)
+			fprintf(stderr, "%s AES kernels don't match the reference\n", kernels[kernel].name);
+		ok &= matches;
+	}
+	free(input);
+	free(expected);
+	free(actual);
+	if (ok) {
+		printf("AES kernels checked against the reference:");
+		for (size_t kernel = 0U; kernel < kernel_count; ++kernel)
+			printf(" %s", kernels[kernel].name);
+		printf("\n");
+	}
+	return ok;
+}
+
+/*
+ * Check what ended up in the simulated flash against the image prepared afresh for the same device, so a run
+ * that went quickly by programming the wrong thing doesn't count. Blank blocks are never sent, so should
+ * still read back erased.
+ */
+static bool bench_check_flash(const stlink_info_s *const info, const stlink_sim_s *const sim,
+	const uint8_t *const image, const size_t length, const size_t chunk_size)
+{
+	stlink_layout_s layout;
+	if (!stlink_layout_load(image, length, info->stinfo_profile->app_base, chunk_size, &layout))
+		return false;
+	stlink_image_s prepared;
+	bool ok = stlink_image_prepare(info, layout.data, layout.length, layout.address, chunk_size, layout.populated,
+		NULL, &prepared);
+	stlink_layout_free(&layout);
+	if (!ok)
+		return false;
+	for (size_t i = 0U; i < prepared.chunk_count; ++i) {
+		const stlink_chunk_s *const chunk = &prepared.chunks[i];
+		const uint8_t *const flash = sim->flash + (chunk->address - sim->flash_base);
+		if (chunk->blank ? !stlink_block_blank(flash, chunk_size) : memcmp(flash, chunk->data, chunk_size) != 0) {
+			fprintf(stderr, "%s: flash at 0x%08" PRIx32 " doesn't match the prepared image\n",
+				info->stinfo_profile->name, chunk->address);
+			ok = false;
+			break;
+		}
+	}
+	stlink_image_free(&prepared);
+	return ok;
+}
+
+static bool bench_run(const stlink_profile_s *const profile, const size_t length,
+	const stlink_flash_options_s *const options, const uint32_t time_scale, const size_t fault_interval)
+{
+	uint8_t *const image = malloc(length);
+	stlink_sim_s sim;
+	if (!image || !stlink_sim_init(&sim, profile->type, time_scale)) {
+		fprintf(stderr, "Failed to allocate benchmark image\n");
+		free(image);
+		return false;
+	}
+	bench_fill_image(image, length);
+	sim.fault_interval = fault_interval;
+
+	const stlink_transport_s transport = {
+		.bulk = stlink_sim_bulk,
+		.data = &sim,
+		.clear_halt = stlink_sim_clear_halt,
+	};
+	stlink_info_s info;
+	memset(&info, 0, sizeof(info));
+	info.stinfo_transport = &transport;
+	info.stinfo_profile = profile;
+	info.stinfo_ep_in = profile->ep_in;
+	info.stinfo_ep_out = profile->ep_out;
+	const stlink_firmware_s firmware = {
+		.data = image,
+		.size = length,
+		.fd = -1,
+	};
+
+	const uint64_t start = time_us();
+	const uint64_t cpu_start = cpu_time_us();
+	bool ok = stlink_read_info(&info) && stlink_flash_firmware(&info, &firmware, options) == 0;
+	const uint64_t elapsed_us = time_us() - start;
+	/* The simulated loader checking downloads runs on this thread too, but isn't the host's work */
+	const uint64_t cpu_used = cpu_time_us() - cpu_start;
+	const uint64_t cpu_us = cpu_used > sim.checking_us ? cpu_used - sim.checking_us : 0U;
+	stlink_buffer_pool_free(&info.stinfo_buffers);
+	const size_t chunk_size = options->chunk_size ? options->chunk_size : stlink_max_chunk_size(&info);
+	ok = ok && bench_check_flash(&info, &sim, image, length, chunk_size);
+
+	const char *const name = profile->name;
+	if (ok) {
+		const double seconds = (double)elapsed_us / 1000000.0;
+		printf("%s %4zu KiB: %4zu blocks in %7.3fs, %7.1f blocks/s, host CPU %8.3fms, %zu transfers, %zu polls",
+			name, length / 1024U, sim.programs, seconds, (double)sim.programs / seconds, (double)cpu_us / 1000.0,
+			sim.transfers, sim.status_polls);
+		if (sim.faults)
+			printf(", %zu faults", sim.faults);
+		/* The loader refusing things is only expected while recovering from lost transfers */
+		if (sim.failures)
+			printf(", %zu rejected", sim.failures);
+		printf("\n");
+	} else
+		printf("%s %4zu KiB: failed (%zu errors from the simulated loader)\n", name, length / 1024U, sim.failures);
+	if (sim.bad_checksums)
+		fprintf(stderr, "%s: %zu downloads didn't match their checksum\n", name, sim.bad_checksums);
+	stlink_sim_free(&sim);
+	free(image);
+	return ok && !sim.bad_checksums && (sim.faults || !sim.failures);
+}
+
+/*
+ * Play a device in a USB recording back to the protocol engine, going through what stlink-tool does with a
+ * device: read its information, check its mode, flash firmware_file (if any) with the options it was recorded
+ * flashing with, and have it start its application if that's what the recording went on to do. Reports how
+ * long that took against the recording, so changes on the host side can be measured against real device timing.
+ */
+static bool bench_replay(
+	const char *const path, const uint8_t device, const char *const firmware_file, const uint32_t time_scale)
+{
+	stlink_replay_s replay;
+	if (!stlink_replay_open(path, device, time_scale, &replay))
+		return false;
+	const stlink_profile_s *const profile = stlink_profile_find(replay.product_id, 0U);
+	if (!profile) {
+		fprintf(stderr, "Recording is of an unknown bootloader (product ID %04x)\n", replay.product_id);
+		stlink_replay_free(&replay);
+		return false;
+	}
+	const stlink_transport_s transport = {
+		.bulk = stlink_replay_bulk,
+		.data = &replay,
+	};
+	stlink_info_s info;
+	memset(&info, 0, sizeof(info));
+	info.stinfo_transport = &transport;
+	info.stinfo_profile = profile;
+	info.stinfo_ep_in = replay.ep_in;
+	info.stinfo_ep_out = replay.ep_out;
+	const stlink_flash_options_s options = {
+		.chunk_size = replay.chunk_size,
+		.block_addressing = replay.flags & STLINK_RECORD_BLOCK_ADDRESSING,
+		.verify = replay.flags & STLINK_RECORD_VERIFY,
+	};
+
+	const uint64_t start = time_us();
+	const uint64_t cpu_start = cpu_time_us();
+	bool ok = stlink_read_info(&info) && stlink_current_mode(&info) != UINT16_MAX;
+	if (ok && firmware_file)
+		ok = stlink_flash(&info, firmware_file, &options) == 0;
+	if (ok && replay.next < replay.count)
+		ok = stlink_exit_dfu(&info);
+	const uint64_t elapsed_us = time_us() - start;
+	const uint64_t cpu_us = cpu_time_us() - cpu_start;
+	stlink_buffer_pool_free(&info.stinfo_buffers);
+	ok &= stlink_replay_finished(&replay);
+
+	const uint64_t recorded_us = (stlink_replay_recorded_us(&replay) * time_scale) / 100U;
+	if (ok)
+		printf("%s replay: %zu transfers (%zu recorded) in %7.3fs (recorded %7.3fs), host CPU %8.3fms, "
+			   "%zu polls skipped, %zu added\n",
+			profile->name, replay.served, replay.count, (double)elapsed_us / 1000000.0,
+			(double)recorded_us / 1000000.0, (double)cpu_us / 1000.0, replay.polls_skipped, replay.polls_added);
+	else
+		printf("%s replay: failed after %zu of %zu transfers\n", profile->name, replay.next, replay.count);
+	stlink_replay_free(&replay);
+	return ok;
+}
+
+static void print_help(char *argv[])
+{
+	printf("Usage: %s [options] [-R recording [firmware.bin]]\n", argv[0]);
+	printf("Flashes images of several sizes to simulated V2 and V3 bootloaders and reports throughput\n");
+	printf("or replays a USB recording made with stlink-tool -U, flashing the same image again\n");
+	printf("Options:\n");
+	printf("\t-t pct\tRun the simulated device at pct%% of real time (default: 100)\n");
+	printf("\t-b size\tDownload block size in bytes (default: bootloader's largest known)\n");
+	printf("\t-s\tSet the address pointer once per run of sequential blocks\n");
+	printf("\t-f n\tLose every nth transfer, to measure the cost of recovering from a flaky link\n");
+	printf("\t-R file\tReplay the USB recording in file instead (-t scales the recorded timing)\n");
+	printf("\t-d n\tReplay the nth device in the recording (default: 0)\n");
+	printf("\t-h\tShow help\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt = -1;
+	uint32_t time_scale = 100U;
+	size_t fault_interval = 0U;
+	const char *replay_file = NULL;
+	uint8_t replay_device = 0U;
+	stlink_flash_options_s options = {0};
+	while ((opt = getopt(argc, argv, "ht:b:sf:R:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			time_scale = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'b': {
+			const unsigned long size = strtoul(optarg, NULL, 0);
+			if (size < 16U || size > STLINK_MAX_CHUNK_SIZE || (size & (size - 1U))) {
+				fprintf(stderr, "Invalid block size %s, must be a power of 2 from 16 to %u\n", optarg,
+					STLINK_MAX_CHUNK_SIZE);
+				return EXIT_FAILURE;
+			}
+			options.chunk_size = size;
+			break;
+		}
+		case 's':
+			options.block_addressing = true;
+			break;
+		case 'f':
+			fault_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			replay_file = optarg;
+			break;
+		case 'd':
+			replay_device = (uint8_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			print_help(argv);
+			return EXIT_SUCCESS;
+		default:
+			print_help(argv);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Nothing measured is worth anything if the image preparation is wrong */
+	if (!bench_check_kernels())
+		return EXIT_FAILURE;
+	if (replay_file)
+		return bench_replay(replay_file, replay_device, optind < argc ? argv[optind] : NULL, time_scale) ?
+			EXIT_SUCCESS :
+			EXIT_FAILURE;
+
+	bool ok = true;
+	/* Every known bootloader gets run, against the simulator for its type */
+	for (size_t profile = 0U; profile < stlink_profile_count; ++profile) {
+		for (size_t size = 0U; size < sizeof(bench_sizes) / sizeof(*bench_sizes); ++size)
+			ok &= bench_run(&stlink_profiles[profile], bench_sizes[size], &options, time_scale, fault_interval);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "../src/buffer_utils.h"
+#include "../src/timing.h"
+#include "simulator.h"
+
+#define SIM_FLASH_BASE    0x08000000U
+#define SIM_V2_FLASH_SIZE (128U * 1024U)
+#define SIM_V3_FLASH_SIZE (512U * 1024U)
+#define SIM_V2_APP_BASE   0x08004000U
+#define SIM_V3_APP_BASE   0x08020000U
+#define SIM_V2_PAGE_SIZE  1024U
+
+/* Typical busy times, from the STM32F103 (V2) and STM32F723 (V3) datasheets */
+#define SIM_SET_ADDRESS_US          100U
+#define SIM_V2_PAGE_ERASE_US        20000U
+#define SIM_V2_PROGRAM_US_PER_BYTE  26U
+#define SIM_V3_PROGRAM_US_PER_BYTE  4U
+#define SIM_V3_ERASE_US_PER_KIB     8U
+#define SIM_V3_ERASE_MIN_US         250000U
+/* Full speed USB manages about a megabyte a second of bulk traffic */
+#define SIM_LINK_RATE               1000U
+
+static const uint32_t sim_v3_sector_start[9] = {
+	0x08000000U,
+	0x08004000U,
+	0x08008000U,
+	0x0800C000U,
+	0x08010000U,
+	0x08020000U,
+	0x08040000U,
+	0x08060000U,
+	0x08080000U,
+};
+
+/* The ID and key material the loader hands out, which what it decrypts downloads with is derived from */
+static void sim_device_id(const stlink_sim_s *const sim, uint8_t *const id)
+{
+	memset(id, 0, 20U);
+	id[0] = 0x5aU;
+	id[1] = 0xa5U;
+	id[2] = 0x3cU;
+	id[3] = (uint8_t)sim->type;
+	for (size_t i = 8U; i < 20U; ++i)
+		id[i] = (uint8_t)(0x30U + i + sim->type);
+}
+
+bool stlink_sim_init(stlink_sim_s *const sim, const bootloader_types_e type, const uint32_t time_scale)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->type = type;
+	sim->flash_base = SIM_FLASH_BASE;
+	sim->flash_size = type == STLINK_BL_V3 ? SIM_V3_FLASH_SIZE : SIM_V2_FLASH_SIZE;
+	sim->app_base = type == STLINK_BL_V3 ? SIM_V3_APP_BASE : SIM_V2_APP_BASE;
+	sim->time_scale = time_scale;
+	sim->link_rate = SIM_LINK_RATE;
+	sim->state = dfuIDLE;
+	sim->status = OK;
+	uint8_t id[20];
+	sim_device_id(sim, id);
+	uint8_t firmware_key[16];
+	memcpy(firmware_key, id, 4U);
+	memcpy(firmware_key + 4U, id + 8U, 12U);
+	stlink_aes(type == STLINK_BL_V3 ? " found...STlink " : "I am key, wawawa", firmware_key, sizeof(firmware_key));
+	stlink_aes_init(&sim->firmware_aes, firmware_key);
+	sim->flash = malloc(sim->flash_size);
+	if (!sim->flash)
+		return false;
+	/* Start out with something other than erased flash, so a missed erase shows up */
+	memset(sim->flash, 0x00, sim->flash_size);
+	return true;
+}
+
+void stlink_sim_free(stlink_sim_s *const sim)
+{
+	free(sim->flash);
+	sim->flash = NULL;
+}
+
+static uint64_t sim_scaled(const stlink_sim_s *const sim, const uint64_t us)
+{
+	return (us * sim->time_scale) / 100U;
+}
+
+/* Account for the time the link takes to carry a transfer, sleeping it off in whole milliseconds */
+static void sim_link_delay(stlink_sim_s *const sim, const size_t length)
+{
+	sim->link_debt_us += sim_scaled(sim, ((uint64_t)length * 1000U) / sim->link_rate);
+	if (sim->link_debt_us < 1000U)
+		return;
+	const uint64_t start = time_us();
+	sleep_us(sim->link_debt_us);
+	const uint64_t slept = time_us() - start;
+	sim->link_debt_us = slept < sim->link_debt_us ? sim->link_debt_us - slept : 0U;
+}
+
+static void sim_respond(stlink_sim_s *const sim, const uint8_t *const data, const size_t length)
+{
+	memcpy(sim->response, data, length);
+	sim->response_length = length;
+}
+
+static bool sim_range_valid(const stlink_sim_s *const sim, const uint32_t address, const size_t length)
+{
+	return address >= sim->app_base && address - sim->flash_base <= sim->flash_size &&
+		length <= sim->flash_size - (address - sim->flash_base);
+}
+
+static enum DeviceStatus sim_erase(stlink_sim_s *const sim, const uint32_t address, const size_t length)
+{
+	if (!sim_range_valid(sim, address, length))
+		return errTARGET;
+	memset(sim->flash + (address - sim->flash_base), 0xff, length);
+	++sim->erases;
+	return OK;
+}
+
+static enum DeviceStatus sim_program(stlink_sim_s *const sim, const uint32_t address)
+{
+	if (!sim_range_valid(sim, address, sim->length))
+		return errTARGET;
+	/*
+	 * The F1 behind V2 loaders refuses to program anything not erased. The F7 behind V3 ones only ever clears
+	 * bits, so rewriting data already there (as when a block is resent) is harmless
+	 */
+	uint8_t *const target = sim->flash + (address - sim->flash_base);
+	for (size_t i = 0U; i < sim->length; ++i) {
+		const bool erased = target[i] == 0xffU;
+		if (sim->type == STLINK_BL_V2 ? !erased : (target[i] & sim->payload[i]) != sim->payload[i])
+			return errCHECK_ERASED;
+	}
+	memcpy(target, sim->payload, sim->length);
+	++sim->programs;
+	return OK;
+}
+
+/*
+ * The checksum the host should have sent with the download just received: the plain sum of a command's bytes,
+ * or for a program block, the sum once the firmware key layer is taken off (leaving any V3 transport layer on)
+ */
+static uint16_t sim_download_checksum(const stlink_sim_s *const sim)
+{
+	uint16_t sum = 0U;
+	for (size_t block_offset = 0U; block_offset < sim->length; block_offset += 16U) {
+		uint8_t block[16];
+		const size_t amount = sim->length - block_offset < 16U ? sim->length - block_offset : 16U;
+		memcpy(block, sim->payload + block_offset, amount);
+		/* Trailing bytes that don't make up a whole AES block are sent as they are */
+		if (sim->block >= 2U && amount == 16U) {
+			for (size_t offset = 0U; offset < 16U; offset += 4U)
+				write_be4(block, offset, read_le4(block, offset));
+			AES_ECB_decrypt(&sim->firmware_aes.ctx, block);
+		}
+		for (size_t offset = 0U; offset < amount; ++offset)
+			sum += block[offset];
+	}
+	return sum;
+}
+
+/* Carry out a download once the status request that triggers it comes in, and go busy for as long as it takes */
+static void sim_execute(stlink_sim_s *const sim)
+{
+	/* Checking the download is part of the time the device spends busy, not extra to it */
+	const uint64_t start = time_us();
+	uint64_t busy_us = SIM_SET_ADDRESS_US;
+	enum DeviceStatus result = OK;
+	const uint16_t checksum = sim_download_checksum(sim);
+	sim->checking_us += time_us() - start;
+	if (checksum != sim->checksum) {
+		/* DfuSe has no status for a bad checksum, so this borrows the closest one */
+		result = errVERIFY;
+		++sim->bad_checksums;
+	} else if (sim->block == 0U) {
+		const uint8_t command = sim->payload[0];
+		const uint32_t argument = sim->length >= 5U ? read_le4(sim->payload, 1) : 0U;
+		/* The pointer can go anywhere in flash (reads of the loader included), but not past it */
+		if (command == 0x21U && sim->length == 5U) {
+			if (argument >= sim->flash_base && argument - sim->flash_base < sim->flash_size)
+				sim->address = argument;
+			else
+				result = errTARGET;
+		}
+		else if (command == 0x41U && sim->type == STLINK_BL_V2) {
+			const uint32_t page = argument & ~(SIM_V2_PAGE_SIZE - 1U);
+			result = sim_erase(sim, page, SIM_V2_PAGE_SIZE);
+			busy_us = SIM_V2_PAGE_ERASE_US;
+		} else if (command == 0x42U && sim->type == STLINK_BL_V3 && sim->payload[1] < 8U) {
+			const uint32_t start = sim_v3_sector_start[sim->payload[1]];
+			const uint32_t length = sim_v3_sector_start[sim->payload[1] + 1U] - start;
+			result = sim_erase(sim, start, length);
+			busy_us = ((uint64_t)length / 1024U) * SIM_V3_ERASE_US_PER_KIB * 1000U;
+			if (busy_us < SIM_V3_ERASE_MIN_US)
+				busy_us = SIM_V3_ERASE_MIN_US;
+		} else
+			result = errTARGET;
+	} else if (sim->block >= 2U) {
+		result = sim_program(sim, sim->address + (uint32_t)((sim->block - 2U) * sim->length));
+		busy_us = sim->length *
+			(sim->type == STLINK_BL_V3 ? SIM_V3_PROGRAM_US_PER_BYTE : SIM_V2_PROGRAM_US_PER_BYTE);
+	} else
+		result = errTARGET;
+
+	if (result != OK)
+		++sim->failures;
+	sim->result = result;
+	sim->busy_until = start + sim_scaled(sim, busy_us);
+	/* Like the real loaders, advertise a comfortable margin over how long it should actually take */
+	sim->poll_timeout_ms = (uint32_t)((sim_scaled(sim, busy_us * 2U) + 999U) / 1000U);
+	sim->state = dfuDNBUSY;
+}
+
+static void sim_get_status(stlink_sim_s *const sim)
+{
+	++sim->status_polls;
+	if (sim->state == dfuDNLOAD_SYNC)
+		sim_execute(sim);
+	else if (sim->state == dfuDNBUSY && time_us() >= sim->busy_until) {
+		sim->status = sim->result;
+		sim->state = sim->result == OK ? dfuDNLOAD_IDLE : dfuERROR;
+	}
+	uint8_t status[6] = {sim->status};
+	status[1] = sim->poll_timeout_ms & 0xffU;
+	status[2] = (sim->poll_timeout_ms >> 8U) & 0xffU;
+	status[3] = (sim->poll_timeout_ms >> 16U) & 0xffU;
+	status[4] = sim->state;
+	sim_respond(sim, status, sizeof(status));
+}
+
+/* Refuse a request the device can't take in its current state, as DfuSe loaders do */
+static void sim_stall(stlink_sim_s *const sim)
+{
+	sim->status = errSTALLEDPKT;
+	sim->state = dfuERROR;
+	++sim->failures;
+}
+
+/* Returns false if the request is refused, which stalls the OUT transfer carrying it */
+static bool sim_dfu_command(stlink_sim_s *const sim, const uint8_t *const request)
+{
+	switch (request[1]) {
+	case 0x01U: /* DNLOAD */
+		if (sim->state != dfuIDLE && sim->state != dfuDNLOAD_IDLE) {
+			sim_stall(sim);
+			return false;
+		}
+		sim->block = read_le2(request, 2);
+		sim->checksum = read_le2(request, 4);
+		sim->length = read_le2(request, 6);
+		sim->awaiting_payload = sim->length > 0U && sim->length <= sizeof(sim->payload);
+		break;
+	case 0x02U: /* UPLOAD */
+		sim->block = read_le2(request, 2);
+		sim->length = read_le2(request, 6);
+		if ((sim->state != dfuIDLE && sim->state != dfuUPLOAD_IDLE) || sim->block < 2U ||
+			!sim_range_valid(sim, sim->address + (uint32_t)((sim->block - 2U) * sim->length), sim->length)) {
+			/* This one shows up on the IN transfer that was to carry the data */
+			sim_stall(sim);
+			sim->stalled = true;
+			break;
+		}
+		sim->uploading = true;
+		sim->state = dfuUPLOAD_IDLE;
+		break;
+	case 0x03U: /* GETSTATUS */
+		sim_get_status(sim);
+		break;
+	case 0x04U: /* CLRSTATUS */
+	case 0x06U: /* ABORT */
+		sim->state = dfuIDLE;
+		sim->status = OK;
+		sim->uploading = false;
+		sim->stalled = false;
+		break;
+	case 0x05U: { /* GETSTATE */
+		const uint8_t state = sim->state;
+		sim_respond(sim, &state, 1U);
+		break;
+	}
+	case 0x07U: /* EXIT */
+		sim->exited = true;
+		break;
+	case 0x08U: { /* Device ID and key material */
+		uint8_t id[20];
+		sim_device_id(sim, id);
+		sim_respond(sim, id, sizeof(id));
+		break;
+	}
+	default:
+		break;
+	}
+	return true;
+}
+
+static bool sim_command(stlink_sim_s *const sim, const uint8_t *const request)
+{
+	switch (request[0]) {
+	case 0xf1U: { /* Firmware and loader versions */
+		uint8_t version[6] = {sim->type == STLINK_BL_V3 ? 0x30U : 0x26U, 0x47U};
+		write_le2(version, 4, 0x2a01U);
+		sim_respond(sim, version, sizeof(version));
+		break;
+	}
+	case 0xfbU: { /* V3 extended versions */
+		uint8_t version[12] = {0x00U, 0x01U, 0x07U};
+		write_le2(version, 10, 0x2a03U);
+		sim_respond(sim, version, sizeof(version));
+		break;
+	}
+	case 0xf5U: { /* Current mode */
+		const uint8_t mode[2] = {0x00U, 0x01U};
+		sim_respond(sim, mode, sizeof(mode));
+		break;
+	}
+	case 0xf3U:
+		return sim_dfu_command(sim, request);
+	default:
+		break;
+	}
+	return true;
+}
+
+int stlink_sim_bulk(void *const data, const uint8_t endpoint, uint8_t *const buffer, const int length,
+	int *const actual_length)
+{
+	stlink_sim_s *const sim = (stlink_sim_s *)data;
+	++sim->transfers;
+	*actual_length = 0;
+	sim_link_delay(sim, (size_t)length);
+	/* A flaky link loses the transfer outright, without the device seeing any of it */
+	if (sim->fault_interval && sim->transfers % sim->fault_interval == 0U) {
+		++sim->faults;
+		return LIBUSB_ERROR_IO;
+	}
+
+	if (endpoint & LIBUSB_ENDPOINT_IN) {
+		if (sim->in_halted)
+			return LIBUSB_ERROR_PIPE;
+		if (sim->stalled) {
+			sim->stalled = false;
+			sim->in_halted = true;
+			return LIBUSB_ERROR_PIPE;
+		}
+		if (sim->uploading) {
+			const uint32_t address = sim->address + (uint32_t)((sim->block - 2U) * sim->length);
+			const size_t amount = (size_t)length < sim->length ? (size_t)length : sim->length;
+			memcpy(buffer, sim->flash + (address - sim->flash_base), amount);
+			*actual_length = (int)amount;
+			sim->uploading = false;
+			return LIBUSB_SUCCESS;
+		}
+		if (!sim->response_length)
+			return LIBUSB_ERROR_TIMEOUT;
+		const size_t amount = (size_t)length < sim->response_length ? (size_t)length : sim->response_length;
+		memcpy(buffer, sim->response, amount);
+		*actual_length = (int)amount;
+		sim->response_length = 0U;
+		return LIBUSB_SUCCESS;
+	}
+
+	if (sim->out_halted)
+		return LIBUSB_ERROR_PIPE;
+	*actual_length = length;
+	/* A command arriving instead of the expected payload abandons the download, as if the payload was lost */
+	if (sim->awaiting_payload && !((size_t)length != sim->length && length == 16 && buffer[0] == 0xf3U)) {
+		sim->awaiting_payload = false;
+		if ((size_t)length != sim->length) {
+			sim_stall(sim);
+			sim->out_halted = true;
+			*actual_length = 0;
+			return LIBUSB_ERROR_PIPE;
+		}
+		memcpy(sim->payload, buffer, sim->length);
+		sim->state = dfuDNLOAD_SYNC;
+		return LIBUSB_SUCCESS;
+	}
+	sim->awaiting_payload = false;
+	if (length == 16 && !sim_command(sim, buffer)) {
+		sim->out_halted = true;
+		*actual_length = 0;
+		return LIBUSB_ERROR_PIPE;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/* stlink_transport_s clear_halt callback, standing in for the CLEAR_FEATURE(ENDPOINT_HALT) request */
+int stlink_sim_clear_halt(void *const data, const uint8_t endpoint)
+{
+	stlink_sim_s *const sim = (stlink_sim_s *)data;
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+		sim->in_halted = false;
+	else
+		sim->out_halted = false;
+	return LIBUSB_SUCCESS;
+}
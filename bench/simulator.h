@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <libusb.h>
+
+#include "../src/crypto.h"
+#include "../src/stlink.h"
+
+/*
+ * A simulated ST-Link bootloader, plugged in through stlink_transport_s in place of a real device.
+ * It models the 0xF3-prefixed DFU command set, the stlink_read_info() exchanges, and how long the
+ * flash takes to erase and program along with the bwPollTimeout the real loaders advertise for each.
+ * Like a real loader it checks each download against the checksum in its request, taking off the firmware
+ * key layer to do so, but blocks are stored as they arrive (still encrypted) for comparing against what the
+ * host prepared.
+ */
+typedef struct stlink_sim {
+	bootloader_types_e type;
+	uint32_t flash_base;
+	uint32_t flash_size;
+	/* Everything below this is the bootloader, which refuses to be erased or written */
+	uint32_t app_base;
+	uint8_t *flash;
+	/* The key this loader's downloads are encrypted with, worked out from its ID as the host does */
+	stlink_aes_ctx_s firmware_aes;
+	/* Scales every modelled delay, as a percentage - 100 for real time */
+	uint32_t time_scale;
+	/* USB link throughput in bytes per millisecond */
+	uint32_t link_rate;
+	uint64_t link_debt_us;
+	/* Drop every this many transfers on the floor to model a flaky link, or 0 for none */
+	size_t fault_interval;
+
+	enum DeviceState state;
+	enum DeviceStatus status;
+	uint32_t address;
+	uint64_t busy_until;
+	uint32_t poll_timeout_ms;
+	/* How the operation keeping the device busy turned out, reported once it's done */
+	enum DeviceStatus result;
+	/* What the next IN transfer gets */
+	uint8_t response[20];
+	size_t response_length;
+	bool stalled;
+	/* A stalled endpoint stays halted, failing everything sent its way, until the host clears it */
+	bool in_halted;
+	bool out_halted;
+	/* The last DNLOAD or UPLOAD request, and any DNLOAD payload that followed it */
+	uint16_t block;
+	uint16_t checksum;
+	size_t length;
+	bool awaiting_payload;
+	bool uploading;
+	uint8_t payload[STLINK_MAX_CHUNK_SIZE];
+	bool exited;
+
+	/* Counters for the benchmark to report */
+	size_t transfers;
+	size_t status_polls;
+	size_t erases;
+	size_t programs;
+	size_t failures;
+	/* Downloads refused for not matching their checksum, which no amount of lost transfers explains */
+	size_t bad_checksums;
+	size_t faults;
+	/* Time spent checking downloads, which the benchmark isn't to count as the host's */
+	uint64_t checking_us;
+} stlink_sim_s;
+
+bool stlink_sim_init(stlink_sim_s *sim, bootloader_types_e type, uint32_t time_scale);
+void stlink_sim_free(stlink_sim_s *sim);
+int stlink_sim_bulk(void *data, uint8_t endpoint, uint8_t *buffer, int length, int *actual_length);
+int stlink_sim_clear_halt(void *data, uint8_t endpoint);
+
+#endif /*SIMULATOR_H*/
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <libusb.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "crypto.h"
+#include "stlink.h"
+#include "buffer_pool.h"
+
+/* libusb_dev_mem_alloc() first appeared in libusb 1.0.21 */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define STLINK_HAVE_DEV_MEM 1
+#endif
+
+#define BUFFER_POOL_ALIGNMENT 4096U
+
+static uint8_t *stlink_buffer_pool_heap_alloc(const size_t length)
+{
+#ifdef _WIN32
+	return (uint8_t *)_aligned_malloc(length, BUFFER_POOL_ALIGNMENT);
+#else
+	void *memory = NULL;
+	if (posix_memalign(&memory, BUFFER_POOL_ALIGNMENT, length))
+		return NULL;
+	return (uint8_t *)memory;
+#endif
+}
+
+static void stlink_buffer_pool_heap_free(uint8_t *const memory)
+{
+#ifdef _WIN32
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
+}
+
+/*
+ * Make sure the device's pool can hold at least length bytes, growing it if it's not in use. Device memory
+ * is tried first, but usbfs only lets so much be mapped across all devices (usbfs_memory_mb, 16MiB by
+ * default), so a big gang can run out of it and fall back to heap. Returns false if there's no memory at all.
+ */
+bool stlink_buffer_pool_reserve(stlink_info_s *const info, const size_t length)
+{
+	stlink_buffer_pool_s *const pool = &info->stinfo_buffers;
+	if (pool->capacity >= length)
+		return true;
+	if (pool->used)
+		return false;
+	stlink_buffer_pool_free(pool);
+	/* Round up to whole pages, which is what either kind of memory ends up as anyway */
+	const size_t capacity = (length + BUFFER_POOL_ALIGNMENT - 1U) & ~(size_t)(BUFFER_POOL_ALIGNMENT - 1U);
+#ifdef STLINK_HAVE_DEV_MEM
+	if (info->stinfo_dev_handle && !info->stinfo_transport) {
+		pool->memory = libusb_dev_mem_alloc(info->stinfo_dev_handle, capacity);
+		if (pool->memory)
+			pool->dev_handle = info->stinfo_dev_handle;
+	}
+#endif
+	if (!pool->memory)
+		pool->memory = stlink_buffer_pool_heap_alloc(capacity);
+	if (!pool->memory) {
+		fprintf(stderr, "Failed to allocate %zu bytes of transfer buffers\n", capacity);
+		return false;
+	}
+	pool->capacity = capacity;
+	return true;
+}
+
+/* Carve length bytes off the pool, 16 byte aligned. Returns NULL if it's used up, leaving the caller to fall back */
+uint8_t *stlink_buffer_pool_alloc(stlink_buffer_pool_s *const pool, const size_t length)
+{
+	const size_t offset = (pool->used + 15U) & ~(size_t)15U;
+	if (!pool->memory || offset > pool->capacity || pool->capacity - offset < length)
+		return NULL;
+	pool->used = offset + length;
+	return pool->memory + offset;
+}
+
+/* Hand back everything carved off the pool, keeping the memory itself for next time */
+void stlink_buffer_pool_reset(stlink_buffer_pool_s *const pool)
+{
+	pool->used = 0U;
+}
+
+/* Release the pool's memory. Device memory has to go back before the handle it came from is closed */
+void stlink_buffer_pool_free(stlink_buffer_pool_s *const pool)
+{
+#ifdef STLINK_HAVE_DEV_MEM
+	if (pool->dev_handle)
+		libusb_dev_mem_free(pool->dev_handle, pool->memory, pool->capacity);
+	else
+#endif
+		stlink_buffer_pool_heap_free(pool->memory);
+	pool->memory = NULL;
+	pool->capacity = 0U;
+	pool->used = 0U;
+	pool->dev_handle = NULL;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+#include <string.h>
+#include <errno.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "buffer_utils.h"
+#include "image.h"
+#include "cache.h"
+
+/*
+ * Each cache entry is a single file named after its key, holding a small header followed by the
+ * block addresses, checksums and flags (4, 2 and 2 bytes each, little endian) and then the encrypted blocks
+ * themselves.
+ * How recently an entry was used is tracked with the file's modification time, which is
+ * refreshed on every hit and used to pick the least recently used entries for eviction.
+ */
+#define CACHE_MAGIC       "STLKIMG3"
+#define CACHE_FLAG_BLANK  0x0001U
+#define CACHE_HEADER_SIZE 24U
+#define CACHE_SUFFIX      ".stlc"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+/* 64-bit FNV-1a - not cryptographic, but plenty to tell firmware images apart */
+uint64_t stlink_hash(const void *const data, const size_t length, uint64_t hash)
+{
+	const uint8_t *const bytes = (const uint8_t *)data;
+	if (!hash)
+		hash = FNV_OFFSET_BASIS;
+	for (size_t offset = 0U; offset < length; ++offset) {
+		hash ^= bytes[offset];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+void stlink_cache_key(const struct stlink_info *const info, const uint8_t *const firmware, const size_t length,
+	const uint32_t base_address, const size_t chunk_size, stlink_cache_key_s *const key)
+{
+	uint8_t parameters[12U];
+	write_le4(parameters, 0U, base_address);
+	write_le4(parameters, 4U, (uint32_t)chunk_size);
+	write_le4(parameters, 8U, info->stlink_version);
+
+	key->image_hash = stlink_hash(firmware, length, 0U);
+	key->device_hash = stlink_hash(info->firmware_key, sizeof(info->firmware_key), 0U);
+	key->device_hash = stlink_hash(parameters, sizeof(parameters), key->device_hash);
+}
+
+static void stlink_cache_path(
+	const char *const directory, const stlink_cache_key_s *const key, char *const path, const size_t path_size)
+{
+	snprintf(path, path_size, "%s/%016" PRIx64 "-%016" PRIx64 CACHE_SUFFIX, directory, key->image_hash,
+		key->device_hash);
+}
+
+bool stlink_cache_load(const char *const directory, const stlink_cache_key_s *const key,
+	const uint32_t base_address, const size_t chunk_size, stlink_buffer_pool_s *const pool, stlink_image_s *const image)
+{
+	char path[4096U];
+	stlink_cache_path(directory, key, path, sizeof(path));
+	FILE *const file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	uint8_t header[CACHE_HEADER_SIZE];
+	bool result = false;
+	if (fread(header, 1U, sizeof(header), file) != sizeof(header) || memcmp(header, CACHE_MAGIC, 8U) != 0 ||
+		read_le4(header, 8U) != chunk_size || read_le4(header, 12U) != base_address)
+		goto out;
+
+	const size_t chunk_count = read_le4(header, 16U);
+	if (!chunk_count || !stlink_image_alloc(image, base_address, chunk_size, chunk_count, pool))
+		goto out;
+
+	for (size_t i = 0U; i < chunk_count; ++i) {
+		uint8_t entry[8U];
+		if (fread(entry, 1U, sizeof(entry), file) != sizeof(entry))
+			goto out_free;
+		image->chunks[i].address = read_le4(entry, 0U);
+		image->chunks[i].checksum = read_le2(entry, 4U);
+		image->chunks[i].blank = read_le2(entry, 6U) & CACHE_FLAG_BLANK;
+	}
+	if (fread(image->buffer, chunk_size, chunk_count, file) != chunk_count)
+		goto out_free;
+
+	/* Mark the entry as most recently used */
+	utime(path, NULL);
+	result = true;
+	goto out;
+
+out_free:
+	stlink_image_free(image);
+out:
+	fclose(file);
+	return result;
+}
+
+typedef struct cache_entry {
+	char name[64U];
+	time_t last_used;
+	uint64_t size;
+} cache_entry_s;
+
+static int cache_entry_compare(const void *const lhs, const void *const rhs)
+{
+	const cache_entry_s *const a = (const cache_entry_s *)lhs;
+	const cache_entry_s *const b = (const cache_entry_s *)rhs;
+	return (a->last_used > b->last_used) - (a->last_used < b->last_used);
+}
+
+/* Throw away the least recently used entries until the cache fits within max_size again */
+static void stlink_cache_evict(const char *const directory, const uint64_t max_size)
+{
+	DIR *const dir = opendir(directory);
+	if (!dir)
+		return;
+
+	cache_entry_s *entries = NULL;
+	size_t count = 0U;
+	size_t capacity = 0U;
+	uint64_t total_size = 0U;
+	char path[4096U];
+	for (const struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+		const size_t name_length = strlen(entry->d_name);
+		if (name_length >= sizeof(entries->name) || name_length < sizeof(CACHE_SUFFIX) ||
+			strcmp(entry->d_name + name_length - (sizeof(CACHE_SUFFIX) - 1U), CACHE_SUFFIX) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		struct stat file_stat;
+		if (stat(path, &file_stat) < 0)
+			continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2U : 64U;
+			cache_entry_s *const new_entries = realloc(entries, capacity * sizeof(cache_entry_s));
+			if (!new_entries)
+				break;
+			entries = new_entries;
+		}
+		strcpy(entries[count].name, entry->d_name);
+		entries[count].last_used = file_stat.st_mtime;
+		entries[count].size = (uint64_t)file_stat.st_size;
+		total_size += entries[count].size;
+		++count;
+	}
+	closedir(dir);
+
+	if (total_size > max_size) {
+		qsort(entries, count, sizeof(cache_entry_s), cache_entry_compare);
+		for (size_t i = 0U; i < count && total_size > max_size; ++i) {
+			snprintf(path, sizeof(path), "%s/%s", directory, entries[i].name);
+			if (remove(path) == 0)
+				total_size -= entries[i].size;
+		}
+	}
+	free(entries);
+}
+
+void stlink_cache_store(const char *const directory, const stlink_cache_key_s *const key,
+	const stlink_image_s *const image, const uint64_t max_size)
+{
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+		const int error = errno;
+		fprintf(stderr, "Failed to create cache directory %s (%d): %s\n", directory, error, strerror(error));
+		return;
+	}
+
+	char path[4096U];
+	char temp_path[sizeof(path) + 4U];
+	stlink_cache_path(directory, key, path, sizeof(path));
+	/* Write to a temporary name first so a concurrent reader never sees a half-written entry */
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+	FILE *const file = fopen(temp_path, "wb");
+	if (!file)
+		return;
+
+	uint8_t header[CACHE_HEADER_SIZE] = {0};
+	memcpy(header, CACHE_MAGIC, 8U);
+	write_le4(header, 8U, (uint32_t)image->chunk_size);
+	write_le4(header, 12U, image->chunks[0].address);
+	write_le4(header, 16U, (uint32_t)image->chunk_count);
+	bool ok = fwrite(header, 1U, sizeof(header), file) == sizeof(header);
+	for (size_t i = 0U; ok && i < image->chunk_count; ++i) {
+		uint8_t entry[8U];
+		write_le4(entry, 0U, image->chunks[i].address);
+		write_le2(entry, 4U, image->chunks[i].checksum);
+		write_le2(entry, 6U, image->chunks[i].blank ? CACHE_FLAG_BLANK : 0U);
+		ok = fwrite(entry, 1U, sizeof(entry), file) == sizeof(entry);
+	}
+	if (ok)
+		ok = fwrite(image->buffer, image->chunk_size, image->chunk_count, file) == image->chunk_count;
+	if (fclose(file) != 0)
+		ok = false;
+#ifdef _WIN32
+	/* rename() won't replace an existing file on Windows */
+	if (ok)
+		remove(path);
+#endif
+	if (!ok || rename(temp_path, path) != 0) {
+		remove(temp_path);
+		return;
+	}
+	stlink_cache_evict(directory, max_size);
+}
+
+void stlink_image_pool_init(stlink_image_pool_s *const pool, const uint64_t max_size)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->max_size = max_size;
+}
+
+const stlink_image_s *stlink_image_pool_find(stlink_image_pool_s *const pool, const stlink_cache_key_s *const key,
+	const uint32_t base_address, const size_t chunk_size)
+{
+	for (size_t i = 0U; i < pool->count; ++i) {
+		stlink_image_pool_entry_s *const entry = &pool->entries[i];
+		if (entry->key.image_hash != key->image_hash || entry->key.device_hash != key->device_hash ||
+			entry->base_address != base_address || entry->image.chunk_size != chunk_size)
+			continue;
+		entry->last_used = ++pool->clock;
+		return &entry->image;
+	}
+	return NULL;
+}
+
+static void stlink_image_pool_remove(stlink_image_pool_s *const pool, const size_t index)
+{
+	stlink_image_pool_entry_s *const entry = &pool->entries[index];
+	pool->size -= entry->image.chunk_count * entry->image.chunk_size;
+	stlink_image_free(&entry->image);
+	pool->entries[index] = pool->entries[--pool->count];
+}
+
+/*
+ * Hand a freshly prepared image over to the pool, evicting the least recently used images to keep
+ * inside the size limit. Returns the pooled copy, or NULL if it couldn't be kept - in which case the
+ * image is left with the caller to free.
+ */
+const stlink_image_s *stlink_image_pool_insert(stlink_image_pool_s *const pool, const stlink_cache_key_s *const key,
+	const uint32_t base_address, stlink_image_s *const image)
+{
+	const uint64_t image_size = image->chunk_count * image->chunk_size;
+	if (image_size > pool->max_size)
+		return NULL;
+	while (pool->count && pool->size + image_size > pool->max_size) {
+		size_t oldest = 0U;
+		for (size_t i = 1U; i < pool->count; ++i) {
+			if (pool->entries[i].last_used < pool->entries[oldest].last_used)
+				oldest = i;
+		}
+		stlink_image_pool_remove(pool, oldest);
+	}
+	if (pool->count == pool->capacity) {
+		const size_t capacity = pool->capacity ? pool->capacity * 2U : 8U;
+		stlink_image_pool_entry_s *const entries = realloc(pool->entries, capacity * sizeof(*entries));
+		if (!entries)
+			return NULL;
+		pool->entries = entries;
+		pool->capacity = capacity;
+	}
+	stlink_image_pool_entry_s *const entry = &pool->entries[pool->count++];
+	entry->key = *key;
+	entry->base_address = base_address;
+	entry->image = *image;
+	entry->last_used = ++pool->clock;
+	pool->size += image_size;
+	return &entry->image;
+}
+
+void stlink_image_pool_free(stlink_image_pool_s *const pool)
+{
+	while (pool->count)
+		stlink_image_pool_remove(pool, pool->count - 1U);
+	free(pool->entries);
+	pool->entries = NULL;
+	pool->capacity = 0U;
+}
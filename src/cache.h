@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "image.h"
+
+struct stlink_info;
+
+/* Default upper bound on the total size of the prepared image cache */
+#define STLINK_CACHE_MAX_SIZE (64U * 1024U * 1024U)
+
+/* Identifies one prepared image: which firmware, and which device (key and loader) it was prepared for */
+typedef struct stlink_cache_key {
+	uint64_t image_hash;
+	uint64_t device_hash;
+} stlink_cache_key_s;
+
+/* A prepared image held in memory, and when it was last used (in pool ticks) */
+typedef struct stlink_image_pool_entry {
+	stlink_cache_key_s key;
+	uint32_t base_address;
+	stlink_image_s image;
+	uint64_t last_used;
+} stlink_image_pool_entry_s;
+
+/*
+ * An in-memory counterpart to the on-disk cache for long-lived processes, so images prepared
+ * for a device stay around between jobs. Not thread safe - only use it from one thread at a time.
+ */
+typedef struct stlink_image_pool {
+	stlink_image_pool_entry_s *entries;
+	size_t count;
+	size_t capacity;
+	uint64_t size;
+	uint64_t max_size;
+	uint64_t clock;
+} stlink_image_pool_s;
+
+uint64_t stlink_hash(const void *data, size_t length, uint64_t hash);
+void stlink_cache_key(const struct stlink_info *info, const uint8_t *firmware, size_t length, uint32_t base_address,
+	size_t chunk_size, stlink_cache_key_s *key);
+bool stlink_cache_load(const char *directory, const stlink_cache_key_s *key, uint32_t base_address,
+	size_t chunk_size, struct stlink_buffer_pool *pool, stlink_image_s *image);
+void stlink_cache_store(
+	const char *directory, const stlink_cache_key_s *key, const stlink_image_s *image, uint64_t max_size);
+
+void stlink_image_pool_init(stlink_image_pool_s *pool, uint64_t max_size);
+const stlink_image_s *stlink_image_pool_find(
+	stlink_image_pool_s *pool, const stlink_cache_key_s *key, uint32_t base_address, size_t chunk_size);
+const stlink_image_s *stlink_image_pool_insert(
+	stlink_image_pool_s *pool, const stlink_cache_key_s *key, uint32_t base_address, stlink_image_s *image);
+void stlink_image_pool_free(stlink_image_pool_s *pool);
+
+#endif /*CACHE_H*/
@@ -21,30 +21,259 @@
  * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-#include "../tiny-AES-c/aes.h"
+#include <stdbool.h>
 #include "crypto.h"
 #include "buffer_utils.h"
 
-void stlink_aes(const void *const key, uint8_t *const data, const size_t length)
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define STLINK_AES_X86
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#include <arm_neon.h>
+#define STLINK_AES_ARMV8
+#endif
+
+/*
+ * All the kernels below implement the same transform: ST's implementation treats the data as 4-byte
+ * little endian words, so each AES block is converted to big endian, run through the cipher (due to a bug
+ * in ST's impl, it's encrypt both ways) and then converted back. Only whole 16 byte blocks are processed.
+ */
+
+static void stlink_aes_kernel_generic(const struct AES_ctx *const ctx, uint8_t *const data, const size_t length)
+{
+	for (size_t block_offset = 0U; block_offset + 16U <= length; block_offset += 16U) {
+		/* Convert the input data block from 4-byte LE to 4-byte BE */
+		for (size_t offset = 0U; offset < 16U; offset += 4U)
+			write_be4(data, block_offset + offset, read_le4(data, block_offset + offset));
+		AES_ECB_encrypt(ctx, data + block_offset);
+		/* Convert the block back */
+		for (size_t offset = 0U; offset < 16U; offset += 4U)
+			write_le4(data, block_offset + offset, read_be4(data, block_offset + offset));
+	}
+}
+
+/* Sum any trailing bytes that don't make up a whole AES block, which are sent as they are */
+static uint16_t stlink_sum_tail(const uint8_t *const data, const size_t length)
+{
+	uint16_t sum = 0U;
+	for (size_t offset = length & ~(size_t)15U; offset < length; ++offset)
+		sum += data[offset];
+	return sum;
+}
+
+/*
+ * The fused kernels below do the whole of a chunk's preparation in one pass over each block: the optional
+ * transport layer encryption, the checksum, and then the firmware key encryption. Summing bytes doesn't
+ * care about their order, so the checksum can be taken from the word-swapped form and the swaps only
+ * need doing once on the way in and once on the way out.
+ */
+static uint16_t stlink_aes_chunk_kernel_generic(const struct AES_ctx *const transport,
+	const struct AES_ctx *const firmware, uint8_t *const data, const size_t length)
+{
+	uint16_t sum = 0U;
+	for (size_t block_offset = 0U; block_offset + 16U <= length; block_offset += 16U) {
+		uint8_t *const block = data + block_offset;
+		for (size_t offset = 0U; offset < 16U; offset += 4U)
+			write_be4(block, offset, read_le4(block, offset));
+		if (transport)
+			AES_ECB_encrypt(transport, block);
+		for (size_t offset = 0U; offset < 16U; ++offset)
+			sum += block[offset];
+		AES_ECB_encrypt(firmware, block);
+		for (size_t offset = 0U; offset < 16U; offset += 4U)
+			write_le4(block, offset, read_be4(block, offset));
+	}
+	return sum + stlink_sum_tail(data, length);
+}
+
+#ifdef STLINK_AES_X86
+/* AES-NI implementation - the word swaps are done with a byte shuffle either side of the cipher rounds */
+__attribute__((target("aes,ssse3"))) static void stlink_aes_kernel_aesni(
+	const struct AES_ctx *const ctx, uint8_t *const data, const size_t length)
+{
+	__m128i round_keys[11U];
+	for (size_t round = 0U; round < 11U; ++round)
+		round_keys[round] = _mm_loadu_si128((const __m128i *)(ctx->RoundKey + (round * 16U)));
+	const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+	for (size_t block_offset = 0U; block_offset + 16U <= length; block_offset += 16U) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + block_offset));
+		block = _mm_shuffle_epi8(block, swap);
+		block = _mm_xor_si128(block, round_keys[0U]);
+		for (size_t round = 1U; round < 10U; ++round)
+			block = _mm_aesenc_si128(block, round_keys[round]);
+		block = _mm_aesenclast_si128(block, round_keys[10U]);
+		block = _mm_shuffle_epi8(block, swap);
+		_mm_storeu_si128((__m128i *)(data + block_offset), block);
+	}
+}
+#endif
+
+#ifdef STLINK_AES_X86
+__attribute__((target("aes,ssse3"))) static inline __m128i stlink_aesni_encrypt(
+	__m128i block, const __m128i *const round_keys)
+{
+	block = _mm_xor_si128(block, round_keys[0U]);
+	for (size_t round = 1U; round < 10U; ++round)
+		block = _mm_aesenc_si128(block, round_keys[round]);
+	return _mm_aesenclast_si128(block, round_keys[10U]);
+}
+
+/* Fused AES-NI kernel - _mm_sad_epu8() against zero sums each half of the block into a 64-bit lane */
+__attribute__((target("aes,ssse3"))) static uint16_t stlink_aes_chunk_kernel_aesni(
+	const struct AES_ctx *const transport, const struct AES_ctx *const firmware, uint8_t *const data,
+	const size_t length)
+{
+	__m128i transport_keys[11U];
+	__m128i firmware_keys[11U];
+	for (size_t round = 0U; round < 11U; ++round) {
+		if (transport)
+			transport_keys[round] = _mm_loadu_si128((const __m128i *)(transport->RoundKey + (round * 16U)));
+		firmware_keys[round] = _mm_loadu_si128((const __m128i *)(firmware->RoundKey + (round * 16U)));
+	}
+	const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sums = zero;
+
+	for (size_t block_offset = 0U; block_offset + 16U <= length; block_offset += 16U) {
+		__m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + block_offset)), swap);
+		if (transport)
+			block = stlink_aesni_encrypt(block, transport_keys);
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(block, zero));
+		block = stlink_aesni_encrypt(block, firmware_keys);
+		_mm_storeu_si128((__m128i *)(data + block_offset), _mm_shuffle_epi8(block, swap));
+	}
+	sums = _mm_add_epi64(sums, _mm_unpackhi_epi64(sums, sums));
+	return (uint16_t)_mm_cvtsi128_si32(sums) + stlink_sum_tail(data, length);
+}
+#endif
+
+#ifdef STLINK_AES_ARMV8
+/* ARMv8 Crypto Extensions implementation - vrev32q_u8() does the word swaps */
+static void stlink_aes_kernel_armv8(const struct AES_ctx *const ctx, uint8_t *const data, const size_t length)
+{
+	uint8x16_t round_keys[11U];
+	for (size_t round = 0U; round < 11U; ++round)
+		round_keys[round] = vld1q_u8(ctx->RoundKey + (round * 16U));
+
+	for (size_t block_offset = 0U; block_offset + 16U <= length; block_offset += 16U) {
+		uint8x16_t block = vrev32q_u8(vld1q_u8(data + block_offset));
+		for (size_t round = 0U; round < 9U; ++round)
+			block = vaesmcq_u8(vaeseq_u8(block, round_keys[round]));
+		block = veorq_u8(vaeseq_u8(block, round_keys[9U]), round_keys[10U]);
+		vst1q_u8(data + block_offset, vrev32q_u8(block));
+	}
+}
+#endif
+
+#ifdef STLINK_AES_ARMV8
+static inline uint8x16_t stlink_armv8_encrypt(uint8x16_t block, const uint8x16_t *const round_keys)
+{
+	for (size_t round = 0U; round < 9U; ++round)
+		block = vaesmcq_u8(vaeseq_u8(block, round_keys[round]));
+	return veorq_u8(vaeseq_u8(block, round_keys[9U]), round_keys[10U]);
+}
+
+/* Fused ARMv8 kernel - the byte sums are widened pairwise into 32-bit lanes as they go */
+static uint16_t stlink_aes_chunk_kernel_armv8(const struct AES_ctx *const transport,
+	const struct AES_ctx *const firmware, uint8_t *const data, const size_t length)
+{
+	uint8x16_t transport_keys[11U];
+	uint8x16_t firmware_keys[11U];
+	for (size_t round = 0U; round < 11U; ++round) {
+		if (transport)
+			transport_keys[round] = vld1q_u8(transport->RoundKey + (round * 16U));
+		firmware_keys[round] = vld1q_u8(firmware->RoundKey + (round * 16U));
+	}
+	uint32x4_t sums = vdupq_n_u32(0U);
+
+	for (size_t block_offset = 0U; block_offset + 16U <= length; block_offset += 16U) {
+		uint8x16_t block = vrev32q_u8(vld1q_u8(data + block_offset));
+		if (transport)
+			block = stlink_armv8_encrypt(block, transport_keys);
+		sums = vpadalq_u16(sums, vpaddlq_u8(block));
+		block = stlink_armv8_encrypt(block, firmware_keys);
+		vst1q_u8(data + block_offset, vrev32q_u8(block));
+	}
+	return (uint16_t)vaddvq_u32(sums) + stlink_sum_tail(data, length);
+}
+#endif
+
+static stlink_aes_kernel_t stlink_aes_select_kernel(void)
+{
+#if defined(STLINK_AES_X86)
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3"))
+		return stlink_aes_kernel_aesni;
+#elif defined(STLINK_AES_ARMV8)
+	return stlink_aes_kernel_armv8;
+#endif
+	return stlink_aes_kernel_generic;
+}
+
+static stlink_aes_chunk_kernel_t stlink_aes_select_chunk_kernel(void)
+{
+#if defined(STLINK_AES_X86)
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3"))
+		return stlink_aes_chunk_kernel_aesni;
+#elif defined(STLINK_AES_ARMV8)
+	return stlink_aes_chunk_kernel_armv8;
+#endif
+	return stlink_aes_chunk_kernel_generic;
+}
+
+void stlink_aes_init(stlink_aes_ctx_s *const ctx, const void *const key)
 {
 	uint8_t key_be[16U] = {0};
 	/* Read the key (as 4-byte little endian) and write it to our internal buffer as 4-byte big endian */
 	for (size_t offset = 0U; offset < 16U; offset += 4U)
 		write_be4(key_be, offset, read_le4(key, offset));
 
-	/* Initialise the cryptography subsystem */
-	struct AES_ctx ctx;
-	AES_init_ctx(&ctx, key_be);
+	/* Initialise the cryptography subsystem and expand the key schedule */
+	AES_init_ctx(&ctx->ctx, key_be);
+	ctx->kernel = stlink_aes_select_kernel();
+	ctx->chunk_kernel = stlink_aes_select_chunk_kernel();
+}
+
+void stlink_aes_run(const stlink_aes_ctx_s *const ctx, uint8_t *const data, const size_t length)
+{
+	ctx->kernel(&ctx->ctx, data, length);
+}
 
-	/* Iterate through the data, 1 AES block size at a time */
-	for (size_t block_offset = 0U; block_offset < length; block_offset += 16U) {
-		/* Convert the input data chunk from 4-byte LE to 4-byte BE */
-		for (size_t offset = 0; offset < length; offset += 4U)
-			write_be4(data, block_offset + offset, read_le4(data, block_offset + offset));
-		/* Run the operation (due to a bug in ST's impl, it's encrypt both ways) */
-		AES_ECB_encrypt(&ctx, data + block_offset);
-		/* Convert the buffer back */
-		for (size_t offset = 0; offset < length; offset += 4U)
-			write_le4(data, block_offset + offset, read_be4(data, block_offset + offset));
-	}
+/*
+ * Prepare a chunk for download in a single pass: encrypt it with the transport key (if given), take the
+ * checksum of the result, then encrypt with the firmware key. Returns the checksum.
+ */
+uint16_t stlink_aes_encrypt_chunk(const stlink_aes_ctx_s *const transport, const stlink_aes_ctx_s *const firmware,
+	uint8_t *const data, const size_t length)
+{
+	return firmware->chunk_kernel(transport ? &transport->ctx : NULL, &firmware->ctx, data, length);
+}
+
+void stlink_aes(const void *const key, uint8_t *const data, const size_t length)
+{
+	stlink_aes_ctx_s ctx;
+	stlink_aes_init(&ctx, key);
+	stlink_aes_run(&ctx, data, length);
+}
+
+/*
+ * Every set of kernels built in that this machine can run, the generic (reference) ones first, so the
+ * accelerated ones can be checked against them. Returns how many there are.
+ */
+size_t stlink_aes_available_kernels(const stlink_aes_kernels_s **const kernels)
+{
+	static const stlink_aes_kernels_s available[] = {
+		{"generic", stlink_aes_kernel_generic, stlink_aes_chunk_kernel_generic},
+#if defined(STLINK_AES_X86)
+		{"AES-NI", stlink_aes_kernel_aesni, stlink_aes_chunk_kernel_aesni},
+#elif defined(STLINK_AES_ARMV8)
+		{"ARMv8", stlink_aes_kernel_armv8, stlink_aes_chunk_kernel_armv8},
+#endif
+	};
+	*kernels = available;
+#if defined(STLINK_AES_X86)
+	if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("ssse3"))
+		return 1U;
+#endif
+	return sizeof(available) / sizeof(*available);
 }
@@ -26,7 +26,34 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "../tiny-AES-c/aes.h"
 
+typedef void (*stlink_aes_kernel_t)(const struct AES_ctx *ctx, uint8_t *data, size_t length);
+typedef uint16_t (*stlink_aes_chunk_kernel_t)(
+	const struct AES_ctx *transport, const struct AES_ctx *firmware, uint8_t *data, size_t length);
+
+/*
+ * An expanded ST-Link AES key, along with the block kernel picked for this machine.
+ * Set one of these up once per key with stlink_aes_init() and reuse it for every chunk.
+ */
+typedef struct stlink_aes_ctx {
+	struct AES_ctx ctx;
+	stlink_aes_kernel_t kernel;
+	stlink_aes_chunk_kernel_t chunk_kernel;
+} stlink_aes_ctx_s;
+
+/* One implementation of the kernels, as listed by stlink_aes_available_kernels() so they can be checked */
+typedef struct stlink_aes_kernels {
+	const char *name;
+	stlink_aes_kernel_t kernel;
+	stlink_aes_chunk_kernel_t chunk_kernel;
+} stlink_aes_kernels_s;
+
+void stlink_aes_init(stlink_aes_ctx_s *ctx, const void *key);
+void stlink_aes_run(const stlink_aes_ctx_s *ctx, uint8_t *data, size_t length);
+uint16_t stlink_aes_encrypt_chunk(
+	const stlink_aes_ctx_s *transport, const stlink_aes_ctx_s *firmware, uint8_t *data, size_t length);
 void stlink_aes(const void *key, uint8_t *data, size_t length);
+size_t stlink_aes_available_kernels(const stlink_aes_kernels_s **kernels);
 
 #endif /*CRYPTO_H*/
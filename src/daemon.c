@@ -0,0 +1,616 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libusb.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+#include "crypto.h"
+#include "stlink.h"
+#include "image.h"
+#include "cache.h"
+#include "discovery.h"
+#include "gang.h"
+#include "timing.h"
+#include "stream.h"
+#include "daemon.h"
+
+#ifndef _WIN32
+
+/*
+ * The daemon keeps a single libusb context alive and takes jobs over a Unix socket, one per connection.
+ * A job is a single line of the form
+ *
+ *   <image path> [serial=<ST-Link ID or USB serial>] [port=<bus-port.port...>]
+ *
+ * and is answered with a single line, "OK <ST-Link ID>" or "ERROR <reason>", once it's been run.
+ * Jobs run one at a time in the order received, each on the next matching device to turn up. Devices
+ * that have been flashed are then left alone until they're unplugged, so plugging in a new device is
+ * what moves the queue along.
+ */
+
+#define DAEMON_REQUEST_MAX       4096U
+#define DAEMON_BACKLOG           16
+#define DAEMON_POLL_MS           100U
+#define DAEMON_DEVICE_WAIT_MS    1000U
+#define DAEMON_REQUEST_TIMEOUT_S 5
+/* How many firmware files to keep mapped between jobs */
+#define DAEMON_FIRMWARE_MAX 16U
+/* Devices drop off the bus as they leave the bootloader, which mustn't be mistaken for being unplugged */
+#define DAEMON_REBOOT_GRACE_US (2000U * 1000U)
+
+typedef struct daemon_job {
+	int client;
+	char request[DAEMON_REQUEST_MAX];
+	const char *image_path;
+	stlink_device_filter_s filter;
+	struct daemon_job *next;
+} daemon_job_s;
+
+/* A firmware file kept mapped, along with what it looked like when mapped so changes are noticed */
+typedef struct daemon_firmware {
+	char *path;
+	off_t size;
+	struct timespec mtime;
+	stlink_firmware_s firmware;
+	uint64_t last_used;
+} daemon_firmware_s;
+
+/* The location of a device that's been flashed and shouldn't be picked up again until it's unplugged */
+typedef struct daemon_done_port {
+	char path[STLINK_PORT_PATH_LENGTH];
+	uint64_t flashed_us;
+} daemon_done_port_s;
+
+typedef struct daemon {
+	libusb_context *ctx;
+	const stlink_daemon_options_s *options;
+	int listener;
+	pthread_t listener_thread;
+
+	/* Jobs waiting to be run, handed from the listener thread to the dispatcher */
+	pthread_mutex_t queue_lock;
+	daemon_job_s *queue_head;
+	daemon_job_s *queue_tail;
+
+	/* Everything below here is only touched by the dispatcher thread */
+	daemon_firmware_s firmware[DAEMON_FIRMWARE_MAX];
+	size_t firmware_count;
+	uint64_t clock;
+	daemon_done_port_s *done;
+	size_t done_count;
+	size_t done_capacity;
+	bool hotplug;
+	libusb_hotplug_callback_handle hotplug_handle;
+	stlink_image_pool_s pool;
+	stlink_flash_options_s flash_options;
+} daemon_s;
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(const int signal)
+{
+	(void)signal;
+	daemon_stop = 1;
+}
+
+static void daemon_reply(const int client, const char *const reply)
+{
+	size_t offset = 0U;
+	const size_t length = strlen(reply);
+	while (offset < length) {
+		const ssize_t written = write(client, reply + offset, length - offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return;
+		offset += (size_t)written;
+	}
+}
+
+/* True if the client has gone away, in which case there's nobody to run the job for */
+static bool daemon_client_gone(const int client)
+{
+	struct pollfd fd = {
+		.fd = client,
+		.events = POLLIN,
+		.revents = 0,
+	};
+	return poll(&fd, 1U, 0) > 0 && (fd.revents & (POLLHUP | POLLERR));
+}
+
+static bool daemon_read_request(const int client, char *const buffer, const size_t length)
+{
+	size_t offset = 0U;
+	while (offset + 1U < length) {
+		const ssize_t res = read(client, buffer + offset, length - offset - 1U);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		offset += (size_t)res;
+		if (memchr(buffer + offset - (size_t)res, '\n', (size_t)res))
+			break;
+	}
+	buffer[offset] = '\0';
+	char *const newline = strchr(buffer, '\n');
+	if (!newline)
+		return false;
+	*newline = '\0';
+	return true;
+}
+
+static bool daemon_parse_request(daemon_job_s *const job, const char **const error)
+{
+	char *state = NULL;
+	job->image_path = strtok_r(job->request, " \t\r", &state);
+	job->filter.serial = NULL;
+	job->filter.port = NULL;
+	if (!job->image_path) {
+		*error = "ERROR no image given\n";
+		return false;
+	}
+	for (char *token = strtok_r(NULL, " \t\r", &state); token; token = strtok_r(NULL, " \t\r", &state)) {
+		if (strncmp(token, "serial=", 7U) == 0)
+			job->filter.serial = token + 7U;
+		else if (strncmp(token, "port=", 5U) == 0)
+			job->filter.port = token + 5U;
+		else {
+			*error = "ERROR unknown job option\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+static void daemon_enqueue(daemon_s *const daemon, daemon_job_s *const job)
+{
+	job->next = NULL;
+	pthread_mutex_lock(&daemon->queue_lock);
+	if (daemon->queue_tail)
+		daemon->queue_tail->next = job;
+	else
+		daemon->queue_head = job;
+	daemon->queue_tail = job;
+	pthread_mutex_unlock(&daemon->queue_lock);
+}
+
+static daemon_job_s *daemon_dequeue(daemon_s *const daemon)
+{
+	pthread_mutex_lock(&daemon->queue_lock);
+	daemon_job_s *const job = daemon->queue_head;
+	if (job) {
+		daemon->queue_head = job->next;
+		if (!daemon->queue_head)
+			daemon->queue_tail = NULL;
+	}
+	pthread_mutex_unlock(&daemon->queue_lock);
+	return job;
+}
+
+/* Accept connections and turn each one into a queued job, so clients never wait on a flash to be heard */
+static void *daemon_listen(void *const arg)
+{
+	daemon_s *const daemon = (daemon_s *)arg;
+	while (!daemon_stop) {
+		struct pollfd fd = {
+			.fd = daemon->listener,
+			.events = POLLIN,
+			.revents = 0,
+		};
+		if (poll(&fd, 1U, DAEMON_POLL_MS) <= 0)
+			continue;
+		const int client = accept(daemon->listener, NULL, NULL);
+		if (client < 0)
+			continue;
+		/* Don't let a client that never finishes its request hold up everyone else */
+		const struct timeval timeout = {
+			.tv_sec = DAEMON_REQUEST_TIMEOUT_S,
+			.tv_usec = 0,
+		};
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		daemon_job_s *const job = malloc(sizeof(daemon_job_s));
+		if (!job) {
+			daemon_reply(client, "ERROR out of memory\n");
+			close(client);
+			continue;
+		}
+		job->client = client;
+		const char *error = "ERROR malformed request\n";
+		if (!daemon_read_request(client, job->request, sizeof(job->request)) || !daemon_parse_request(job, &error)) {
+			daemon_reply(client, error);
+			close(client);
+			free(job);
+			continue;
+		}
+		daemon_enqueue(daemon, job);
+	}
+	return NULL;
+}
+
+/*
+ * Find the firmware for a job, mapping it if it's new or has changed on disk since we last saw it.
+ * The least recently used mapping is dropped to make room once we're holding DAEMON_FIRMWARE_MAX files.
+ */
+static const stlink_firmware_s *daemon_firmware(daemon_s *const daemon, const char *const path)
+{
+	struct stat file_stat;
+	if (stat(path, &file_stat) < 0) {
+		const int error = errno;
+		fprintf(stderr, "Opening file failed (%d): %s\n", error, strerror(error));
+		return NULL;
+	}
+
+	daemon_firmware_s *entry = NULL;
+	for (size_t i = 0U; i < daemon->firmware_count; ++i) {
+		if (strcmp(daemon->firmware[i].path, path) == 0) {
+			entry = &daemon->firmware[i];
+			break;
+		}
+	}
+	if (entry) {
+		if (entry->size == file_stat.st_size && entry->mtime.tv_sec == file_stat.st_mtim.tv_sec &&
+			entry->mtime.tv_nsec == file_stat.st_mtim.tv_nsec) {
+			entry->last_used = ++daemon->clock;
+			return &entry->firmware;
+		}
+		stlink_firmware_close(&entry->firmware);
+	} else {
+		if (daemon->firmware_count == DAEMON_FIRMWARE_MAX) {
+			entry = &daemon->firmware[0];
+			for (size_t i = 1U; i < daemon->firmware_count; ++i) {
+				if (daemon->firmware[i].last_used < entry->last_used)
+					entry = &daemon->firmware[i];
+			}
+			stlink_firmware_close(&entry->firmware);
+			free(entry->path);
+		} else
+			entry = &daemon->firmware[daemon->firmware_count++];
+		entry->path = strdup(path);
+		if (!entry->path) {
+			*entry = daemon->firmware[--daemon->firmware_count];
+			return NULL;
+		}
+	}
+
+	if (!stlink_firmware_open(path, &entry->firmware)) {
+		free(entry->path);
+		*entry = daemon->firmware[--daemon->firmware_count];
+		return NULL;
+	}
+	entry->size = file_stat.st_size;
+	entry->mtime = file_stat.st_mtim;
+	entry->last_used = ++daemon->clock;
+	return &entry->firmware;
+}
+
+static void daemon_mark_done(daemon_s *const daemon, libusb_device *const dev)
+{
+	if (daemon->done_count == daemon->done_capacity) {
+		const size_t capacity = daemon->done_capacity ? daemon->done_capacity * 2U : 8U;
+		daemon_done_port_s *const done = realloc(daemon->done, capacity * sizeof(daemon_done_port_s));
+		if (!done)
+			return;
+		daemon->done = done;
+		daemon->done_capacity = capacity;
+	}
+	daemon_done_port_s *const port = &daemon->done[daemon->done_count++];
+	stlink_format_port_path(dev, port->path, sizeof(port->path));
+	port->flashed_us = time_us();
+}
+
+static bool daemon_port_match(libusb_device *const dev, const char *const path)
+{
+	char dev_path[STLINK_PORT_PATH_LENGTH];
+	stlink_format_port_path(dev, dev_path, sizeof(dev_path));
+	return strcmp(dev_path, path) == 0;
+}
+
+static bool daemon_is_done(libusb_device *const dev, void *const data)
+{
+	const daemon_s *const daemon = (const daemon_s *)data;
+	for (size_t i = 0U; i < daemon->done_count; ++i) {
+		if (daemon_port_match(dev, daemon->done[i].path))
+			return true;
+	}
+	return false;
+}
+
+/* Forget a flashed device's port once it's gone, as long as it's not just rebooting out of the bootloader */
+static void daemon_forget_port(daemon_s *const daemon, const char *const path, const uint64_t now)
+{
+	for (size_t i = 0U; i < daemon->done_count; ++i) {
+		daemon_done_port_s *const port = &daemon->done[i];
+		if (strcmp(port->path, path) == 0 && now - port->flashed_us >= DAEMON_REBOOT_GRACE_US) {
+			*port = daemon->done[--daemon->done_count];
+			return;
+		}
+	}
+}
+
+static int LIBUSB_CALL daemon_hotplug_left(
+	libusb_context *const ctx, libusb_device *const dev, const libusb_hotplug_event event, void *const user_data)
+{
+	(void)ctx;
+	(void)event;
+	char path[STLINK_PORT_PATH_LENGTH];
+	stlink_format_port_path(dev, path, sizeof(path));
+	daemon_forget_port((daemon_s *)user_data, path, time_us());
+	return 0;
+}
+
+/* Without hotplug support, notice unplugged devices by their port having gone quiet the next time we look */
+static void daemon_prune_done(daemon_s *const daemon)
+{
+	if (daemon->hotplug || !daemon->done_count)
+		return;
+	libusb_device **devs;
+	const ssize_t n_devs = libusb_get_device_list(daemon->ctx, &devs);
+	if (n_devs < 0)
+		return;
+	const uint64_t now = time_us();
+	for (size_t i = daemon->done_count; i-- > 0U;) {
+		bool present = false;
+		for (size_t j = 0U; devs[j] && !present; ++j)
+			present = daemon_port_match(devs[j], daemon->done[i].path);
+		if (!present)
+			daemon_forget_port(daemon, daemon->done[i].path, now);
+	}
+	libusb_free_device_list(devs, n_devs);
+}
+
+/* Run a job on the next matching device to show up, returning false if it should be abandoned instead */
+static bool daemon_dispatch(daemon_s *const daemon, daemon_job_s *const job)
+{
+	/*
+	 * Streams (pipes, URLs) and compressed images are read afresh as each device is flashed, rather than mapped
+	 * and kept - and a pipe isn't opened until then, as that would hold us up until something writes to it
+	 */
+	const bool streamed = stlink_stream_wanted(job->image_path);
+	const stlink_firmware_s *const firmware = streamed ? NULL : daemon_firmware(daemon, job->image_path);
+	if (!streamed && !firmware) {
+		daemon_reply(job->client, "ERROR cannot open image\n");
+		return false;
+	}
+	const stlink_job_s device_job = {
+		.probe = false,
+		.firmware_file = streamed ? job->image_path : NULL,
+		.firmware = firmware,
+		.flash_options = &daemon->flash_options,
+		.filter = &job->filter,
+		.timeout_ms = daemon->options->timeout_ms,
+	};
+	/* Only a serial number filter needs every device looking at, the rest can stop at the first one */
+	const stlink_discovery_options_s discovery = {
+		.all = job->filter.serial != NULL,
+		.jlink_switch = daemon->options->jlink_switch,
+		.filter = &job->filter,
+		.skip = daemon_is_done,
+		.skip_data = daemon,
+	};
+
+	stlink_device_list_s list = {0};
+	bool dispatched = false;
+	while (!daemon_stop && !dispatched) {
+		if (daemon_client_gone(job->client)) {
+			fprintf(stderr, "Client went away, dropping job for %s\n", job->image_path);
+			break;
+		}
+		daemon_prune_done(daemon);
+		if (!stlink_discover(daemon->ctx, &discovery, &list)) {
+			daemon_reply(job->client, "ERROR device discovery failed\n");
+			break;
+		}
+		for (size_t i = 0U; i < list.count && !dispatched; ++i) {
+			stlink_info_s *const info = &list.devices[i];
+			const int result = stlink_run_device(info, &device_job, false);
+			if (result == STLINK_RUN_FILTERED)
+				continue;
+			dispatched = true;
+			daemon_mark_done(daemon, libusb_get_device(info->stinfo_dev_handle));
+			char reply[32U + STLINK_ID_LENGTH];
+			char id[STLINK_ID_LENGTH];
+			stlink_format_id(info->id, id);
+			snprintf(reply, sizeof(reply), "%s %s\n", result == EXIT_SUCCESS ? "OK" : "ERROR flashing failed on", id);
+			daemon_reply(job->client, reply);
+		}
+		stlink_device_list_close(&list);
+		if (!dispatched)
+			stlink_wait_for_device(daemon->ctx, DAEMON_DEVICE_WAIT_MS);
+	}
+	stlink_device_list_free(&list);
+	return dispatched;
+}
+
+/* If nothing answers on an existing socket, it's left over from a previous run and can be replaced */
+static bool daemon_socket_stale(const struct sockaddr_un *const address)
+{
+	const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe < 0)
+		return false;
+	const bool stale = connect(probe, (const struct sockaddr *)address, sizeof(*address)) < 0 && errno == ECONNREFUSED;
+	close(probe);
+	return stale;
+}
+
+static int daemon_bind(const char *const path)
+{
+	struct sockaddr_un address = {0};
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return -1;
+	}
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		const int error = errno;
+		fprintf(stderr, "Failed to create socket (%d): %s\n", error, strerror(error));
+		return -1;
+	}
+	int res = bind(listener, (const struct sockaddr *)&address, sizeof(address));
+	if (res < 0 && errno == EADDRINUSE && daemon_socket_stale(&address)) {
+		unlink(path);
+		res = bind(listener, (const struct sockaddr *)&address, sizeof(address));
+	}
+	if (res < 0) {
+		const int error = errno;
+		fprintf(stderr, "Failed to bind %s (%d): %s\n", path, error, strerror(error));
+		close(listener);
+		return -1;
+	}
+	/*
+	 * A job names a file for us to open and flash, so only our own user may connect. Nobody can until we
+	 * listen, so tightening the socket's permissions first leaves no window open.
+	 */
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0) {
+		const int error = errno;
+		fprintf(stderr, "Failed to set permissions on %s (%d): %s\n", path, error, strerror(error));
+		close(listener);
+		unlink(path);
+		return -1;
+	}
+	if (listen(listener, DAEMON_BACKLOG) < 0) {
+		const int error = errno;
+		fprintf(stderr, "Failed to listen on %s (%d): %s\n", path, error, strerror(error));
+		close(listener);
+		unlink(path);
+		return -1;
+	}
+	return listener;
+}
+
+static void daemon_cleanup(daemon_s *const daemon)
+{
+	for (daemon_job_s *job = daemon_dequeue(daemon); job; job = daemon_dequeue(daemon)) {
+		daemon_reply(job->client, "ERROR daemon stopping\n");
+		close(job->client);
+		free(job);
+	}
+	pthread_mutex_destroy(&daemon->queue_lock);
+	for (size_t i = 0U; i < daemon->firmware_count; ++i) {
+		stlink_firmware_close(&daemon->firmware[i].firmware);
+		free(daemon->firmware[i].path);
+	}
+	if (daemon->hotplug)
+		libusb_hotplug_deregister_callback(daemon->ctx, daemon->hotplug_handle);
+	free(daemon->done);
+	stlink_image_pool_free(&daemon->pool);
+}
+
+int stlink_daemon_run(libusb_context *const ctx, const stlink_daemon_options_s *const options)
+{
+	daemon_s daemon = {0};
+	daemon.ctx = ctx;
+	daemon.options = options;
+	daemon.flash_options = options->flash_options;
+	daemon.flash_options.image_pool = &daemon.pool;
+	stlink_image_pool_init(&daemon.pool, options->pool_size);
+	pthread_mutex_init(&daemon.queue_lock, NULL);
+
+	/* A client hanging up on us mid-reply must not take the whole daemon down with it */
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction action = {0};
+	action.sa_handler = daemon_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	daemon.hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, daemon_hotplug_left, &daemon,
+			&daemon.hotplug_handle) == LIBUSB_SUCCESS;
+
+	daemon.listener = daemon_bind(options->socket_path);
+	if (daemon.listener < 0) {
+		daemon_cleanup(&daemon);
+		return EXIT_FAILURE;
+	}
+	if (pthread_create(&daemon.listener_thread, NULL, daemon_listen, &daemon) != 0) {
+		fprintf(stderr, "Failed to start listener thread\n");
+		close(daemon.listener);
+		unlink(options->socket_path);
+		daemon_cleanup(&daemon);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Waiting for jobs on %s\n", options->socket_path);
+
+	while (!daemon_stop) {
+		daemon_job_s *const job = daemon_dequeue(&daemon);
+		if (!job) {
+			/* Keep hotplug events flowing while idle so unplugged devices are noticed as they go */
+			if (daemon.hotplug) {
+				struct timeval timeout = {
+					.tv_sec = 0,
+					.tv_usec = DAEMON_POLL_MS * 1000U,
+				};
+				libusb_handle_events_timeout_completed(ctx, &timeout, NULL);
+			} else
+				sleep_us((uint64_t)DAEMON_POLL_MS * 1000U);
+			continue;
+		}
+		fprintf(stderr, "Job: %s\n", job->image_path);
+		if (!daemon_dispatch(&daemon, job) && daemon_stop)
+			daemon_reply(job->client, "ERROR daemon stopping\n");
+		close(job->client);
+		free(job);
+	}
+
+	fprintf(stderr, "Shutting down\n");
+	pthread_join(daemon.listener_thread, NULL);
+	close(daemon.listener);
+	unlink(options->socket_path);
+	daemon_cleanup(&daemon);
+	return EXIT_SUCCESS;
+}
+
+#else
+
+int stlink_daemon_run(libusb_context *const ctx, const stlink_daemon_options_s *const options)
+{
+	(void)ctx;
+	(void)options;
+	fprintf(stderr, "Daemon mode needs Unix sockets and is not available on this platform\n");
+	return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Default upper bound on the prepared images the daemon keeps in memory between jobs */
+#define STLINK_DAEMON_POOL_SIZE (256U * 1024U * 1024U)
+
+typedef struct stlink_daemon_options {
+	/* Path of the Unix socket to accept jobs on */
+	const char *socket_path;
+	/* Switch J-Links (converted ST-Links) back to the ST-Link bootloader when they turn up */
+	bool jlink_switch;
+	/* How to flash each job's image - the daemon adds its own in-memory image pool to these */
+	stlink_flash_options_s flash_options;
+	uint64_t pool_size;
+	/* How long each job gets on its device before it's given up on, in milliseconds (0 for no limit) */
+	uint32_t timeout_ms;
+} stlink_daemon_options_s;
+
+int stlink_daemon_run(libusb_context *ctx, const stlink_daemon_options_s *options);
+
+#endif /*DAEMON_H*/
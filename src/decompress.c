@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef STLINK_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef STLINK_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef STLINK_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "decompress.h"
+
+struct stlink_decompressor {
+	int fd;
+	stlink_codec_e codec;
+	/* Set once the first bytes have been read and the format worked out from them */
+	bool detected;
+	/* Input read but not yet decompressed (or, for an uncompressed image, the bytes read to detect that) */
+	uint8_t *input;
+	size_t input_offset;
+	size_t input_length;
+	bool input_eof;
+	/* Partway through a frame, so running out of input now means the image was cut short */
+	bool pending;
+	/* The last step filled all the output it was given, so the codec may still have more to give without input */
+	bool output_full;
+#ifdef STLINK_HAVE_ZLIB
+	z_stream zlib;
+	bool zlib_ready;
+#endif
+#ifdef STLINK_HAVE_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+#ifdef STLINK_HAVE_LZ4
+	LZ4F_dctx *lz4;
+#endif
+};
+
+/* Indexed by stlink_codec_e */
+static const char *const stlink_codec_names[] = {
+	"uncompressed",
+	"gzip",
+	"zstd",
+	"lz4",
+};
+
+stlink_codec_e stlink_codec_detect(const uint8_t *const data, const size_t length)
+{
+	if (length >= 2U && data[0] == 0x1fU && data[1] == 0x8bU)
+		return STLINK_CODEC_GZIP;
+	if (length >= 4U && data[0] == 0x28U && data[1] == 0xb5U && data[2] == 0x2fU && data[3] == 0xfdU)
+		return STLINK_CODEC_ZSTD;
+	if (length >= 4U && data[0] == 0x04U && data[1] == 0x22U && data[2] == 0x4dU && data[3] == 0x18U)
+		return STLINK_CODEC_LZ4;
+	return STLINK_CODEC_NONE;
+}
+
+const char *stlink_codec_name(const stlink_codec_e codec)
+{
+	return stlink_codec_names[codec];
+}
+
+/* Whether this build can decompress the given format - each library is only used if it was found at build time */
+bool stlink_codec_supported(const stlink_codec_e codec)
+{
+	switch (codec) {
+	case STLINK_CODEC_NONE:
+		return true;
+#ifdef STLINK_HAVE_ZLIB
+	case STLINK_CODEC_GZIP:
+		return true;
+#endif
+#ifdef STLINK_HAVE_ZSTD
+	case STLINK_CODEC_ZSTD:
+		return true;
+#endif
+#ifdef STLINK_HAVE_LZ4
+	case STLINK_CODEC_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+/* Set up a reader on fd. Nothing is read until the first stlink_decompressor_read(), so this never blocks */
+stlink_decompressor_s *stlink_decompressor_open(const int fd)
+{
+	stlink_decompressor_s *const decompressor = calloc(1U, sizeof(stlink_decompressor_s));
+	if (!decompressor)
+		return NULL;
+	decompressor->input = malloc(STLINK_DECOMPRESS_INPUT_SIZE);
+	if (!decompressor->input) {
+		free(decompressor);
+		return NULL;
+	}
+	decompressor->fd = fd;
+	return decompressor;
+}
+
+/* Read more input into the window, which must have been used up. Returns false (with errno set) on failure */
+static bool stlink_decompressor_fill(stlink_decompressor_s *const decompressor, const size_t offset)
+{
+	while (true) {
+		const ssize_t res = read(
+			decompressor->fd, decompressor->input + offset, STLINK_DECOMPRESS_INPUT_SIZE - offset);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return false;
+		decompressor->input_offset = 0U;
+		decompressor->input_length = offset + (size_t)res;
+		decompressor->input_eof = res == 0;
+		return true;
+	}
+}
+
+static bool stlink_decompressor_failed(const stlink_decompressor_s *const decompressor, const char *const reason)
+{
+	fprintf(stderr, "Decompressing %s firmware failed: %s\n", stlink_codec_name(decompressor->codec), reason);
+	errno = EIO;
+	return false;
+}
+
+/* Work out the format from the first few bytes of the image, and get ready to decompress it */
+static bool stlink_decompressor_detect(stlink_decompressor_s *const decompressor)
+{
+	while (decompressor->input_length < STLINK_CODEC_MAGIC_LENGTH && !decompressor->input_eof) {
+		if (!stlink_decompressor_fill(decompressor, decompressor->input_length))
+			return false;
+	}
+	decompressor->codec = stlink_codec_detect(decompressor->input, decompressor->input_length);
+	decompressor->detected = true;
+	if (!stlink_codec_supported(decompressor->codec)) {
+		fprintf(stderr, "Firmware is %s compressed, which this build of stlink-tool can't decompress\n",
+			stlink_codec_name(decompressor->codec));
+		errno = ENOTSUP;
+		return false;
+	}
+
+	switch (decompressor->codec) {
+#ifdef STLINK_HAVE_ZLIB
+	case STLINK_CODEC_GZIP:
+		/* 16 on top of the window size asks for a gzip wrapper rather than a zlib one */
+		if (inflateInit2(&decompressor->zlib, 15 + 16) != Z_OK)
+			return stlink_decompressor_failed(decompressor, "out of memory");
+		decompressor->zlib_ready = true;
+		break;
+#endif
+#ifdef STLINK_HAVE_ZSTD
+	case STLINK_CODEC_ZSTD:
+		decompressor->zstd = ZSTD_createDStream();
+		if (!decompressor->zstd || ZSTD_isError(ZSTD_initDStream(decompressor->zstd)))
+			return stlink_decompressor_failed(decompressor, "out of memory");
+		break;
+#endif
+#ifdef STLINK_HAVE_LZ4
+	case STLINK_CODEC_LZ4:
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&decompressor->lz4, LZ4F_VERSION)))
+			return stlink_decompressor_failed(decompressor, "out of memory");
+		break;
+#endif
+	default:
+		break;
+	}
+	return true;
+}
+
+/*
+ * Run the codec over some input, writing what it can to output. At the end of each frame (gzip member),
+ * pending is cleared so that the image is allowed to end there, or another frame may follow.
+ */
+static bool stlink_decompressor_step(stlink_decompressor_s *const decompressor, const uint8_t *const input,
+	const size_t input_length, size_t *const consumed, uint8_t *const output, const size_t output_length,
+	size_t *const produced)
+{
+	switch (decompressor->codec) {
+#ifdef STLINK_HAVE_ZLIB
+	case STLINK_CODEC_GZIP: {
+		z_stream *const zlib = &decompressor->zlib;
+		zlib->next_in = (Bytef *)input;
+		zlib->avail_in = (uInt)input_length;
+		zlib->next_out = output;
+		zlib->avail_out = (uInt)output_length;
+		const int res = inflate(zlib, Z_NO_FLUSH);
+		*consumed = input_length - zlib->avail_in;
+		*produced = output_length - zlib->avail_out;
+		if (res == Z_STREAM_END) {
+			decompressor->pending = false;
+			return inflateReset(zlib) == Z_OK || stlink_decompressor_failed(decompressor, "out of memory");
+		}
+		/* No progress being possible just means it needs more input */
+		if (res != Z_OK && res != Z_BUF_ERROR)
+			return stlink_decompressor_failed(decompressor, zlib->msg ? zlib->msg : "corrupt data");
+		break;
+	}
+#endif
+#ifdef STLINK_HAVE_ZSTD
+	case STLINK_CODEC_ZSTD: {
+		ZSTD_inBuffer in = {input, input_length, 0U};
+		ZSTD_outBuffer out = {output, output_length, 0U};
+		const size_t res = ZSTD_decompressStream(decompressor->zstd, &out, &in);
+		if (ZSTD_isError(res))
+			return stlink_decompressor_failed(decompressor, ZSTD_getErrorName(res));
+		*consumed = in.pos;
+		*produced = out.pos;
+		if (!res) {
+			decompressor->pending = false;
+			return true;
+		}
+		break;
+	}
+#endif
+#ifdef STLINK_HAVE_LZ4
+	case STLINK_CODEC_LZ4: {
+		size_t in = input_length;
+		size_t out = output_length;
+		const size_t res = LZ4F_decompress(decompressor->lz4, output, &out, input, &in, NULL);
+		if (LZ4F_isError(res))
+			return stlink_decompressor_failed(decompressor, LZ4F_getErrorName(res));
+		*consumed = in;
+		*produced = out;
+		if (!res) {
+			decompressor->pending = false;
+			return true;
+		}
+		break;
+	}
+#endif
+	default:
+		*consumed = 0U;
+		*produced = 0U;
+		return stlink_decompressor_failed(decompressor, "unsupported format");
+	}
+	if (*consumed || *produced)
+		decompressor->pending = true;
+	return true;
+}
+
+/*
+ * Read up to length bytes of the (decompressed) image, as read(2) does: returns how many bytes were read,
+ * 0 at the end of the image, or -1 with errno set if reading or decompressing failed - including the
+ * compressed data ending partway through a frame.
+ */
+ssize_t stlink_decompressor_read(stlink_decompressor_s *const decompressor, uint8_t *const buffer, const size_t length)
+{
+	if (!decompressor->detected && !stlink_decompressor_detect(decompressor))
+		return -1;
+	if (!length)
+		return 0;
+
+	/* Uncompressed images hand over what was read to detect the format, and are then read directly */
+	if (decompressor->codec == STLINK_CODEC_NONE) {
+		const size_t buffered = decompressor->input_length - decompressor->input_offset;
+		if (!buffered)
+			return decompressor->input_eof ? 0 : read(decompressor->fd, buffer, length);
+		const size_t amount = buffered < length ? buffered : length;
+		memcpy(buffer, decompressor->input + decompressor->input_offset, amount);
+		decompressor->input_offset += amount;
+		return (ssize_t)amount;
+	}
+
+	size_t produced = 0U;
+	while (!produced) {
+		/* Only go back for more input once the codec has given up everything it's holding on to */
+		if (decompressor->input_offset == decompressor->input_length && !decompressor->output_full) {
+			if (!decompressor->input_eof && !stlink_decompressor_fill(decompressor, 0U))
+				return -1;
+			if (decompressor->input_offset == decompressor->input_length) {
+				if (!decompressor->pending)
+					return 0;
+				stlink_decompressor_failed(decompressor, "image is truncated");
+				return -1;
+			}
+		}
+		size_t consumed = 0U;
+		if (!stlink_decompressor_step(decompressor, decompressor->input + decompressor->input_offset,
+				decompressor->input_length - decompressor->input_offset, &consumed, buffer, length, &produced))
+			return -1;
+		decompressor->input_offset += consumed;
+		decompressor->output_full = produced == length;
+	}
+	return (ssize_t)produced;
+}
+
+void stlink_decompressor_close(stlink_decompressor_s *const decompressor)
+{
+	if (!decompressor)
+		return;
+#ifdef STLINK_HAVE_ZLIB
+	if (decompressor->zlib_ready)
+		inflateEnd(&decompressor->zlib);
+#endif
+#ifdef STLINK_HAVE_ZSTD
+	ZSTD_freeDStream(decompressor->zstd);
+#endif
+#ifdef STLINK_HAVE_LZ4
+	LZ4F_freeDecompressionContext(decompressor->lz4);
+#endif
+	free(decompressor->input);
+	free(decompressor);
+}
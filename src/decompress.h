@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Enough of the start of an image to tell which (if any) of the compression formats it's in */
+#define STLINK_CODEC_MAGIC_LENGTH 4U
+/* How much compressed input is read at a time */
+#define STLINK_DECOMPRESS_INPUT_SIZE (64U * 1024U)
+
+typedef enum stlink_codec {
+	STLINK_CODEC_NONE,
+	STLINK_CODEC_GZIP,
+	STLINK_CODEC_ZSTD,
+	STLINK_CODEC_LZ4,
+} stlink_codec_e;
+
+/*
+ * Reads an image from a file descriptor, decompressing it on the way if it turns out to be gzip, zstd or
+ * lz4 (frame format) compressed. Which it is comes from the first few bytes, so uncompressed images just
+ * pass straight through. Only a bounded window of compressed input is held at any one time.
+ */
+typedef struct stlink_decompressor stlink_decompressor_s;
+
+stlink_codec_e stlink_codec_detect(const uint8_t *data, size_t length);
+const char *stlink_codec_name(stlink_codec_e codec);
+bool stlink_codec_supported(stlink_codec_e codec);
+stlink_decompressor_s *stlink_decompressor_open(int fd);
+ssize_t stlink_decompressor_read(stlink_decompressor_s *decompressor, uint8_t *buffer, size_t length);
+void stlink_decompressor_close(stlink_decompressor_s *decompressor);
+
+#endif /*DECOMPRESS_H*/
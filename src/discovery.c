@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "timing.h"
+#include "discovery.h"
+#include "buffer_pool.h"
+#include "profile.h"
+#include "trace.h"
+
+#define REENUMERATION_TIMEOUT_MS       5000U
+#define JLINK_REENUMERATION_TIMEOUT_MS 10000U
+#define REENUMERATION_POLL_MS          100U
+#define REENUMERATION_SETTLE_MS        100U
+
+/* Where a device sits on the bus, so we can recognise it again after it re-enumerates */
+typedef struct usb_port_path {
+	uint8_t bus;
+	uint8_t depth;
+	uint8_t ports[7U];
+	/* The product ID it had before being switched, so the old incarnation isn't mistaken for the new one */
+	uint16_t old_product_id;
+	bool arrived;
+} usb_port_path_s;
+
+/* The set of devices we've asked to re-enumerate and are waiting on */
+typedef struct reenumeration {
+	usb_port_path_s *devices;
+	size_t count;
+	size_t capacity;
+	size_t arrived;
+	uint32_t timeout_ms;
+	/* When set, any new ST-Link turning up anywhere satisfies the wait */
+	bool any_stlink;
+} reenumeration_s;
+
+void stlink_format_id(const uint8_t *const id, char *const buffer)
+{
+	for (size_t i = 0; i < 12U; i += 4U)
+		sprintf(buffer + (i * 2U), "%02X%02X%02X%02X", id[i + 3U], id[i + 2U], id[i + 1U], id[i + 0U]);
+}
+
+void stlink_format_port_path(libusb_device *const dev, char *const buffer, const size_t length)
+{
+	uint8_t ports[7U];
+	const int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int offset = snprintf(buffer, length, "%u", libusb_get_bus_number(dev));
+	for (int i = 0; i < depth && offset > 0 && (size_t)offset < length; ++i)
+		offset += snprintf(buffer + offset, length - (size_t)offset, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+bool stlink_filter_match_id(const stlink_device_filter_s *const filter, const uint8_t *const id)
+{
+	if (!filter || !filter->serial)
+		return true;
+	char id_string[STLINK_ID_LENGTH];
+	stlink_format_id(id, id_string);
+	return strcasecmp(id_string, filter->serial) == 0;
+}
+
+static bool stlink_filter_match_port(const stlink_device_filter_s *const filter, libusb_device *const dev)
+{
+	if (!filter || !filter->port)
+		return true;
+	char path[STLINK_PORT_PATH_LENGTH];
+	stlink_format_port_path(dev, path, sizeof(path));
+	return strcmp(path, filter->port) == 0;
+}
+
+/*
+ * Application mode ST-Links report their ID as the USB serial number, so check that before switching
+ * a device we've been told to leave alone. If the serial can't be read, assume it matches.
+ */
+static bool stlink_filter_match_serial(
+	const stlink_device_filter_s *const filter, libusb_device_handle *const handle, const uint8_t serial_index)
+{
+	if (!filter || !filter->serial || !serial_index)
+		return true;
+	unsigned char serial[64U];
+	if (libusb_get_string_descriptor_ascii(handle, serial_index, serial, sizeof(serial)) <= 0)
+		return true;
+	return strcasecmp((const char *)serial, filter->serial) == 0;
+}
+
+static void reenumeration_expect(
+	reenumeration_s *const wait, libusb_device *const dev, const uint16_t product_id, const uint32_t timeout_ms)
+{
+	if (wait->count == wait->capacity) {
+		const size_t capacity = wait->capacity ? wait->capacity * 2U : 8U;
+		usb_port_path_s *const devices = realloc(wait->devices, capacity * sizeof(usb_port_path_s));
+		if (!devices)
+			return;
+		wait->devices = devices;
+		wait->capacity = capacity;
+	}
+	usb_port_path_s *const path = &wait->devices[wait->count++];
+	const int depth = libusb_get_port_numbers(dev, path->ports, sizeof(path->ports));
+	path->bus = libusb_get_bus_number(dev);
+	path->depth = depth > 0 ? (uint8_t)depth : 0U;
+	path->old_product_id = product_id;
+	path->arrived = false;
+	if (timeout_ms > wait->timeout_ms)
+		wait->timeout_ms = timeout_ms;
+}
+
+/* Check a device against the ones we're waiting on and mark it arrived if it's one of them, come back */
+static void reenumeration_check(reenumeration_s *const wait, libusb_device *const dev)
+{
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return;
+	if (wait->any_stlink) {
+		if (desc.idVendor == VENDOR_ID_STLINK &&
+			(desc.idProduct & PRODUCT_ID_STLINK_MASK) == PRODUCT_ID_STLINK_GROUP)
+			wait->arrived = wait->count;
+		return;
+	}
+	uint8_t ports[7U];
+	const int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	const uint8_t bus = libusb_get_bus_number(dev);
+	for (size_t i = 0U; i < wait->count; ++i) {
+		usb_port_path_s *const path = &wait->devices[i];
+		if (path->arrived || path->bus != bus || path->depth != depth || desc.idProduct == path->old_product_id ||
+			memcmp(path->ports, ports, path->depth) != 0)
+			continue;
+		path->arrived = true;
+		++wait->arrived;
+	}
+}
+
+static int LIBUSB_CALL reenumeration_hotplug(
+	libusb_context *const ctx, libusb_device *const dev, const libusb_hotplug_event event, void *const user_data)
+{
+	(void)ctx;
+	(void)event;
+	reenumeration_check((reenumeration_s *)user_data, dev);
+	return 0;
+}
+
+/*
+ * Wait for every device in the set to come back on its port as something new, or for the timeout.
+ * Hotplug notifications let us carry on the moment they show up; where the platform doesn't support
+ * them we fall back to rescanning the bus at a short interval.
+ */
+static void reenumeration_wait(libusb_context *const ctx, reenumeration_s *const wait, const bool enumerate)
+{
+	const uint64_t start = time_us();
+	const uint64_t deadline = start + ((uint64_t)wait->timeout_ms * 1000U);
+	libusb_hotplug_callback_handle handle;
+	const bool hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			enumerate ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, reenumeration_hotplug, wait,
+			&handle) == LIBUSB_SUCCESS;
+
+	while (wait->arrived < wait->count) {
+		const uint64_t now = time_us();
+		if (now >= deadline)
+			break;
+		if (hotplug) {
+			const uint64_t remaining = deadline - now;
+			struct timeval timeout = {
+				.tv_sec = (long)(remaining / 1000000U),
+				.tv_usec = (long)(remaining % 1000000U),
+			};
+			libusb_handle_events_timeout_completed(ctx, &timeout, NULL);
+		} else {
+			sleep_us((uint64_t)REENUMERATION_POLL_MS * 1000U);
+			libusb_device **devs;
+			const ssize_t n_devs = libusb_get_device_list(ctx, &devs);
+			if (n_devs < 0)
+				continue;
+			for (size_t i = 0U; devs[i]; ++i)
+				reenumeration_check(wait, devs[i]);
+			libusb_free_device_list(devs, n_devs);
+		}
+	}
+
+	if (hotplug)
+		libusb_hotplug_deregister_callback(ctx, handle);
+	if (wait->arrived >= wait->count)
+		/* Give the OS a moment to finish setting up the new device node before we try to open it */
+		sleep_us((uint64_t)REENUMERATION_SETTLE_MS * 1000U);
+	stlink_trace_event(NULL, "reenumeration_wait", start, "\"devices\":%zu,\"arrived\":%zu,\"hotplug\":%s",
+		wait->count, wait->arrived, hotplug ? "true" : "false");
+}
+
+static void stlink_reenumerate(libusb_context *const ctx, reenumeration_s *const wait)
+{
+	fprintf(stderr, "Waiting for re-enumeration...\n");
+	reenumeration_wait(ctx, wait, true);
+	if (wait->arrived < wait->count)
+		fprintf(stderr, "%zu of %zu devices did not re-enumerate in time\n", wait->count - wait->arrived, wait->count);
+	wait->count = 0U;
+	wait->arrived = 0U;
+	wait->timeout_ms = 0U;
+}
+
+/* Wait for a new ST-Link to be plugged in (or re-enumerate), returning false on timeout */
+bool stlink_wait_for_device(libusb_context *const ctx, const uint32_t timeout_ms)
+{
+	reenumeration_s wait = {
+		.devices = NULL,
+		.count = 1U,
+		.capacity = 0U,
+		.arrived = 0U,
+		.timeout_ms = timeout_ms,
+		.any_stlink = true,
+	};
+	/* Only new arrivals count here, so don't ask for the devices already present */
+	reenumeration_wait(ctx, &wait, false);
+	return wait.arrived >= wait.count;
+}
+
+static bool stlink_device_list_append(stlink_device_list_s *const list, const stlink_info_s *const info)
+{
+	if (list->count == list->capacity) {
+		const size_t capacity = list->capacity ? list->capacity * 2U : 8U;
+		stlink_info_s *const devices = realloc(list->devices, capacity * sizeof(stlink_info_s));
+		if (!devices)
+			return false;
+		list->devices = devices;
+		list->capacity = capacity;
+	}
+	list->devices[list->count++] = *info;
+	return true;
+}
+
+void stlink_device_list_close(stlink_device_list_s *const list)
+{
+	for (size_t i = 0U; i < list->count; ++i) {
+		stlink_buffer_pool_free(&list->devices[i].stinfo_buffers);
+		libusb_close(list->devices[i].stinfo_dev_handle);
+	}
+	list->count = 0U;
+}
+
+void stlink_device_list_free(stlink_device_list_s *const list)
+{
+	stlink_device_list_close(list);
+	free(list->devices);
+	list->devices = NULL;
+	list->capacity = 0U;
+}
+
+/*
+ * Scan the bus for ST-Links in bootloader mode, opening them and adding them to the list. Devices in
+ * application mode (and BMPs, and J-Links if requested) are switched to their bootloader first. When
+ * collecting every device, those switches are batched up so we only wait for re-enumeration once.
+ * Returns false if something went wrong badly enough that carrying on makes no sense.
+ */
+bool stlink_discover(
+	libusb_context *const ctx, const stlink_discovery_options_s *const options, stlink_device_list_s *const list)
+{
+	const bool gang = options->all;
+	const stlink_device_filter_s *const filter = options->filter;
+	bool jlink_switch = options->jlink_switch;
+	reenumeration_s reenumeration = {0};
+	stlink_info_s info;
+	info.stinfo_usb_ctx = ctx;
+	info.stinfo_transport = NULL;
+	info.stinfo_session.active = false;
+	info.stinfo_buffers = (stlink_buffer_pool_s){0};
+	info.stinfo_link = NULL;
+	info.stinfo_link_held = 0U;
+	info.stinfo_deadline_us = 0U;
+	atomic_init(&info.stinfo_cancelled, false);
+	const uint64_t start = time_us();
+rescan:
+	info.stinfo_dev_handle = NULL;
+	libusb_device **devs;
+	ssize_t n_devs = libusb_get_device_list(ctx, &devs);
+	if (n_devs < 0) {
+		free(reenumeration.devices);
+		return false;
+	}
+
+	for (size_t i = 0U; devs[i]; i++) {
+		libusb_device *dev = devs[i];
+		struct libusb_device_descriptor desc;
+		int res = libusb_get_device_descriptor(dev, &desc);
+		if (res < 0 || !stlink_filter_match_port(filter, dev))
+			continue;
+		if (options->skip && options->skip(dev, options->skip_data))
+			continue;
+		if ((desc.idVendor == OPENMOKO_VID) && (desc.idProduct == BMP_APPL_PID)) {
+			fprintf(stderr, "Trying to switch BMP/Application to bootloader\n");
+			res = libusb_open(dev, &info.stinfo_dev_handle);
+			if (res < 0) {
+				fprintf(stderr, "Can not open BMP/Application!\n");
+				continue;
+			}
+			if (!stlink_filter_match_serial(filter, info.stinfo_dev_handle, desc.iSerialNumber)) {
+				libusb_close(info.stinfo_dev_handle);
+				info.stinfo_dev_handle = NULL;
+				continue;
+			}
+			libusb_claim_interface(info.stinfo_dev_handle, BMP_DFU_IF);
+			res = libusb_control_transfer(info.stinfo_dev_handle,
+				/* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+				/* bRequest      */ 0, /*DFU_DETACH,*/
+				/* wValue        */ 1000,
+				/* wIndex        */ BMP_DFU_IF,
+				/* Data          */ NULL,
+				/* wLength       */ 0, 5000);
+			libusb_release_interface(info.stinfo_dev_handle, 0);
+			libusb_close(info.stinfo_dev_handle);
+			info.stinfo_dev_handle = NULL;
+			if (res < 0) {
+				fprintf(stderr, "BMP Switch failed\n");
+				continue;
+			}
+			reenumeration_expect(&reenumeration, dev, desc.idProduct, REENUMERATION_TIMEOUT_MS);
+			if (gang)
+				continue;
+			libusb_free_device_list(devs, n_devs);
+			stlink_reenumerate(ctx, &reenumeration);
+			goto rescan;
+		}
+		/* Handle J-Link devices (converted ST-Links) */
+		if (jlink_switch && desc.idVendor == VENDOR_ID_SEGGER) {
+			fprintf(stderr, "Found SEGGER device (VID:PID = %04X:%04X)\n", desc.idVendor, desc.idProduct);
+			fprintf(stderr, "Attempting to switch J-Link to ST-Link bootloader...\n");
+			res = libusb_open(dev, &info.stinfo_dev_handle);
+			if (res < 0) {
+				fprintf(stderr, "Cannot open J-Link device: %s\n", libusb_strerror(res));
+				continue;
+			}
+			if (libusb_claim_interface(info.stinfo_dev_handle, 0)) {
+				fprintf(stderr, "Unable to claim USB interface. Please close all programs that "
+					"may communicate with the J-Link.\n");
+				libusb_close(info.stinfo_dev_handle);
+				continue;
+			}
+			res = jlink_switch_to_stlink_bootloader(info.stinfo_dev_handle);
+			libusb_release_interface(info.stinfo_dev_handle, 0);
+			libusb_close(info.stinfo_dev_handle);
+			info.stinfo_dev_handle = NULL;
+			if (res == 0) {
+				fprintf(stderr, "Success! Device should now re-enumerate as ST-Link in DFU mode.\n");
+				reenumeration_expect(&reenumeration, dev, desc.idProduct, JLINK_REENUMERATION_TIMEOUT_MS);
+				if (gang)
+					continue;
+				libusb_free_device_list(devs, n_devs);
+				stlink_reenumerate(ctx, &reenumeration);
+				jlink_switch = false; /* Don't try again on rescan */
+				goto rescan;
+			} else {
+				fprintf(stderr, "Failed to switch to ST-Link bootloader.\n");
+				if (gang)
+					continue;
+				libusb_free_device_list(devs, n_devs);
+				free(reenumeration.devices);
+				return false;
+			}
+		}
+		if (desc.idVendor != VENDOR_ID_STLINK || (desc.idProduct & PRODUCT_ID_STLINK_MASK) != PRODUCT_ID_STLINK_GROUP)
+			continue;
+		switch (desc.idProduct) {
+		case PRODUCT_ID_STLINKV21:
+		case PRODUCT_ID_STLINKV21_MSD:
+		case PRODUCT_ID_STLINKV3:
+		case PRODUCT_ID_STLINKV3_NO_MSD:
+		case PRODUCT_ID_STLINKV3E:
+			res = libusb_open(dev, &info.stinfo_dev_handle);
+			if (res < 0) {
+				fprintf(stderr, "Can not open ST-Link/Application!\n");
+				continue;
+			}
+			if (!stlink_filter_match_serial(filter, info.stinfo_dev_handle, desc.iSerialNumber)) {
+				libusb_close(info.stinfo_dev_handle);
+				info.stinfo_dev_handle = NULL;
+				continue;
+			}
+			fprintf(stderr, "Trying to switch ST-Link/Application to bootloader\n");
+			if (libusb_claim_interface(info.stinfo_dev_handle, 0)) {
+				fprintf(stderr,
+					"Unable to claim USB interface. Please close all programs that "
+					"may communicate with an ST-Link dongle.\n");
+				libusb_close(info.stinfo_dev_handle);
+				info.stinfo_dev_handle = NULL;
+				continue;
+			}
+			const uint16_t mode = stlink_dfu_mode(info.stinfo_dev_handle, false);
+			if (mode != 0x8000U) {
+				fprintf(stderr, "ST-Link/Application can not switch to bootloader, skipping\n");
+				libusb_release_interface(info.stinfo_dev_handle, 0);
+				libusb_close(info.stinfo_dev_handle);
+				info.stinfo_dev_handle = NULL;
+				continue;
+			}
+			stlink_dfu_mode(info.stinfo_dev_handle, true);
+			libusb_release_interface(info.stinfo_dev_handle, 0);
+			libusb_close(info.stinfo_dev_handle);
+			info.stinfo_dev_handle = NULL;
+			reenumeration_expect(&reenumeration, dev, desc.idProduct, REENUMERATION_TIMEOUT_MS);
+			if (gang)
+				continue;
+			libusb_free_device_list(devs, n_devs);
+			stlink_reenumerate(ctx, &reenumeration);
+			goto rescan;
+		default: {
+			/* Anything else is a bootloader, if there's a profile for it */
+			const stlink_profile_s *const profile = stlink_profile_find(desc.idProduct, 0U);
+			if (!profile) {
+				fprintf(stderr, "Unknown STM PID %x, please report\n", desc.idProduct);
+				break;
+			}
+			res = libusb_open(dev, &info.stinfo_dev_handle);
+			if (res < 0) {
+				fprintf(stderr, "Can not open ST-Link %s Bootloader!\n", profile->name);
+				continue;
+			}
+			info.stinfo_ep_in = profile->ep_in;
+			info.stinfo_ep_out = profile->ep_out;
+			info.stinfo_profile = profile;
+			fprintf(stderr, "ST-Link %s Bootloader found\n", profile->name);
+			break;
+		}
+		}
+		if (info.stinfo_dev_handle) {
+			if (!stlink_device_list_append(list, &info)) {
+				fprintf(stderr, "Failed to allocate device list, skipping device\n");
+				libusb_close(info.stinfo_dev_handle);
+			}
+			info.stinfo_dev_handle = NULL;
+			if (!gang)
+				break;
+		}
+	}
+	libusb_free_device_list(devs, n_devs);
+
+	if (reenumeration.count) {
+		/* Some devices are re-enumerating, so drop what we have and look again once they're back */
+		stlink_device_list_close(list);
+		stlink_reenumerate(ctx, &reenumeration);
+		jlink_switch = false; /* Don't try again on rescan */
+		goto rescan;
+	}
+	free(reenumeration.devices);
+	stlink_trace_event(NULL, "enumerate", start, "\"devices\":%zu", list->count);
+	return true;
+}
+
+/* Nothing but an ST-Link can be the device coming back, so anything else on its port is left well alone */
+static bool stlink_reconnect_skip(libusb_device *const dev, void *const data)
+{
+	(void)data;
+	struct libusb_device_descriptor desc;
+	return libusb_get_device_descriptor(dev, &desc) < 0 || desc.idVendor != VENDOR_ID_STLINK;
+}
+
+/*
+ * Find a device again after it dropped off the bus partway through a job, and swap it in for the stale
+ * handle in info. It may come back in application mode (which discovery switches back to the bootloader)
+ * or straight into its bootloader, where only reading its ID tells it apart from any other ST-Link.
+ * Only the port it dropped off is looked at, so the rest of the bus (other workers' devices included)
+ * is never opened or switched. Everything else in info, such as the flash session, is kept. Returns
+ * false if it didn't reappear in time.
+ */
+bool stlink_reconnect(stlink_info_s *const info, const uint32_t timeout_ms)
+{
+	char id[STLINK_ID_LENGTH];
+	stlink_format_id(info->id, id);
+	/* The stale handle still knows where on the bus the device was */
+	char port[STLINK_PORT_PATH_LENGTH];
+	stlink_format_port_path(libusb_get_device(info->stinfo_dev_handle), port, sizeof(port));
+	const stlink_device_filter_s filter = {
+		.serial = id,
+		.port = port,
+	};
+	const stlink_discovery_options_s options = {
+		.all = true,
+		.jlink_switch = false,
+		.filter = &filter,
+		.skip = stlink_reconnect_skip,
+		.skip_data = NULL,
+	};
+	stlink_buffer_pool_free(&info->stinfo_buffers);
+	libusb_close(info->stinfo_dev_handle);
+	info->stinfo_dev_handle = NULL;
+
+	const uint64_t start = time_us();
+	const uint64_t deadline = start + ((uint64_t)timeout_ms * 1000U);
+	bool found = false;
+	while (!found && time_us() < deadline) {
+		stlink_device_list_s list = {0};
+		if (stlink_discover(info->stinfo_usb_ctx, &options, &list)) {
+			for (size_t i = 0U; !found && i < list.count; ++i) {
+				stlink_info_s candidate = list.devices[i];
+				/* Devices already in use by another worker can't be claimed, which rules them out anyway */
+				if (libusb_claim_interface(candidate.stinfo_dev_handle, 0))
+					continue;
+				found = stlink_read_info(&candidate) && memcmp(candidate.id, info->id, sizeof(info->id)) == 0;
+				libusb_release_interface(candidate.stinfo_dev_handle, 0);
+				if (!found)
+					continue;
+				info->stinfo_dev_handle = candidate.stinfo_dev_handle;
+				info->stinfo_ep_in = candidate.stinfo_ep_in;
+				info->stinfo_ep_out = candidate.stinfo_ep_out;
+				info->stinfo_profile = candidate.stinfo_profile;
+				/* The list no longer owns this one */
+				list.devices[i] = list.devices[--list.count];
+			}
+		}
+		stlink_device_list_free(&list);
+		if (!found)
+			sleep_us((uint64_t)REENUMERATION_POLL_MS * 1000U);
+	}
+	stlink_trace_event(info, "reconnect", start, "\"found\":%s", found ? "true" : "false");
+	return found;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define VENDOR_ID_STLINK           0x0483U
+#define PRODUCT_ID_STLINK_MASK     0xffe0U
+#define PRODUCT_ID_STLINK_GROUP    0x3740U
+#define PRODUCT_ID_STLINKV2        0x3748U
+#define PRODUCT_ID_STLINKV21       0x374bU
+#define PRODUCT_ID_STLINKV21_MSD   0x3752U
+#define PRODUCT_ID_STLINKV3_NO_MSD 0x3754U
+#define PRODUCT_ID_STLINKV3_BL     0x374dU
+#define PRODUCT_ID_STLINKV3        0x374fU
+#define PRODUCT_ID_STLINKV3E       0x374eU
+
+#define OPENMOKO_VID 0x1d50
+#define BMP_APPL_PID 0x6018
+#define BMP_DFU_IF   4
+
+#define VENDOR_ID_SEGGER      0x1366U
+#define PRODUCT_ID_JLINK      0x0101U
+#define PRODUCT_ID_JLINK_PLUS 0x0105U
+
+/* Long enough for "bus-port.port.port..." with the 7 levels of hubs USB allows */
+#define STLINK_PORT_PATH_LENGTH 32U
+/* How long to wait for a device that dropped off the bus mid-flash to come back */
+#define STLINK_RECONNECT_TIMEOUT_MS 10000U
+/* 12 byte ST-Link ID as hex, plus the terminator */
+#define STLINK_ID_LENGTH 25U
+
+/* Restricts discovery to particular devices. Either member may be NULL to match anything */
+typedef struct stlink_device_filter {
+	/* ST-Link ID (as printed by the probe) or application mode USB serial number */
+	const char *serial;
+	/* Physical location on the bus, as "bus-port.port..." (e.g. "1-2.4") */
+	const char *port;
+} stlink_device_filter_s;
+
+struct stlink_info;
+
+/* A set of bootloader mode ST-Links that have been opened (but not claimed) */
+typedef struct stlink_device_list {
+	struct stlink_info *devices;
+	size_t count;
+	size_t capacity;
+} stlink_device_list_s;
+
+/* Lets the caller pass over devices it already knows about, returning true to skip the device */
+typedef bool (*stlink_device_skip_t)(libusb_device *dev, void *data);
+
+typedef struct stlink_discovery_options {
+	/* Collect every matching device rather than stopping at the first one */
+	bool all;
+	/* Switch J-Links (converted ST-Links) back to the ST-Link bootloader */
+	bool jlink_switch;
+	const stlink_device_filter_s *filter;
+	stlink_device_skip_t skip;
+	void *skip_data;
+} stlink_discovery_options_s;
+
+bool stlink_discover(libusb_context *ctx, const stlink_discovery_options_s *options, stlink_device_list_s *list);
+void stlink_device_list_close(stlink_device_list_s *list);
+void stlink_device_list_free(stlink_device_list_s *list);
+bool stlink_wait_for_device(libusb_context *ctx, uint32_t timeout_ms);
+bool stlink_reconnect(struct stlink_info *info, uint32_t timeout_ms);
+
+void stlink_format_id(const uint8_t *id, char *buffer);
+void stlink_format_port_path(libusb_device *dev, char *buffer, size_t length);
+bool stlink_filter_match_id(const stlink_device_filter_s *filter, const uint8_t *id);
+
+#endif /*DISCOVERY_H*/
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "image.h"
+#include "profile.h"
+#include "buffer_pool.h"
+#include "discovery.h"
+#include "dump.h"
+#include "timing.h"
+#include "trace.h"
+
+#define DUMP_HEX_RECORD_SIZE 16U
+
+#define IHEX_DATA                   0x00U
+#define IHEX_END_OF_FILE            0x01U
+#define IHEX_EXTENDED_LINEAR_ADDRESS 0x04U
+
+/* Where a read-out is going, and what's been held back from it */
+typedef struct stlink_dump {
+	FILE *file;
+	bool hex;
+	bool skip_blank;
+	/* Blank blocks not yet written to a raw binary, in case they turn out to be the end of the flash */
+	size_t held_blank;
+	/* The upper 16 address bits of the last Intel HEX extended linear address record */
+	uint32_t upper_address;
+	size_t blocks;
+	size_t blank_blocks;
+} stlink_dump_s;
+
+/*
+ * Build the file name for a device's read-out, substituting its ST-Link ID for the first {id} in name.
+ * Returns false if the result doesn't fit.
+ */
+bool stlink_dump_path(const char *const name, const uint8_t *const id, char *const path, const size_t length)
+{
+	const char *const placeholder = strstr(name, STLINK_DUMP_ID_PLACEHOLDER);
+	int res;
+	if (placeholder) {
+		char formatted_id[STLINK_ID_LENGTH];
+		stlink_format_id(id, formatted_id);
+		res = snprintf(path, length, "%.*s%s%s", (int)(placeholder - name), name, formatted_id,
+			placeholder + strlen(STLINK_DUMP_ID_PLACEHOLDER));
+	} else
+		res = snprintf(path, length, "%s", name);
+	return res >= 0 && (size_t)res < length;
+}
+
+static char *stlink_dump_hex_byte(char *const out, const uint8_t value, uint8_t *const checksum)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	*checksum += value;
+	out[0] = digits[value >> 4U];
+	out[1] = digits[value & 0x0fU];
+	return out + 2U;
+}
+
+static bool stlink_dump_hex_record(
+	FILE *const file, const uint8_t type, const uint16_t address, const uint8_t *const data, const size_t length)
+{
+	char line[1U + (2U * (4U + DUMP_HEX_RECORD_SIZE + 1U)) + 1U];
+	uint8_t checksum = 0U;
+	char *out = line;
+	*out++ = ':';
+	out = stlink_dump_hex_byte(out, (uint8_t)length, &checksum);
+	out = stlink_dump_hex_byte(out, (uint8_t)(address >> 8U), &checksum);
+	out = stlink_dump_hex_byte(out, (uint8_t)address, &checksum);
+	out = stlink_dump_hex_byte(out, type, &checksum);
+	for (size_t i = 0U; i < length; ++i)
+		out = stlink_dump_hex_byte(out, data[i], &checksum);
+	uint8_t unused = 0U;
+	out = stlink_dump_hex_byte(out, (uint8_t)(0x100U - checksum), &unused);
+	*out++ = '\n';
+	const size_t line_length = (size_t)(out - line);
+	return fwrite(line, 1U, line_length, file) == line_length;
+}
+
+/* Write a block out as Intel HEX data records, leaving out any record's worth of blank flash if asked to */
+static bool stlink_dump_hex_block(
+	stlink_dump_s *const dump, const uint32_t address, const uint8_t *const block, const size_t length)
+{
+	for (size_t offset = 0U; offset < length; offset += DUMP_HEX_RECORD_SIZE) {
+		const uint8_t *const data = block + offset;
+		const size_t amount = length - offset < DUMP_HEX_RECORD_SIZE ? length - offset : DUMP_HEX_RECORD_SIZE;
+		if (dump->skip_blank && stlink_block_blank(data, amount))
+			continue;
+		const uint32_t record_address = address + (uint32_t)offset;
+		if ((record_address >> 16U) != dump->upper_address) {
+			dump->upper_address = record_address >> 16U;
+			const uint8_t upper[2] = {(uint8_t)(dump->upper_address >> 8U), (uint8_t)dump->upper_address};
+			if (!stlink_dump_hex_record(dump->file, IHEX_EXTENDED_LINEAR_ADDRESS, 0U, upper, sizeof(upper)))
+				return false;
+		}
+		if (!stlink_dump_hex_record(dump->file, IHEX_DATA, (uint16_t)record_address, data, amount))
+			return false;
+	}
+	return true;
+}
+
+/* Write a block to a raw binary, catching up on any blank blocks held back now there's something after them */
+static bool stlink_dump_raw_block(stlink_dump_s *const dump, const uint8_t *const block, const size_t length)
+{
+	if (dump->skip_blank && stlink_block_blank(block, length)) {
+		++dump->held_blank;
+		return true;
+	}
+	if (dump->held_blank) {
+		uint8_t erased[STLINK_MAX_CHUNK_SIZE];
+		memset(erased, 0xff, length);
+		for (; dump->held_blank; --dump->held_blank) {
+			if (fwrite(erased, 1U, length, dump->file) != length)
+				return false;
+		}
+	}
+	return fwrite(block, 1U, length, dump->file) == length;
+}
+
+static int stlink_dump_sink(void *const data, const uint32_t address, const uint8_t *const block, const size_t length)
+{
+	stlink_dump_s *const dump = (stlink_dump_s *)data;
+	++dump->blocks;
+	if (stlink_block_blank(block, length))
+		++dump->blank_blocks;
+	const bool written = dump->hex ? stlink_dump_hex_block(dump, address, block, length) :
+									 stlink_dump_raw_block(dump, block, length);
+	if (!written) {
+		const int error = errno;
+		fprintf(stderr, "Writing firmware read-out failed (%d): %s\n", error, strerror(error));
+		return -5;
+	}
+	return 0;
+}
+
+static bool stlink_dump_is_hex(const char *const filename)
+{
+	const size_t length = strlen(filename);
+	return (length >= 4U && strcasecmp(filename + length - 4U, ".hex") == 0) ||
+		(length >= 5U && strcasecmp(filename + length - 5U, ".ihex") == 0);
+}
+
+/*
+ * Read the whole application area back out of the device, streaming it to filename ("-" for stdout)
+ * block by block as the uploads come in. Names ending in .hex get Intel HEX, anything else a raw binary
+ * that can be flashed straight back. Nothing is kept beyond the two blocks the read-back has in flight.
+ */
+int stlink_dump(stlink_info_s *const info, const char *const filename, const stlink_dump_options_s *const options)
+{
+	const stlink_profile_s *const profile = info->stinfo_profile;
+	const size_t chunk_size = options->chunk_size ? options->chunk_size : stlink_max_chunk_size(info);
+	const uint32_t flash_end = profile->flash_base + profile->flash_size;
+	const size_t count = (flash_end - profile->app_base) / chunk_size;
+
+	const bool to_stdout = strcmp(filename, "-") == 0;
+	FILE *const file = to_stdout ? stdout : fopen(filename, "wb");
+	if (!file) {
+		const int error = errno;
+		fprintf(stderr, "Opening %s for the firmware read-out failed (%d): %s\n", filename, error, strerror(error));
+		return -1;
+	}
+	stlink_dump_s dump = {
+		.file = file,
+		.hex = !to_stdout && stlink_dump_is_hex(filename),
+		.skip_blank = options->skip_blank,
+		.held_blank = 0U,
+		.upper_address = UINT32_MAX,
+		.blocks = 0U,
+		.blank_blocks = 0U,
+	};
+
+	const uint64_t start = time_us();
+	stlink_buffer_pool_reserve(info, 2U * chunk_size);
+	int res = stlink_read_flash(
+		info, profile->app_base, count, chunk_size, options->block_addressing, stlink_dump_sink, &dump);
+	stlink_buffer_pool_reset(&info->stinfo_buffers);
+	if (!res && dump.hex && !stlink_dump_hex_record(file, IHEX_END_OF_FILE, 0U, NULL, 0U))
+		res = -5;
+	if ((to_stdout ? fflush(file) : fclose(file)) && !res) {
+		const int error = errno;
+		fprintf(stderr, "Writing firmware read-out failed (%d): %s\n", error, strerror(error));
+		res = -5;
+	}
+	const uint64_t elapsed_us = time_us() - start;
+	stlink_trace_event(info, "dump", start, "\"blocks\":%zu,\"blank\":%zu,\"result\":%d", dump.blocks,
+		dump.blank_blocks, res);
+	if (res) {
+		fprintf(stderr, "Firmware read-out failed after %zu of %zu blocks\n", dump.blocks, count);
+		return res;
+	}
+
+	const size_t kib = (dump.blocks * chunk_size) / 1024U;
+	const double seconds = (double)elapsed_us / 1000000.0;
+	fprintf(stderr, "Read %zu KiB from 0x%08" PRIx32 " in %.3fs (%.1f KiB/s)", kib, profile->app_base, seconds,
+		seconds > 0.0 ? (double)kib / seconds : 0.0);
+	/* Blank blocks in the middle of a raw binary still have to be there to keep everything after them in place */
+	const size_t left_out = dump.hex ? dump.blank_blocks : dump.held_blank;
+	if (options->skip_blank && left_out)
+		fprintf(stderr, ", leaving out %zu blank blocks", left_out);
+	fprintf(stderr, "\n");
+	return 0;
+}
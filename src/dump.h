@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Stands in for the ST-Link ID in a read-out file name, so each device of a gang run gets its own file */
+#define STLINK_DUMP_ID_PLACEHOLDER "{id}"
+
+typedef struct stlink_dump_options {
+	/* Upload block size to use, or 0 to use the largest the bootloader is known to accept */
+	size_t chunk_size;
+	/* Address sequential blocks by block number, reading them back to back rather than one at a time */
+	bool block_addressing;
+	/* Leave out blank (all 0xff) flash: dropped off the end of a raw binary, and from anywhere in Intel HEX */
+	bool skip_blank;
+} stlink_dump_options_s;
+
+bool stlink_dump_path(const char *name, const uint8_t *id, char *path, size_t length);
+int stlink_dump(stlink_info_s *info, const char *filename, const stlink_dump_options_s *options);
+
+#endif /*DUMP_H*/
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef FLASH_OPTIONS_H
+#define FLASH_OPTIONS_H
+
+/*
+ * What callers say about how to flash, and hear back about how it's going. Kept apart from stlink.h
+ * (which includes this) as it's part of the public interface in stlinktool.h, where the device itself
+ * is opaque.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct stlink_info;
+struct stlink_image_pool;
+
+/* How far through flashing an image we are, as reported to a progress callback */
+typedef struct stlink_progress {
+	size_t blocks_written;
+	/* Left alone as they match what's already on the device (differential flashing) */
+	size_t blocks_skipped;
+	/* Left alone as they're all 0xff, which the erase already took care of */
+	size_t blocks_blank;
+	/* Read back and found to match the image, once programming is done (verify) */
+	size_t blocks_verified;
+	size_t blocks_total;
+	/* Set on the last report for a flash, whether or not it succeeded */
+	bool finished;
+} stlink_progress_s;
+
+/*
+ * Called from whichever thread is doing the flashing, after every block written and once more when
+ * programming ends. It holds up the USB traffic while it runs, so it should hand anything slow off elsewhere.
+ */
+typedef void (*stlink_progress_cb_t)(const struct stlink_info *info, const stlink_progress_s *progress, void *data);
+
+typedef struct stlink_flash_options {
+	/* Directory to keep prepared images in between runs, or NULL to always prepare from scratch */
+	const char *cache_dir;
+	uint64_t cache_max_size;
+	/* Skip erase units whose contents match the last image flashed to the device (needs cache_dir) */
+	bool differential;
+	/* Download block size to use, or 0 to use the largest the bootloader is known to accept */
+	size_t chunk_size;
+	/* Address sequential blocks by block number rather than setting the address pointer for every one */
+	bool block_addressing;
+	/* Read the flash back through DFU UPLOAD once programmed, and check it against the image */
+	bool verify;
+	/* In-memory pool of prepared images to use ahead of cache_dir, or NULL (see cache.h) */
+	struct stlink_image_pool *image_pool;
+	/* Progress reporting for the flash, or NULL for none */
+	stlink_progress_cb_t progress;
+	void *progress_data;
+} stlink_flash_options_s;
+
+#endif /*FLASH_OPTIONS_H*/
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "image.h"
+#include "stream.h"
+#include "discovery.h"
+#include "gang.h"
+#include "topology.h"
+#include "profile.h"
+#include "dump.h"
+
+typedef struct gang_worker {
+	stlink_info_s *info;
+	const stlink_job_s *job;
+	pthread_t thread;
+	bool started;
+	int result;
+} gang_worker_s;
+
+static int stlink_run_flash(stlink_info_s *const info, const stlink_job_s *const job)
+{
+	if (job->firmware)
+		return stlink_flash_firmware(info, job->firmware, job->flash_options);
+	if (stlink_stream_wanted(job->firmware_file)) {
+		int res = -1;
+		stlink_stream_s stream;
+		if (stlink_stream_open(job->firmware_file, &stream)) {
+			res = stlink_flash_stream(info, &stream, job->flash_options);
+			stlink_stream_close(&stream);
+		}
+		return res;
+	}
+	return stlink_flash(info, job->firmware_file, job->flash_options);
+}
+
+/*
+ * A flash that stopped partway (having run out of in-place retries, or with the device gone from the bus)
+ * gets the device found again and carries on from its session. Returns the result of the last attempt,
+ * and leaves the interface claimed only if the device is still there to carry on with.
+ */
+static int stlink_resume_flash(
+	stlink_info_s *const info, const stlink_job_s *const job, const char *const id, int res, bool *const claimed)
+{
+	for (size_t resume = 0U; res && info->stinfo_session.active && resume < STLINK_FLASH_RESUMES; ++resume) {
+		if (stlink_stopped(info))
+			break;
+		fprintf(stderr, "%s: flashing stopped after %zu of %zu blocks, waiting for the device to resume\n", id,
+			info->stinfo_session.confirmed, info->stinfo_session.chunk_count);
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		*claimed = false;
+		if (!stlink_reconnect(info, stlink_time_left_ms(info, STLINK_RECONNECT_TIMEOUT_MS))) {
+			fprintf(stderr, "%s: device did not come back\n", id);
+			break;
+		}
+		if (libusb_claim_interface(info->stinfo_dev_handle, 0)) {
+			fprintf(stderr, "%s: unable to claim USB interface after reconnecting\n", id);
+			break;
+		}
+		*claimed = true;
+		if (!stlink_read_info(info))
+			break;
+		res = stlink_run_flash(info, job);
+	}
+	return res;
+}
+
+/* Say why a device was given up on, if it was cancelled or ran out of time rather than failing by itself */
+static void stlink_report_stopped(const stlink_info_s *const info, const char *const id)
+{
+	if (atomic_load(&info->stinfo_cancelled))
+		fprintf(stderr, "%s: cancelled\n", id);
+	else if (stlink_stopped(info))
+		fprintf(stderr, "%s: ran out of time, giving up on the device\n", id);
+}
+
+/*
+ * Run the bootloader side of the process on an opened ST-Link: read its information,
+ * check it's the device the job wants and in a mode we can work with, and then flash it (unless probing).
+ * When `verbose` is false (gang and daemon mode) the device information is condensed to a single line
+ * and the busy time statistics are left out, so output from several devices stays readable. The job's
+ * deadline covers all of it, and a device that's cancelled or runs out of time is let go of without
+ * starting its application.
+ */
+int stlink_run_device(stlink_info_s *const info, const stlink_job_s *const job, const bool verbose)
+{
+	stlink_set_deadline(info, job->timeout_ms);
+	if (libusb_claim_interface(info->stinfo_dev_handle, 0)) {
+		fprintf(stderr,
+			"Unable to claim USB interface ! Please close all programs that "
+			"may communicate with an ST-Link dongle.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!stlink_read_info(info)) {
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		return EXIT_FAILURE;
+	}
+	/* Bootloader mode devices don't report a serial number, so this is the first chance to check the ID */
+	if (!stlink_filter_match_id(job->filter, info->id)) {
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		return STLINK_RUN_FILTERED;
+	}
+	char id[STLINK_ID_LENGTH];
+	stlink_format_id(info->id, id);
+	/* A read-out going to stdout needs it to itself */
+	FILE *const out = job->dump_file && strcmp(job->dump_file, "-") == 0 ? stderr : stdout;
+	if (verbose) {
+		fprintf(out, "Firmware version : V%dJ%dS%d\n", info->stlink_version, info->jtag_version, info->swim_version);
+		fprintf(out, "Loader version : %d\n", info->loader_version);
+		fprintf(out, "ST-Link ID : %s\n", id);
+		fprintf(out, "Firmware encryption key : ");
+		for (size_t i = 0U; i < 16U; ++i)
+			fprintf(out, "%02X", info->firmware_key[i]);
+		fprintf(out, "\n");
+	} else
+		fprintf(out, "%s: firmware V%dJ%dS%d, loader %d\n", id, info->stlink_version, info->jtag_version,
+			info->swim_version, info->loader_version);
+
+	const uint16_t mode = stlink_current_mode(info);
+	if (mode == UINT16_MAX) {
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		return EXIT_FAILURE;
+	}
+	if (verbose)
+		fprintf(out, "Current mode : %u\n", mode);
+
+	if (mode & ~3U) {
+		fprintf(out, "%s: ST-Link dongle is not in the correct mode. Please unplug and plug the dongle again.\n",
+			id);
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		return EXIT_SUCCESS;
+	}
+
+	int result = EXIT_SUCCESS;
+	if (!job->probe) {
+		/* Back up what's on the device before anything overwrites it, and leave it be if that fails */
+		if (job->dump_file) {
+			char path[4096U];
+			if (!stlink_dump_path(job->dump_file, info->id, path, sizeof(path))) {
+				fprintf(stderr, "%s: read-out file name too long\n", id);
+				result = EXIT_FAILURE;
+			} else if (stlink_dump(info, path, job->dump_options)) {
+				fprintf(stderr, "%s: firmware read-out failed\n", id);
+				result = EXIT_FAILURE;
+			}
+			if (result != EXIT_SUCCESS) {
+				stlink_report_stopped(info, id);
+				libusb_release_interface(info->stinfo_dev_handle, 0);
+				return result;
+			}
+		}
+		if (job->firmware || job->firmware_file) {
+			printf("Type %s\n", info->stinfo_profile->name);
+			bool claimed = true;
+			const int res = stlink_resume_flash(info, job, id, stlink_run_flash(info, job), &claimed);
+			/* Only a single-device run has stdout to itself, and not even then when a read-out is going there */
+			if (verbose && out == stdout)
+				stlink_print_poll_stats(info);
+			if (res) {
+				fprintf(stderr, "%s: flashing failed\n", id);
+				stlink_report_stopped(info, id);
+				result = EXIT_FAILURE;
+			}
+			/* Lost the device for good, so there's nothing left to start or release */
+			if (!claimed)
+				return result;
+		}
+		if (!stlink_stopped(info))
+			stlink_exit_dfu(info);
+	}
+	libusb_release_interface(info->stinfo_dev_handle, 0);
+	return result;
+}
+
+/* Progress reporting for the command line: a dot per block, and what was skipped once done */
+void stlink_print_progress(const stlink_info_s *const info, const stlink_progress_s *const progress, void *const data)
+{
+	(void)info;
+	(void)data;
+	if (progress->finished) {
+		printf("\n");
+		if (progress->blocks_skipped)
+			printf("Skipped %zu unchanged blocks\n", progress->blocks_skipped);
+		if (progress->blocks_blank)
+			printf("Skipped %zu blank blocks\n", progress->blocks_blank);
+		if (progress->blocks_verified)
+			printf("Verified %zu blocks\n", progress->blocks_verified);
+	} else {
+		printf(".");
+		fflush(stdout); /* Flush stdout buffer */
+	}
+}
+
+static void *gang_worker(void *const arg)
+{
+	gang_worker_s *const worker = (gang_worker_s *)arg;
+	worker->result = stlink_run_device(worker->info, worker->job, false);
+	return NULL;
+}
+
+/*
+ * Run the job on every device in the list at once, one thread per device. Devices sharing a hub take
+ * turns at having transfers in flight, so a crowded hub doesn't drag every device on it down with it
+ * while devices elsewhere get on at full speed.
+ */
+int stlink_run_gang(stlink_device_list_s *const list, const stlink_job_s *const job)
+{
+	stlink_topology_s topology;
+	if (!stlink_topology_build(&topology, list, job->hub_limit))
+		return EXIT_FAILURE;
+	gang_worker_s *const workers = calloc(list->count, sizeof(gang_worker_s));
+	if (!workers) {
+		fprintf(stderr, "Failed to allocate gang workers\n");
+		stlink_topology_free(&topology, list);
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0U; i < list->count; ++i) {
+		workers[i].info = &list->devices[i];
+		workers[i].job = job;
+		workers[i].started = pthread_create(&workers[i].thread, NULL, gang_worker, &workers[i]) == 0;
+		if (!workers[i].started) {
+			fprintf(stderr, "Failed to start worker for device %zu\n", i);
+			workers[i].result = EXIT_FAILURE;
+		}
+	}
+
+	size_t devices = 0U;
+	size_t failures = 0U;
+	for (size_t i = 0U; i < list->count; ++i) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		if (workers[i].result == STLINK_RUN_FILTERED)
+			continue;
+		++devices;
+		if (workers[i].result != EXIT_SUCCESS)
+			++failures;
+	}
+	free(workers);
+	stlink_topology_report(&topology);
+	stlink_topology_free(&topology, list);
+	printf("Gang run complete: %zu of %zu devices succeeded\n", devices - failures, devices);
+	return failures || !devices ? EXIT_FAILURE : EXIT_SUCCESS;
+}
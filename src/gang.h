@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GANG_H
+#define GANG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct stlink_firmware;
+struct stlink_dump_options;
+
+/* Returned by stlink_run_device() when the device turned out not to be the one the job asked for */
+#define STLINK_RUN_FILTERED (-1)
+
+/* What to do with each device: shared, and only ever read, by all the workers of a run */
+typedef struct stlink_job {
+	/* Only read out the device information, leaving the device in its bootloader */
+	bool probe;
+	/* Firmware to flash, either as a file name or already mapped. With neither, the application is just started */
+	const char *firmware_file;
+	const struct stlink_firmware *firmware;
+	const stlink_flash_options_s *flash_options;
+	/* Back the existing firmware up to this file first (see dump.h), or NULL not to */
+	const char *dump_file;
+	const struct stlink_dump_options *dump_options;
+	const stlink_device_filter_s *filter;
+	/* How many devices behind each hub may have transfers in flight at once in a gang run (0 for no limit) */
+	size_t hub_limit;
+	/* How long each device gets to finish the whole job before it's given up on, in milliseconds (0 for no limit) */
+	uint32_t timeout_ms;
+} stlink_job_s;
+
+void stlink_print_progress(const stlink_info_s *info, const stlink_progress_s *progress, void *data);
+int stlink_run_device(stlink_info_s *info, const stlink_job_s *job, bool verbose);
+int stlink_run_gang(stlink_device_list_s *list, const stlink_job_s *job);
+
+#endif /*GANG_H*/
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_MEAN_AND_LEAN
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#define O_BINARY O_NOCTTY
+#endif
+#include <string.h>
+#include <errno.h>
+#include <libusb.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "crypto.h"
+#include "stlink.h"
+#include "image.h"
+#include "buffer_pool.h"
+
+bool stlink_firmware_open(const char *const filename, stlink_firmware_s *const firmware)
+{
+	const int fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		const int error = errno;
+		fprintf(stderr, "Opening file failed (%d): %s\n", error, strerror(error));
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) < 0 || file_stat.st_size <= 0) {
+		const int error = errno;
+		fprintf(stderr, "Failed to get firmware file length (%d): %s\n", error, strerror(error));
+		close(fd);
+		return false;
+	}
+	const size_t file_size = (size_t)file_stat.st_size;
+
+#ifdef _WIN32
+	const HANDLE file_handle = (HANDLE)_get_osfhandle(fd);
+	HANDLE mapping =
+		CreateFileMappingA(file_handle, NULL, PAGE_READONLY, file_size >> 32U, file_size & UINT32_MAX, NULL);
+	if (mapping == INVALID_HANDLE_VALUE) {
+		DWORD error = GetLastError();
+		fprintf(stderr, "Failed to memory map firmware (%lu)\n", error);
+		close(fd);
+		return false;
+	}
+
+	const uint8_t *const data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0U, 0U, 0U);
+	if (data == NULL) {
+		DWORD error = GetLastError();
+		fprintf(stderr, "Failed to memory map firmware (%lu)\n", error);
+		CloseHandle(mapping);
+		close(fd);
+		return false;
+	}
+	firmware->mapping = mapping;
+#else
+	const uint8_t *const data = (const uint8_t *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		const int error = errno;
+		fprintf(stderr, "Failed to memory map firmware (%d): %s\n", error, strerror(error));
+		close(fd);
+		return false;
+	}
+#endif
+
+	firmware->data = data;
+	firmware->size = file_size;
+	firmware->fd = fd;
+	return true;
+}
+
+void stlink_firmware_close(stlink_firmware_s *const firmware)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(firmware->data);
+	CloseHandle(firmware->mapping);
+#else
+	munmap((void *)firmware->data, firmware->size);
+#endif
+	close(firmware->fd);
+	firmware->data = NULL;
+	firmware->size = 0U;
+}
+
+/*
+ * Check if a block is entirely 0xff, which is what erasing leaves behind, so it needn't be sent.
+ * Blocks are a multiple of 16 bytes, so this works 16 bytes at a time (a vector where there's one),
+ * and bails out on the first group with anything else in it.
+ */
+bool stlink_block_blank(const uint8_t *const data, const size_t length)
+{
+	size_t offset = 0U;
+#if defined(__SSE2__)
+	const __m128i ones = _mm_set1_epi8((char)0xff);
+	for (; offset + 16U <= length; offset += 16U) {
+		const __m128i block = _mm_loadu_si128((const __m128i *)(data + offset));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, ones)) != 0xffff)
+			return false;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; offset + 16U <= length; offset += 16U) {
+		const uint8x16_t block = vld1q_u8(data + offset);
+		if (vminvq_u8(block) != 0xffU)
+			return false;
+	}
+#else
+	for (; offset + 16U <= length; offset += 16U) {
+		uint64_t words[2];
+		memcpy(words, data + offset, sizeof(words));
+		if ((words[0] & words[1]) != UINT64_MAX)
+			return false;
+	}
+#endif
+	for (; offset < length; ++offset) {
+		if (data[offset] != 0xffU)
+			return false;
+	}
+	return true;
+}
+
+/* How many download blocks an image of length bytes takes up, counting only the populated ones if given */
+size_t stlink_image_chunk_count(const size_t length, const size_t chunk_size, const bool *const populated)
+{
+	const size_t total_chunks = (length + chunk_size - 1U) / chunk_size;
+	if (!populated)
+		return total_chunks;
+	size_t chunk_count = 0U;
+	for (size_t i = 0U; i < total_chunks; ++i)
+		chunk_count += populated[i];
+	return chunk_count;
+}
+
+/*
+ * Set up an image's blocks, with their data in the given transfer buffer pool if there is one and
+ * it has room (so the blocks can go out over USB without being copied again), or on the heap if not
+ */
+bool stlink_image_alloc(stlink_image_s *const image, const uint32_t base_address, const size_t chunk_size,
+	const size_t chunk_count, stlink_buffer_pool_s *const pool)
+{
+	image->chunk_size = chunk_size;
+	image->chunk_count = chunk_count;
+	image->buffer = pool ? stlink_buffer_pool_alloc(pool, chunk_count * chunk_size) : NULL;
+	image->pooled = image->buffer != NULL;
+	if (!image->pooled)
+		image->buffer = malloc(chunk_count * chunk_size);
+	image->chunks = calloc(chunk_count, sizeof(stlink_chunk_s));
+	if (!image->buffer || !image->chunks) {
+		fprintf(stderr, "Failed to allocate memory for the prepared firmware image\n");
+		stlink_image_free(image);
+		return false;
+	}
+
+	for (size_t i = 0U; i < chunk_count; ++i) {
+		stlink_chunk_s *const chunk = &image->chunks[i];
+		chunk->address = base_address + (uint32_t)(i * chunk_size);
+		chunk->data = image->buffer + (i * chunk_size);
+	}
+	return true;
+}
+
+/*
+ * Encrypt and checksum a whole firmware image for the given device up front, so that the flashing
+ * loop only has to push ready-made blocks at the USB link. The final block is padded out with 0xff
+ * (the erased flash state) rather than sending whatever follows the image in memory.
+ */
+bool stlink_image_prepare(const struct stlink_info *const info, const uint8_t *const firmware, const size_t length,
+	const uint32_t base_address, const size_t chunk_size, const bool *const populated,
+	stlink_buffer_pool_s *const pool, stlink_image_s *const image)
+{
+	const size_t total_chunks = (length + chunk_size - 1U) / chunk_size;
+	const size_t chunk_count = stlink_image_chunk_count(length, chunk_size, populated);
+	if (!stlink_image_alloc(image, base_address, chunk_size, chunk_count, pool))
+		return false;
+
+	/* Only the blocks with some of the image in them are kept, each remembering where it goes */
+	size_t index = 0U;
+	for (size_t i = 0U; i < total_chunks; ++i) {
+		if (populated && !populated[i])
+			continue;
+		stlink_chunk_s *const chunk = &image->chunks[index++];
+		const size_t offset = i * chunk_size;
+		const size_t amount = length - offset < chunk_size ? length - offset : chunk_size;
+		chunk->address = base_address + (uint32_t)offset;
+		memcpy(chunk->data, firmware + offset, amount);
+		memset(chunk->data + amount, 0xff, chunk_size - amount);
+		/* Blank blocks are left as they are after the erase, so there's no point encrypting them */
+		chunk->blank = stlink_block_blank(chunk->data, chunk_size);
+		if (!chunk->blank)
+			chunk->checksum = stlink_encrypt_chunk(info, chunk->data, chunk_size);
+	}
+	return true;
+}
+
+void stlink_image_free(stlink_image_s *const image)
+{
+	free(image->chunks);
+	if (!image->pooled)
+		free(image->buffer);
+	image->chunks = NULL;
+	image->buffer = NULL;
+	image->chunk_count = 0U;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct stlink_info;
+struct stlink_buffer_pool;
+
+/* A firmware file mapped into memory */
+typedef struct stlink_firmware {
+	const uint8_t *data;
+	size_t size;
+	int fd;
+#ifdef _WIN32
+	void *mapping;
+#endif
+} stlink_firmware_s;
+
+/* A single ready-to-send download block: already encrypted, with the checksum for its request */
+typedef struct stlink_chunk {
+	uint32_t address;
+	uint16_t checksum;
+	/* All 0xff before encryption: still erased like any other block, but never downloaded */
+	bool blank;
+	uint8_t *data;
+} stlink_chunk_s;
+
+/* A firmware image encrypted for one specific device, laid out as a sequence of download blocks */
+typedef struct stlink_image {
+	size_t chunk_size;
+	size_t chunk_count;
+	stlink_chunk_s *chunks;
+	uint8_t *buffer;
+	/* The buffer was carved off a device's transfer buffer pool, so goes back with it rather than being freed */
+	bool pooled;
+} stlink_image_s;
+
+bool stlink_firmware_open(const char *filename, stlink_firmware_s *firmware);
+void stlink_firmware_close(stlink_firmware_s *firmware);
+
+bool stlink_block_blank(const uint8_t *data, size_t length);
+size_t stlink_image_chunk_count(size_t length, size_t chunk_size, const bool *populated);
+bool stlink_image_alloc(stlink_image_s *image, uint32_t base_address, size_t chunk_size, size_t chunk_count,
+	struct stlink_buffer_pool *pool);
+bool stlink_image_prepare(const struct stlink_info *info, const uint8_t *firmware, size_t length,
+	uint32_t base_address, size_t chunk_size, const bool *populated, struct stlink_buffer_pool *pool,
+	stlink_image_s *image);
+void stlink_image_free(stlink_image_s *image);
+
+#endif /*IMAGE_H*/
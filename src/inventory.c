@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "discovery.h"
+#include "profile.h"
+#include "inventory.h"
+#include "timing.h"
+#include "trace.h"
+
+/* One ST-Link found on the bus, and what probing it turned up */
+typedef struct inventory_device {
+	stlink_info_s info;
+	uint16_t product_id;
+	char path[STLINK_PORT_PATH_LENGTH];
+	/* The USB serial number, which is the ST-Link ID for application mode devices */
+	char serial[64U];
+	uint16_t mode;
+	/* Why the device couldn't be probed, or NULL if it could */
+	const char *error;
+	pthread_t thread;
+	bool started;
+} inventory_device_s;
+
+typedef struct inventory {
+	inventory_device_s *devices;
+	size_t count;
+	size_t capacity;
+} inventory_s;
+
+static bool stlink_inventory_application(const uint16_t product_id)
+{
+	switch (product_id) {
+	case PRODUCT_ID_STLINKV21:
+	case PRODUCT_ID_STLINKV21_MSD:
+	case PRODUCT_ID_STLINKV3:
+	case PRODUCT_ID_STLINKV3_NO_MSD:
+	case PRODUCT_ID_STLINKV3E:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inventory_device_s *stlink_inventory_append(inventory_s *const inventory)
+{
+	if (inventory->count == inventory->capacity) {
+		const size_t capacity = inventory->capacity ? inventory->capacity * 2U : 16U;
+		inventory_device_s *const devices = realloc(inventory->devices, capacity * sizeof(*devices));
+		if (!devices)
+			return NULL;
+		inventory->devices = devices;
+		inventory->capacity = capacity;
+	}
+	inventory_device_s *const device = &inventory->devices[inventory->count++];
+	memset(device, 0, sizeof(*device));
+	return device;
+}
+
+/*
+ * Collect every ST-Link on the bus in a single pass, opening the ones in their bootloader. Application mode
+ * devices are left exactly as they are - switching them would mean waiting for each to re-enumerate, and they
+ * may well be in use - so they're only reported by what their descriptors say.
+ */
+static bool stlink_inventory_scan(libusb_context *const ctx, inventory_s *const inventory)
+{
+	libusb_device **devs;
+	const ssize_t n_devs = libusb_get_device_list(ctx, &devs);
+	if (n_devs < 0) {
+		fprintf(stderr, "Failed to list USB devices: %s\n", libusb_strerror((int)n_devs));
+		return false;
+	}
+
+	for (size_t i = 0U; devs[i]; ++i) {
+		libusb_device *const dev = devs[i];
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(dev, &desc) < 0 || desc.idVendor != VENDOR_ID_STLINK)
+			continue;
+		const stlink_profile_s *const profile = stlink_profile_find(desc.idProduct, 0U);
+		if (!profile && !stlink_inventory_application(desc.idProduct))
+			continue;
+		inventory_device_s *const device = stlink_inventory_append(inventory);
+		if (!device) {
+			fprintf(stderr, "Failed to allocate memory for the inventory\n");
+			break;
+		}
+		device->product_id = desc.idProduct;
+		stlink_format_port_path(dev, device->path, sizeof(device->path));
+		device->info.stinfo_usb_ctx = ctx;
+		device->info.stinfo_profile = profile;
+		if (profile) {
+			device->info.stinfo_ep_in = profile->ep_in;
+			device->info.stinfo_ep_out = profile->ep_out;
+		}
+		const int res = libusb_open(dev, &device->info.stinfo_dev_handle);
+		if (res < 0) {
+			device->info.stinfo_dev_handle = NULL;
+			device->error = libusb_strerror(res);
+			continue;
+		}
+		unsigned char *const serial = (unsigned char *)device->serial;
+		if (desc.iSerialNumber && libusb_get_string_descriptor_ascii(device->info.stinfo_dev_handle,
+									  desc.iSerialNumber, serial, sizeof(device->serial)) < 0)
+			device->serial[0] = '\0';
+	}
+	libusb_free_device_list(devs, 1);
+	return true;
+}
+
+/* Read out a bootloader mode device, on a thread of its own so every device on the bus is probed at once */
+static void *stlink_inventory_probe(void *const arg)
+{
+	inventory_device_s *const device = (inventory_device_s *)arg;
+	stlink_info_s *const info = &device->info;
+	if (libusb_claim_interface(info->stinfo_dev_handle, 0)) {
+		device->error = "unable to claim USB interface";
+		return NULL;
+	}
+	if (!stlink_read_info(info))
+		device->error = "unable to read device information";
+	else {
+		device->mode = stlink_current_mode(info);
+		if (device->mode == UINT16_MAX)
+			device->error = "unable to read current mode";
+	}
+	libusb_release_interface(info->stinfo_dev_handle, 0);
+	return NULL;
+}
+
+/* Write a string out as a JSON string literal, escaping anything that needs it */
+static void stlink_inventory_print_string(const char *const string)
+{
+	putchar('"');
+	for (const char *c = string; *c; ++c) {
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if ((unsigned char)*c < 0x20U)
+			printf("\\u%04x", (unsigned char)*c);
+		else
+			putchar(*c);
+	}
+	putchar('"');
+}
+
+static void stlink_inventory_print(const inventory_device_s *const device)
+{
+	const stlink_info_s *const info = &device->info;
+	const bool bootloader = info->stinfo_profile != NULL;
+	printf("{\"bus\":\"%s\",\"product_id\":\"%04x\",\"state\":\"%s\"", device->path, device->product_id,
+		bootloader ? "bootloader" : "application");
+	if (device->serial[0]) {
+		printf(",\"serial\":");
+		stlink_inventory_print_string(device->serial);
+	}
+	if (bootloader && !device->error) {
+		char id[STLINK_ID_LENGTH];
+		stlink_format_id(info->id, id);
+		printf(",\"id\":\"%s\",\"type\":\"%s\",\"firmware\":\"V%uJ%uS%u\",\"loader_version\":%u,\"mode\":%u", id,
+			info->stinfo_profile->name, info->stlink_version, info->jtag_version, info->swim_version,
+			info->loader_version, device->mode);
+	}
+	if (device->error) {
+		printf(",\"error\":");
+		stlink_inventory_print_string(device->error);
+	}
+	printf("}\n");
+}
+
+/*
+ * Inventory probe: print one JSON record per ST-Link on the bus. Every bootloader mode device is read out
+ * in parallel, and nothing is switched between modes, so the whole bus takes one enumeration pass and as
+ * long as the slowest device does to answer. Returns EXIT_FAILURE if no device could be probed.
+ */
+int stlink_inventory(libusb_context *const ctx)
+{
+	const uint64_t start = time_us();
+	inventory_s inventory = {0};
+	if (!stlink_inventory_scan(ctx, &inventory)) {
+		free(inventory.devices);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0U; i < inventory.count; ++i) {
+		inventory_device_s *const device = &inventory.devices[i];
+		if (!device->info.stinfo_profile || !device->info.stinfo_dev_handle)
+			continue;
+		device->started = pthread_create(&device->thread, NULL, stlink_inventory_probe, device) == 0;
+		if (!device->started)
+			stlink_inventory_probe(device);
+	}
+
+	size_t probed = 0U;
+	for (size_t i = 0U; i < inventory.count; ++i) {
+		inventory_device_s *const device = &inventory.devices[i];
+		if (device->started)
+			pthread_join(device->thread, NULL);
+		stlink_inventory_print(device);
+		if (device->info.stinfo_dev_handle)
+			libusb_close(device->info.stinfo_dev_handle);
+		probed += !device->error;
+	}
+	fflush(stdout);
+	stlink_trace_event(NULL, "inventory", start, "\"devices\":%zu,\"probed\":%zu", inventory.count, probed);
+	free(inventory.devices);
+	return probed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
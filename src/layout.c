@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "buffer_utils.h"
+#include "layout.h"
+
+#define ELF_MAGIC          "\x7f" "ELF"
+#define ELF_CLASS_32       1U
+#define ELF_DATA_LSB       1U
+#define ELF_HEADER_SIZE    52U
+#define ELF_PHDR_SIZE      32U
+#define ELF_PT_LOAD        1U
+
+#define HEX_RECORD_DATA            0x00U
+#define HEX_RECORD_EOF             0x01U
+#define HEX_RECORD_SEGMENT_ADDRESS 0x02U
+#define HEX_RECORD_LINEAR_ADDRESS  0x04U
+
+/* One contiguous run of the image, as found in the input file */
+typedef struct stlink_segment {
+	uint32_t address;
+	size_t length;
+	/* Offset of the segment's data in the firmware file, or in the HEX decode buffer */
+	size_t offset;
+} stlink_segment_s;
+
+typedef struct stlink_segments {
+	stlink_segment_s *segments;
+	size_t count;
+	size_t capacity;
+	/* Decoded data for HEX images, which (unlike ELF) can't be used straight from the file */
+	uint8_t *data;
+	size_t data_length;
+	size_t data_capacity;
+} stlink_segments_s;
+
+static stlink_segment_s *stlink_segments_add(stlink_segments_s *const segments)
+{
+	if (segments->count == segments->capacity) {
+		const size_t capacity = segments->capacity ? segments->capacity * 2U : 16U;
+		stlink_segment_s *const entries = realloc(segments->segments, capacity * sizeof(stlink_segment_s));
+		if (!entries)
+			return NULL;
+		segments->segments = entries;
+		segments->capacity = capacity;
+	}
+	return &segments->segments[segments->count++];
+}
+
+/* Gather the loadable, file-backed program segments of a 32-bit little endian ELF at their load addresses */
+static bool stlink_segments_elf(const uint8_t *const firmware, const size_t length, stlink_segments_s *const segments)
+{
+	if (length < ELF_HEADER_SIZE || firmware[4] != ELF_CLASS_32 || firmware[5] != ELF_DATA_LSB) {
+		fprintf(stderr, "Only 32-bit little endian ELF images are supported\n");
+		return false;
+	}
+	const uint32_t phdr_offset = read_le4(firmware, 28U);
+	const uint16_t phdr_size = read_le2(firmware, 42U);
+	const uint16_t phdr_count = read_le2(firmware, 44U);
+	if (phdr_size < ELF_PHDR_SIZE || phdr_offset > length || phdr_count > (length - phdr_offset) / phdr_size) {
+		fprintf(stderr, "ELF program headers are malformed\n");
+		return false;
+	}
+
+	for (size_t i = 0U; i < phdr_count; ++i) {
+		const uint8_t *const phdr = firmware + phdr_offset + (i * phdr_size);
+		const uint32_t file_offset = read_le4(phdr, 4U);
+		/* The physical address is where the loader puts the segment, which is what's in flash */
+		const uint32_t address = read_le4(phdr, 12U);
+		const uint32_t file_size = read_le4(phdr, 16U);
+		if (read_le4(phdr, 0U) != ELF_PT_LOAD || !file_size)
+			continue;
+		if (file_offset > length || file_size > length - file_offset) {
+			fprintf(stderr, "ELF segment %zu lies outside the file\n", i);
+			return false;
+		}
+		stlink_segment_s *const segment = stlink_segments_add(segments);
+		if (!segment)
+			return false;
+		segment->address = address;
+		segment->length = file_size;
+		segment->offset = file_offset;
+	}
+	return true;
+}
+
+static int hex_nibble(const uint8_t digit)
+{
+	if (digit >= '0' && digit <= '9')
+		return digit - '0';
+	if (digit >= 'A' && digit <= 'F')
+		return digit - 'A' + 10;
+	if (digit >= 'a' && digit <= 'f')
+		return digit - 'a' + 10;
+	return -1;
+}
+
+static bool hex_decode(const uint8_t *const text, const size_t count, uint8_t *const bytes)
+{
+	for (size_t i = 0U; i < count; ++i) {
+		const int high = hex_nibble(text[i * 2U]);
+		const int low = hex_nibble(text[(i * 2U) + 1U]);
+		if (high < 0 || low < 0)
+			return false;
+		bytes[i] = (uint8_t)((high << 4U) | low);
+	}
+	return true;
+}
+
+static bool stlink_segments_append(
+	stlink_segments_s *const segments, const uint32_t address, const uint8_t *const data, const size_t length)
+{
+	if (!length)
+		return true;
+	if (segments->data_length + length > segments->data_capacity) {
+		size_t capacity = segments->data_capacity ? segments->data_capacity * 2U : 65536U;
+		while (capacity < segments->data_length + length)
+			capacity *= 2U;
+		uint8_t *const buffer = realloc(segments->data, capacity);
+		if (!buffer)
+			return false;
+		segments->data = buffer;
+		segments->data_capacity = capacity;
+	}
+	/* Records usually follow on from each other, in which case they just extend the current segment */
+	stlink_segment_s *segment = segments->count ? &segments->segments[segments->count - 1U] : NULL;
+	if (!segment || segment->address + segment->length != address ||
+		segment->offset + segment->length != segments->data_length) {
+		segment = stlink_segments_add(segments);
+		if (!segment)
+			return false;
+		segment->address = address;
+		segment->length = 0U;
+		segment->offset = segments->data_length;
+	}
+	memcpy(segments->data + segments->data_length, data, length);
+	segments->data_length += length;
+	segment->length += length;
+	return true;
+}
+
+static bool stlink_segments_hex(const uint8_t *const firmware, const size_t length, stlink_segments_s *const segments)
+{
+	uint32_t upper_address = 0U;
+	size_t line = 0U;
+	for (size_t offset = 0U; offset < length;) {
+		/* Skip line endings and any other whitespace between records */
+		if (firmware[offset] != ':') {
+			if (firmware[offset] > ' ') {
+				fprintf(stderr, "Intel HEX line %zu is not a record\n", line + 1U);
+				return false;
+			}
+			if (firmware[offset++] == '\n')
+				++line;
+			continue;
+		}
+		uint8_t header[4U];
+		if (length - offset < 11U || !hex_decode(firmware + offset + 1U, 4U, header) ||
+			length - offset < 11U + (header[0] * 2U)) {
+			fprintf(stderr, "Intel HEX line %zu is truncated\n", line + 1U);
+			return false;
+		}
+		uint8_t record[4U + 255U + 1U];
+		const size_t record_length = 5U + header[0];
+		if (!hex_decode(firmware + offset + 1U, record_length, record)) {
+			fprintf(stderr, "Intel HEX line %zu is malformed\n", line + 1U);
+			return false;
+		}
+		uint8_t checksum = 0U;
+		for (size_t i = 0U; i < record_length; ++i)
+			checksum += record[i];
+		if (checksum) {
+			fprintf(stderr, "Intel HEX line %zu has a bad checksum\n", line + 1U);
+			return false;
+		}
+		offset += 1U + (record_length * 2U);
+
+		const uint8_t *const payload = record + 4U;
+		const uint32_t address = upper_address + read_be2(record, 1U);
+		switch (record[3]) {
+		case HEX_RECORD_DATA:
+			if (!stlink_segments_append(segments, address, payload, header[0]))
+				return false;
+			break;
+		case HEX_RECORD_EOF:
+			return true;
+		case HEX_RECORD_SEGMENT_ADDRESS:
+			if (header[0] != 2U)
+				return false;
+			upper_address = (uint32_t)read_be2(payload, 0U) << 4U;
+			break;
+		case HEX_RECORD_LINEAR_ADDRESS:
+			if (header[0] != 2U)
+				return false;
+			upper_address = (uint32_t)read_be2(payload, 0U) << 16U;
+			break;
+		default:
+			/* Start address records say nothing about what goes in flash */
+			break;
+		}
+	}
+	fprintf(stderr, "Intel HEX image has no end of file record\n");
+	return false;
+}
+
+static int stlink_segment_compare(const void *const lhs, const void *const rhs)
+{
+	const stlink_segment_s *const a = (const stlink_segment_s *)lhs;
+	const stlink_segment_s *const b = (const stlink_segment_s *)rhs;
+	return a->address < b->address ? -1 : a->address > b->address;
+}
+
+static bool hex_is_text(const uint8_t *const firmware, const size_t length)
+{
+	size_t offset = 0U;
+	while (offset < length && (firmware[offset] == ' ' || firmware[offset] == '\r' || firmware[offset] == '\n'))
+		++offset;
+	return offset < length && firmware[offset] == ':';
+}
+
+/* Flatten the sorted segments over the chunk-aligned range they cover, noting which blocks they land in */
+static bool stlink_layout_flatten(const stlink_segments_s *const segments, const uint8_t *const source,
+	const uint32_t base_address, const size_t chunk_size, stlink_layout_s *const layout)
+{
+	const stlink_segment_s *const first = &segments->segments[0];
+	const stlink_segment_s *const last = &segments->segments[segments->count - 1U];
+	for (size_t i = 0U; i < segments->count; ++i) {
+		const stlink_segment_s *const segment = &segments->segments[i];
+		if (segment->address < base_address) {
+			fprintf(stderr, "Image segment at 0x%08" PRIx32 " would overwrite the bootloader (starts at 0x%08" PRIx32
+				")\n", segment->address, base_address);
+			return false;
+		}
+		if (i && segment->address < segments->segments[i - 1U].address + segments->segments[i - 1U].length) {
+			fprintf(stderr, "Image segments overlap at 0x%08" PRIx32 "\n", segment->address);
+			return false;
+		}
+	}
+	const uint64_t end_address = (uint64_t)last->address + last->length;
+	const uint32_t start = base_address + (uint32_t)(((first->address - base_address) / chunk_size) * chunk_size);
+	if (end_address - start > STLINK_LAYOUT_MAX_SPAN) {
+		fprintf(stderr, "Image spans 0x%08" PRIx32 " to 0x%08" PRIx64 ", which doesn't look like flash\n", start,
+			end_address);
+		return false;
+	}
+	const size_t chunk_count = (size_t)((end_address - start + chunk_size - 1U) / chunk_size);
+	layout->address = start;
+	layout->length = chunk_count * chunk_size;
+	layout->storage = malloc(layout->length);
+	layout->populated = calloc(chunk_count, sizeof(bool));
+	if (!layout->storage || !layout->populated)
+		return false;
+	memset(layout->storage, 0xff, layout->length);
+	for (size_t i = 0U; i < segments->count; ++i) {
+		const stlink_segment_s *const segment = &segments->segments[i];
+		const size_t offset = segment->address - start;
+		memcpy(layout->storage + offset, source + segment->offset, segment->length);
+		const size_t last_chunk = (offset + segment->length - 1U) / chunk_size;
+		for (size_t chunk = offset / chunk_size; chunk <= last_chunk; ++chunk)
+			layout->populated[chunk] = true;
+	}
+	layout->data = layout->storage;
+	return true;
+}
+
+/*
+ * Work out where an image goes. Raw binaries are used in place at the bootloader's base address, while
+ * ELF and Intel HEX images go wherever their segments say, as long as that's not over the bootloader.
+ */
+bool stlink_layout_load(const uint8_t *const firmware, const size_t length, const uint32_t base_address,
+	const size_t chunk_size, stlink_layout_s *const layout)
+{
+	memset(layout, 0, sizeof(*layout));
+	if (length >= 4U && memcmp(firmware, ELF_MAGIC, 4U) == 0)
+		layout->format = STLINK_FORMAT_ELF;
+	else if (hex_is_text(firmware, length))
+		layout->format = STLINK_FORMAT_HEX;
+	else {
+		layout->format = STLINK_FORMAT_BIN;
+		layout->address = base_address;
+		layout->data = firmware;
+		layout->length = length;
+		return true;
+	}
+
+	stlink_segments_s segments = {0};
+	bool result = layout->format == STLINK_FORMAT_ELF ? stlink_segments_elf(firmware, length, &segments) :
+														stlink_segments_hex(firmware, length, &segments);
+	if (result && !segments.count) {
+		fprintf(stderr, "Image has nothing to flash in it\n");
+		result = false;
+	}
+	if (result) {
+		qsort(segments.segments, segments.count, sizeof(stlink_segment_s), stlink_segment_compare);
+		result = stlink_layout_flatten(
+			&segments, segments.data ? segments.data : firmware, base_address, chunk_size, layout);
+	}
+	free(segments.segments);
+	free(segments.data);
+	if (!result)
+		stlink_layout_free(layout);
+	return result;
+}
+
+void stlink_layout_free(stlink_layout_s *const layout)
+{
+	free(layout->storage);
+	free(layout->populated);
+	layout->storage = NULL;
+	layout->populated = NULL;
+	layout->data = NULL;
+	layout->length = 0U;
+}
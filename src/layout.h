@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Largest span of flash an ELF or Intel HEX image may cover, to catch images built for somewhere else */
+#define STLINK_LAYOUT_MAX_SPAN (16U * 1024U * 1024U)
+
+typedef enum stlink_image_format {
+	STLINK_FORMAT_BIN,
+	STLINK_FORMAT_ELF,
+	STLINK_FORMAT_HEX,
+} stlink_image_format_e;
+
+/*
+ * Where a firmware image lands in flash. The image is flattened over the chunk-aligned address range
+ * it covers, with any gaps between its segments filled with 0xff, and `populated` records which of
+ * the download blocks in that range actually hold any of the image - the rest needn't be sent.
+ */
+typedef struct stlink_layout {
+	stlink_image_format_e format;
+	uint32_t address;
+	const uint8_t *data;
+	size_t length;
+	/* One entry per block, or NULL when every block is populated (as for a raw binary) */
+	bool *populated;
+	/* Backing for data when it had to be assembled rather than used in place */
+	uint8_t *storage;
+} stlink_layout_s;
+
+bool stlink_layout_load(const uint8_t *firmware, size_t length, uint32_t base_address, size_t chunk_size,
+	stlink_layout_s *layout);
+void stlink_layout_free(stlink_layout_s *layout);
+
+#endif /*LAYOUT_H*/
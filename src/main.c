@@ -24,48 +24,50 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
-#ifdef _WIN32
-#define NOMINMAX
-#define WIN32_MEAN_AND_LEAN
-#include <windows.h>
-#define mssleep(ms) Sleep(ms)
-#else
-#include <unistd.h>
-#define mssleep(ms) usleep(ms * 1000U)
-#endif
+#include <string.h>
 #include <libusb.h>
 #include <getopt.h>
-#include <string.h>
 
+#include "crypto.h"
 #include "stlink.h"
-
-#define VENDOR_ID_STLINK           0x0483U
-#define PRODUCT_ID_STLINK_MASK     0xffe0U
-#define PRODUCT_ID_STLINK_GROUP    0x3740U
-#define PRODUCT_ID_STLINKV2        0x3748U
-#define PRODUCT_ID_STLINKV21       0x374bU
-#define PRODUCT_ID_STLINKV21_MSD   0x3752U
-#define PRODUCT_ID_STLINKV3_NO_MSD 0x3754U
-#define PRODUCT_ID_STLINKV3_BL     0x374dU
-#define PRODUCT_ID_STLINKV3        0x374fU
-#define PRODUCT_ID_STLINKV3E       0x374eU
-
-#define OPENMOKO_VID 0x1d50
-#define BMP_APPL_PID 0x6018
-#define BMP_DFU_IF   4
-
-#define VENDOR_ID_SEGGER        0x1366U
-#define PRODUCT_ID_JLINK        0x0101U
-#define PRODUCT_ID_JLINK_PLUS   0x0105U
+#include "cache.h"
+#include "discovery.h"
+#include "gang.h"
+#include "topology.h"
+#include "daemon.h"
+#include "stream.h"
+#include "trace.h"
+#include "inventory.h"
+#include "dump.h"
+#include "record.h"
 
 void print_help(char *argv[])
 {
-	printf("Usage: %s [options] [firmware.bin]\n", argv[0]);
+	printf("Usage: %s [options] [firmware.bin | - | http(s)://url]\n", argv[0]);
 	printf("Options:\n");
 	printf("\t-p\tProbe the ST-Link adapter\n");
+	printf("\t-P\tInventory: probe every ST-Link on the bus at once, printing a JSON record for each\n");
 	printf("\t-j\tSwitch J-Link (converted ST-Link) back to ST-Link bootloader before proceeding\n");
+	printf("\t-g\tGang mode: operate on every ST-Link found on the bus in parallel\n");
+	printf("\t-H n\tGang mode: let at most n devices behind each hub transfer at once (0: no limit; default: %u)\n",
+		STLINK_HUB_IN_FLIGHT_DEFAULT);
+	printf("\t-c dir\tCache prepared (encrypted) firmware images in dir for faster re-flashing\n");
+	printf("\t-b size\tDownload block size in bytes (power of 2, 16 to %u; default: bootloader's largest known)\n",
+		STLINK_MAX_CHUNK_SIZE);
+	printf("\t-s\tSet the address pointer once per run of sequential blocks (loader must support wBlockNum)\n");
+	printf("\t-d\tDifferential flash: only rewrite what changed since the last flash with the same -c dir\n");
+	printf("\t-v\tVerify: read the flash back once programmed and check it against the image\n");
+	printf("\t-r file\tRead out (back up) the application area to file first: raw binary, or Intel HEX if it ends\n"
+		   "\t\tin .hex, - for stdout. " STLINK_DUMP_ID_PLACEHOLDER " in the name is replaced by the ST-Link ID\n");
+	printf("\t-z\tLeave blank flash out of the read-out\n");
+	printf("\t-T secs\tGive up on a device that hasn't finished within secs seconds (default: no limit)\n");
+	printf("\t-t file\tWrite per-phase timing telemetry to file (JSON lines, or a Chrome trace if it ends in .json)\n");
+	printf("\t-U file\tRecord every USB transfer to file, for replaying with stlink-bench -R\n");
+	printf("\t-D sock\tDaemon mode: take jobs (\"<image> [serial=ID] [port=BUS-PORT]\") on Unix socket sock,\n"
+		   "\t\twhich only the daemon's own user may connect to\n");
 	printf("\t-h\tShow help\n\n");
 	printf("\tApplication is started when called without argument or after firmware load\n\n");
 }
@@ -73,214 +75,212 @@ void print_help(char *argv[])
 int main(int argc, char **argv)
 {
 	int opt = -1;
-	bool probe = false;
-	bool jlink_switch = false;
+	bool gang = false;
+	bool inventory = false;
+	const char *daemon_socket = NULL;
+	const char *trace_file = NULL;
+	const char *record_file = NULL;
+	stlink_job_s job = {
+		.hub_limit = STLINK_HUB_IN_FLIGHT_DEFAULT,
+	};
+	stlink_flash_options_s flash_options = {
+		.cache_dir = NULL,
+		.cache_max_size = STLINK_CACHE_MAX_SIZE,
+		.differential = false,
+		.chunk_size = 0U,
+		.block_addressing = false,
+		.verify = false,
+		.image_pool = NULL,
+		.progress = stlink_print_progress,
+		.progress_data = NULL,
+	};
+	stlink_dump_options_s dump_options = {
+		.chunk_size = 0U,
+		.block_addressing = false,
+		.skip_blank = false,
+	};
+	stlink_discovery_options_s discovery = {0};
 
-	while ((opt = getopt(argc, argv, "hpj")) != -1) {
+	while ((opt = getopt(argc, argv, "hpPjgH:c:db:svr:zT:t:U:D:")) != -1) {
 		switch (opt) {
 		case 'p': /* Probe mode */
-			probe = true;
+			job.probe = true;
 			break;
-		case 'j': /* J-Link to ST-Link bootloader switch */
-			jlink_switch = true;
+		case 'P': /* Inventory probe */
+			inventory = true;
 			break;
-		case 'h': /* Help */
-			print_help(argv);
-			return EXIT_SUCCESS;
+		case 'j': /* J-Link to ST-Link bootloader switch */
+			discovery.jlink_switch = true;
 			break;
-		default:
-			print_help(argv);
-			return EXIT_FAILURE;
+		case 'g': /* Gang mode */
+			gang = true;
 			break;
-		}
-	}
-
-	const bool do_load = optind < argc;
-
-	stlink_info_s info;
-	const int res = libusb_init(&info.stinfo_usb_ctx);
-	if (res != LIBUSB_SUCCESS) {
-		fprintf(stderr, "Failed to initialise libusb: %d (%s)\n", res, libusb_strerror(res));
-		return 2;
-	}
-rescan:
-	info.stinfo_dev_handle = NULL;
-	libusb_device **devs;
-	ssize_t n_devs = libusb_get_device_list(info.stinfo_usb_ctx, &devs);
-	if (n_devs < 0)
-		goto exit_libusb;
-
-	for (size_t i = 0U; devs[i]; i++) {
-		libusb_device *dev = devs[i];
-		struct libusb_device_descriptor desc;
-		int res = libusb_get_device_descriptor(dev, &desc);
-		if (res < 0)
-			continue;
-		if ((desc.idVendor == OPENMOKO_VID) && (desc.idProduct == BMP_APPL_PID)) {
-			fprintf(stderr, "Trying to switch BMP/Application to bootloader\n");
-			res = libusb_open(dev, &info.stinfo_dev_handle);
-			if (res < 0) {
-				fprintf(stderr, "Can not open BMP/Application!\n");
-				continue;
-			}
-			libusb_claim_interface(info.stinfo_dev_handle, BMP_DFU_IF);
-			res = libusb_control_transfer(info.stinfo_dev_handle,
-				/* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-				/* bRequest      */ 0, /*DFU_DETACH,*/
-				/* wValue        */ 1000,
-				/* wIndex        */ BMP_DFU_IF,
-				/* Data          */ NULL,
-				/* wLength       */ 0, 5000);
-			libusb_release_interface(info.stinfo_dev_handle, 0);
-			if (res < 0) {
-				fprintf(stderr, "BMP Switch failed\n");
-				continue;
+		case 'H': { /* Per-hub transfer limit */
+			char *end = NULL;
+			const unsigned long limit = strtoul(optarg, &end, 0);
+			if (!*optarg || *end) {
+				fprintf(stderr, "Invalid hub transfer limit %s\n", optarg);
+				return EXIT_FAILURE;
 			}
-			libusb_free_device_list(devs, n_devs);
-			mssleep(2000);
-			goto rescan;
+			job.hub_limit = limit;
 			break;
 		}
-		/* Handle J-Link devices (converted ST-Links) */
-		if (jlink_switch && desc.idVendor == VENDOR_ID_SEGGER) {
-			fprintf(stderr, "Found SEGGER device (VID:PID = %04X:%04X)\n", desc.idVendor, desc.idProduct);
-			fprintf(stderr, "Attempting to switch J-Link to ST-Link bootloader...\n");
-			res = libusb_open(dev, &info.stinfo_dev_handle);
-			if (res < 0) {
-				fprintf(stderr, "Cannot open J-Link device: %s\n", libusb_strerror(res));
-				continue;
-			}
-			if (libusb_claim_interface(info.stinfo_dev_handle, 0)) {
-				fprintf(stderr, "Unable to claim USB interface. Please close all programs that "
-					"may communicate with the J-Link.\n");
-				libusb_close(info.stinfo_dev_handle);
-				continue;
-			}
-			res = jlink_switch_to_stlink_bootloader(info.stinfo_dev_handle);
-			libusb_release_interface(info.stinfo_dev_handle, 0);
-			libusb_close(info.stinfo_dev_handle);
-			if (res == 0) {
-				fprintf(stderr, "Success! Device should now re-enumerate as ST-Link in DFU mode.\n");
-				fprintf(stderr, "Waiting for re-enumeration...\n");
-				libusb_free_device_list(devs, n_devs);
-				mssleep(5000);
-				jlink_switch = false; /* Don't try again on rescan */
-				goto rescan;
-			} else {
-				fprintf(stderr, "Failed to switch to ST-Link bootloader.\n");
-				libusb_free_device_list(devs, n_devs);
-				libusb_exit(info.stinfo_usb_ctx);
+		case 'c': /* Prepared image cache */
+			flash_options.cache_dir = optarg;
+			break;
+		case 'd': /* Differential flashing */
+			flash_options.differential = true;
+			break;
+		case 's': /* DfuSe-style block number addressing */
+			flash_options.block_addressing = true;
+			break;
+		case 'v': /* Read-back verification */
+			flash_options.verify = true;
+			break;
+		case 'r': /* Firmware read-out */
+			job.dump_file = optarg;
+			break;
+		case 'z': /* Leave blank flash out of the read-out */
+			dump_options.skip_blank = true;
+			break;
+		case 'T': { /* Per-device deadline */
+			char *end = NULL;
+			const unsigned long seconds = strtoul(optarg, &end, 0);
+			if (!*optarg || *end || seconds > UINT32_MAX / 1000U) {
+				fprintf(stderr, "Invalid time limit %s\n", optarg);
 				return EXIT_FAILURE;
 			}
+			job.timeout_ms = (uint32_t)seconds * 1000U;
+			break;
 		}
-		if (desc.idVendor != VENDOR_ID_STLINK || (desc.idProduct & PRODUCT_ID_STLINK_MASK) != PRODUCT_ID_STLINK_GROUP)
-			continue;
-		switch (desc.idProduct) {
-		case PRODUCT_ID_STLINKV2:
-			res = libusb_open(dev, &info.stinfo_dev_handle);
-			if (res < 0) {
-				fprintf(stderr, "Can not open ST-Link v2/Bootloader!\n");
-				continue;
-			}
-			info.stinfo_ep_in = 1 | LIBUSB_ENDPOINT_IN;
-			info.stinfo_ep_out = 2 | LIBUSB_ENDPOINT_OUT;
-			info.stinfo_bl_type = STLINK_BL_V2;
-			fprintf(stderr, "ST-Link v2/v2.1 Bootloader found\n");
+		case 't': /* Timing telemetry */
+			trace_file = optarg;
 			break;
-		case PRODUCT_ID_STLINKV3_BL:
-			res = libusb_open(dev, &info.stinfo_dev_handle);
-			if (res < 0) {
-				fprintf(stderr, "Can not open ST-Link v3 Bootloader!\n");
-				continue;
-			}
-			info.stinfo_ep_in = 1 | LIBUSB_ENDPOINT_IN;
-			info.stinfo_ep_out = 1 | LIBUSB_ENDPOINT_OUT;
-			info.stinfo_bl_type = STLINK_BL_V3;
-			fprintf(stderr, "ST-Link v3 Bootloader found\n");
+		case 'U': /* USB transfer recording */
+			record_file = optarg;
 			break;
-		case PRODUCT_ID_STLINKV21:
-		case PRODUCT_ID_STLINKV21_MSD:
-		case PRODUCT_ID_STLINKV3:
-		case PRODUCT_ID_STLINKV3_NO_MSD:
-		case PRODUCT_ID_STLINKV3E:
-			fprintf(stderr, "Trying to switch ST-Link/Application to bootloader\n");
-			res = libusb_open(dev, &info.stinfo_dev_handle);
-			if (res < 0) {
-				fprintf(stderr, "Can not open ST-Link/Application!\n");
-				continue;
-			}
-			if (libusb_claim_interface(info.stinfo_dev_handle, 0)) {
-				fprintf(stderr,
-					"Unable to claim USB interface. Please close all programs that "
-					"may communicate with an ST-Link dongle.\n");
-				continue;
-			}
-			const uint16_t mode = stlink_dfu_mode(info.stinfo_dev_handle, false);
-			if (mode != 0x8000U) {
-				libusb_release_interface(info.stinfo_dev_handle, 0);
-				return 0;
+		case 'D': /* Daemon mode */
+			daemon_socket = optarg;
+			break;
+		case 'b': { /* Download block size */
+			const unsigned long size = strtoul(optarg, NULL, 0);
+			if (size < 16U || size > STLINK_MAX_CHUNK_SIZE || (size & (size - 1U))) {
+				fprintf(stderr, "Invalid block size %s, must be a power of 2 from 16 to %u\n", optarg,
+					STLINK_MAX_CHUNK_SIZE);
+				return EXIT_FAILURE;
 			}
-			stlink_dfu_mode(info.stinfo_dev_handle, true);
-			libusb_release_interface(info.stinfo_dev_handle, 0);
-			libusb_free_device_list(devs, n_devs);
-			mssleep(2000);
-			goto rescan;
+			flash_options.chunk_size = size;
 			break;
-		default:
-			fprintf(stderr, "Unknown STM PID %x, please report\n", desc.idProduct);
 		}
-		if (info.stinfo_dev_handle)
+		case 'h': /* Help */
+			print_help(argv);
+			return EXIT_SUCCESS;
+			break;
+		default:
+			print_help(argv);
+			return EXIT_FAILURE;
 			break;
+		}
 	}
-	libusb_free_device_list(devs, n_devs);
-	if (!info.stinfo_dev_handle) {
-		fprintf(stderr, "No ST-Link in DFU mode found. Replug ST-Link to flash!\n");
+
+	if (optind < argc)
+		job.firmware_file = argv[optind];
+	if (flash_options.differential && !flash_options.cache_dir) {
+		fprintf(stderr, "Differential flashing (-d) needs a cache directory (-c) to keep device manifests in\n");
 		return EXIT_FAILURE;
 	}
-
-	if (libusb_claim_interface(info.stinfo_dev_handle, 0)) {
-		fprintf(stderr,
-			"Unable to claim USB interface ! Please close all programs that "
-			"may communicate with an ST-Link dongle.\n");
+	/* A stream can only be read once, so there's no sharing it between devices - unlike a compressed file */
+	if (gang && job.firmware_file && stlink_stream_wanted(job.firmware_file) &&
+		!stlink_stream_compressed(job.firmware_file)) {
+		fprintf(stderr, "Gang mode (-g) needs a firmware file, not a stream\n");
 		return EXIT_FAILURE;
 	}
-
-	if (!stlink_read_info(&info)) {
-		libusb_release_interface(info.stinfo_dev_handle, 0);
+	if (flash_options.differential && job.firmware_file && stlink_stream_wanted(job.firmware_file))
+		fprintf(stderr, "Differential flashing is not possible from a stream, flashing everything\n");
+	if (flash_options.verify && job.firmware_file && stlink_stream_wanted(job.firmware_file))
+		fprintf(stderr, "Verification is not possible from a stream, skipping it\n");
+	if (job.dump_file && strcmp(job.dump_file, "-") == 0 && job.firmware_file) {
+		fprintf(stderr, "A read-out can't go to stdout (-r -) while flashing as well\n");
+		return EXIT_FAILURE;
+	}
+	if (gang && job.dump_file && !strstr(job.dump_file, STLINK_DUMP_ID_PLACEHOLDER)) {
+		fprintf(stderr, "Gang mode (-g) needs " STLINK_DUMP_ID_PLACEHOLDER " in the read-out file name (-r)\n");
 		return EXIT_FAILURE;
 	}
-	printf("Firmware version : V%dJ%dS%d\n", info.stlink_version, info.jtag_version, info.swim_version);
-	printf("Loader version : %d\n", info.loader_version);
-	printf("ST-Link ID : ");
-	for (size_t i = 0; i < 12U; i += 4U)
-		printf("%02X%02X%02X%02X", info.id[i + 3U], info.id[i + 2U], info.id[i + 1U], info.id[i + 0U]);
-	printf("\n");
-	printf("Firmware encryption key : ");
-	for (size_t i = 0U; i < 16U; ++i)
-		printf("%02X", info.firmware_key[i]);
-	printf("\n");
+	job.flash_options = &flash_options;
+	dump_options.chunk_size = flash_options.chunk_size;
+	dump_options.block_addressing = flash_options.block_addressing;
+	job.dump_options = &dump_options;
+	discovery.all = gang;
 
-	const uint16_t mode = stlink_current_mode(&info);
-	if (mode == UINT16_MAX) {
-		libusb_release_interface(info.stinfo_dev_handle, 0);
+	if (trace_file && !stlink_trace_open(trace_file))
+		return EXIT_FAILURE;
+	/* A replay needs to flash the same way, so the options that change what goes over the bus are kept */
+	if (record_file &&
+		!stlink_record_open(record_file, flash_options.chunk_size,
+			(flash_options.block_addressing ? STLINK_RECORD_BLOCK_ADDRESSING : 0U) |
+				(flash_options.verify ? STLINK_RECORD_VERIFY : 0U))) {
+		stlink_trace_close();
 		return EXIT_FAILURE;
 	}
-	printf("Current mode : %u\n", mode);
+	libusb_context *ctx = NULL;
+	const int res = libusb_init(&ctx);
+	if (res != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to initialise libusb: %d (%s)\n", res, libusb_strerror(res));
+		stlink_trace_close();
+		stlink_record_close();
+		return 2;
+	}
+
+	if (inventory) {
+		const int result = stlink_inventory(ctx);
+		libusb_exit(ctx);
+		stlink_trace_close();
+		stlink_record_close();
+		return result;
+	}
 
-	if (mode & ~3U) {
-		printf("ST-Link dongle is not in the correct mode. Please unplug and plug the dongle again.\n");
-		libusb_release_interface(info.stinfo_dev_handle, 0);
-		return EXIT_SUCCESS;
+	if (daemon_socket) {
+		const stlink_daemon_options_s daemon_options = {
+			.socket_path = daemon_socket,
+			.jlink_switch = discovery.jlink_switch,
+			.flash_options = flash_options,
+			.pool_size = STLINK_DAEMON_POOL_SIZE,
+			.timeout_ms = job.timeout_ms,
+		};
+		const int result = stlink_daemon_run(ctx, &daemon_options);
+		libusb_exit(ctx);
+		stlink_trace_close();
+		stlink_record_close();
+		return result;
 	}
 
-	if (!probe) {
-		if (do_load)
-			stlink_flash(&info, argv[optind]);
-		stlink_exit_dfu(&info);
+	stlink_device_list_s devices = {0};
+	if (!stlink_discover(ctx, &discovery, &devices)) {
+		stlink_device_list_free(&devices);
+		libusb_exit(ctx);
+		stlink_trace_close();
+		stlink_record_close();
+		return EXIT_FAILURE;
+	}
+	if (!devices.count) {
+		fprintf(stderr, "No ST-Link in DFU mode found. Replug ST-Link to flash!\n");
+		stlink_device_list_free(&devices);
+		libusb_exit(ctx);
+		stlink_trace_close();
+		stlink_record_close();
+		return EXIT_FAILURE;
 	}
-	libusb_release_interface(info.stinfo_dev_handle, 0);
-exit_libusb:
-	libusb_exit(info.stinfo_usb_ctx);
 
-	return EXIT_SUCCESS;
+	int result;
+	if (gang) {
+		fprintf(stderr, "Starting gang run on %zu devices\n", devices.count);
+		result = stlink_run_gang(&devices, &job);
+	} else
+		result = stlink_run_device(&devices.devices[0], &job, true);
+	stlink_device_list_free(&devices);
+	libusb_exit(ctx);
+	stlink_trace_close();
+	stlink_record_close();
+	return result == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+#include <string.h>
+#include <errno.h>
+
+#include "buffer_utils.h"
+#include "image.h"
+#include "cache.h"
+#include "manifest.h"
+
+#define MANIFEST_MAGIC       "STLKMAN1"
+#define MANIFEST_HEADER_SIZE 20U
+#define MANIFEST_SUFFIX      ".stlm"
+
+/* Manifests are kept alongside the prepared image cache, named after the ST-Link ID of the device */
+static void stlink_manifest_path(
+	const char *const directory, const uint8_t *const id, char *const path, const size_t path_size)
+{
+	char id_string[25U];
+	for (size_t i = 0U; i < 12U; i += 4U)
+		sprintf(id_string + (i * 2U), "%02X%02X%02X%02X", id[i + 3U], id[i + 2U], id[i + 1U], id[i + 0U]);
+	snprintf(path, path_size, "%s/%s" MANIFEST_SUFFIX, directory, id_string);
+}
+
+bool stlink_manifest_build(const uint8_t *const firmware, const size_t length, const uint32_t base_address,
+	const size_t chunk_size, const bool *const populated, stlink_manifest_s *const manifest)
+{
+	manifest->base_address = base_address;
+	manifest->chunk_size = chunk_size;
+	manifest->chunk_count = (length + chunk_size - 1U) / chunk_size;
+	manifest->hashes = calloc(manifest->chunk_count, sizeof(uint64_t));
+	if (!manifest->hashes)
+		return false;
+
+	for (size_t i = 0U; i < manifest->chunk_count; ++i) {
+		/* Blocks we don't write keep whatever was there before, so their contents are unknown */
+		if (populated && !populated[i]) {
+			manifest->hashes[i] = STLINK_MANIFEST_UNKNOWN;
+			continue;
+		}
+		const size_t offset = i * chunk_size;
+		const size_t amount = length - offset < chunk_size ? length - offset : chunk_size;
+		manifest->hashes[i] = stlink_hash(firmware + offset, amount, 0U);
+	}
+	return true;
+}
+
+bool stlink_manifest_load(const char *const directory, const uint8_t *const id, stlink_manifest_s *const manifest)
+{
+	char path[4096U];
+	stlink_manifest_path(directory, id, path, sizeof(path));
+	FILE *const file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	bool result = false;
+	uint8_t header[MANIFEST_HEADER_SIZE];
+	struct stat file_stat;
+	if (fread(header, 1U, sizeof(header), file) != sizeof(header) || memcmp(header, MANIFEST_MAGIC, 8U) != 0 ||
+		fstat(fileno(file), &file_stat) < 0)
+		goto out;
+
+	manifest->base_address = read_le4(header, 8U);
+	manifest->chunk_size = read_le4(header, 12U);
+	manifest->chunk_count = read_le4(header, 16U);
+	/* A manifest with more or fewer hashes than it says it has can't be trusted to describe the device */
+	if ((uint64_t)file_stat.st_size != MANIFEST_HEADER_SIZE + ((uint64_t)manifest->chunk_count * 8U))
+		goto out;
+	manifest->hashes = calloc(manifest->chunk_count, sizeof(uint64_t));
+	if (!manifest->hashes)
+		goto out;
+
+	for (size_t i = 0U; i < manifest->chunk_count; ++i) {
+		uint8_t hash[8U];
+		if (fread(hash, 1U, sizeof(hash), file) != sizeof(hash)) {
+			stlink_manifest_free(manifest);
+			goto out;
+		}
+		manifest->hashes[i] = read_le4(hash, 0U) | ((uint64_t)read_le4(hash, 4U) << 32U);
+	}
+	result = true;
+
+out:
+	fclose(file);
+	return result;
+}
+
+bool stlink_manifest_store(
+	const char *const directory, const uint8_t *const id, const stlink_manifest_s *const manifest)
+{
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+		return false;
+
+	char path[4096U];
+	char temp_path[sizeof(path) + 4U];
+	stlink_manifest_path(directory, id, path, sizeof(path));
+	/* As with the image cache, write to a temporary name first so a crash never leaves a torn manifest */
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+	FILE *const file = fopen(temp_path, "wb");
+	if (!file)
+		return false;
+
+	uint8_t header[MANIFEST_HEADER_SIZE];
+	memcpy(header, MANIFEST_MAGIC, 8U);
+	write_le4(header, 8U, manifest->base_address);
+	write_le4(header, 12U, (uint32_t)manifest->chunk_size);
+	write_le4(header, 16U, (uint32_t)manifest->chunk_count);
+	bool ok = fwrite(header, 1U, sizeof(header), file) == sizeof(header);
+	for (size_t i = 0U; ok && i < manifest->chunk_count; ++i) {
+		uint8_t hash[8U];
+		write_le4(hash, 0U, (uint32_t)manifest->hashes[i]);
+		write_le4(hash, 4U, (uint32_t)(manifest->hashes[i] >> 32U));
+		ok = fwrite(hash, 1U, sizeof(hash), file) == sizeof(hash);
+	}
+	if (fclose(file) != 0)
+		ok = false;
+#ifdef _WIN32
+	/* rename() won't replace an existing file on Windows */
+	if (ok)
+		remove(path);
+#endif
+	if (!ok || rename(temp_path, path) != 0) {
+		remove(temp_path);
+		return false;
+	}
+	return true;
+}
+
+void stlink_manifest_remove(const char *const directory, const uint8_t *const id)
+{
+	char path[4096U];
+	stlink_manifest_path(directory, id, path, sizeof(path));
+	remove(path);
+}
+
+void stlink_manifest_free(stlink_manifest_s *const manifest)
+{
+	free(manifest->hashes);
+	manifest->hashes = NULL;
+	manifest->chunk_count = 0U;
+}
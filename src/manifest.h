@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * A record of what was last successfully flashed onto a device: one content hash
+ * per download block, for the image as it was laid out at base_address.
+ */
+/* Hash recorded for blocks whose contents aren't known, which never matches anything */
+#define STLINK_MANIFEST_UNKNOWN 0U
+
+typedef struct stlink_manifest {
+	uint32_t base_address;
+	size_t chunk_size;
+	size_t chunk_count;
+	uint64_t *hashes;
+} stlink_manifest_s;
+
+bool stlink_manifest_build(const uint8_t *firmware, size_t length, uint32_t base_address, size_t chunk_size,
+	const bool *populated, stlink_manifest_s *manifest);
+bool stlink_manifest_load(const char *directory, const uint8_t *id, stlink_manifest_s *manifest);
+bool stlink_manifest_store(const char *directory, const uint8_t *id, const stlink_manifest_s *manifest);
+void stlink_manifest_remove(const char *directory, const uint8_t *id);
+void stlink_manifest_free(stlink_manifest_s *manifest);
+
+#endif /*MANIFEST_H*/
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "discovery.h"
+#include "profile.h"
+
+#define STLINK_FLASH_BASE 0x08000000U
+
+/* Start addresses of the sectors making up the flash on V3 adapters (STM32F723) */
+static const uint32_t stlink_f723_sector_start[] = {
+	0x08000000U,
+	0x08004000U,
+	0x08008000U,
+	0x0800C000U,
+	0x08010000U,
+	0x08020000U,
+	0x08040000U,
+	0x08060000U,
+};
+
+/* The sector each 16 KiB granule of the STM32F723's flash falls in */
+static const uint8_t stlink_f723_sector_index[] = {
+	0U, 1U, 2U, 3U,
+	4U, 4U, 4U, 4U,
+	5U, 5U, 5U, 5U, 5U, 5U, 5U, 5U,
+	6U, 6U, 6U, 6U, 6U, 6U, 6U, 6U,
+	7U, 7U, 7U, 7U, 7U, 7U, 7U, 7U,
+};
+
+/*
+ * The known bootloaders, searched in order so a narrower loader version range can go ahead of a catch-all
+ * for the same product ID. Both have only ever been seen driven with 1 KiB blocks and an explicit address
+ * pointer per block by ST's own updater, so that's what we use unless told otherwise on the command line.
+ */
+const stlink_profile_s stlink_profiles[] = {
+	{
+		.name = "V2",
+		.product_id = PRODUCT_ID_STLINKV2,
+		.loader_min = 0U,
+		.loader_max = UINT16_MAX,
+		.type = STLINK_BL_V2,
+		.ep_in = 1U | LIBUSB_ENDPOINT_IN,
+		.ep_out = 2U | LIBUSB_ENDPOINT_OUT,
+		.aes = STLINK_AES_V2,
+		.flash_base = STLINK_FLASH_BASE,
+		/* STM32F103CB on V2-1s - V2s have the 64 KiB C8, which usually turns out to have the full 128 KiB anyway */
+		.flash_size = 0x00020000U,
+		.app_base = 0x08004000U,
+		.max_chunk_size = 1024U,
+		.block_addressing = false,
+		/* STM32F103: 1 KiB pages */
+		.page_shift = 10U,
+		.sector_start = NULL,
+		.sector_count = 0U,
+		.granule_shift = 0U,
+		.sector_index = NULL,
+		.granule_count = 0U,
+	},
+	{
+		.name = "V3",
+		.product_id = PRODUCT_ID_STLINKV3_BL,
+		.loader_min = 0U,
+		.loader_max = UINT16_MAX,
+		.type = STLINK_BL_V3,
+		.ep_in = 1U | LIBUSB_ENDPOINT_IN,
+		.ep_out = 1U | LIBUSB_ENDPOINT_OUT,
+		.aes = STLINK_AES_V3,
+		.flash_base = STLINK_FLASH_BASE,
+		.flash_size = 0x00080000U,
+		.app_base = 0x08020000U,
+		.max_chunk_size = 1024U,
+		.block_addressing = false,
+		.page_shift = 0U,
+		.sector_start = stlink_f723_sector_start,
+		.sector_count = sizeof(stlink_f723_sector_start) / sizeof(*stlink_f723_sector_start),
+		.granule_shift = 14U,
+		.sector_index = stlink_f723_sector_index,
+		.granule_count = sizeof(stlink_f723_sector_index),
+	},
+};
+
+const size_t stlink_profile_count = sizeof(stlink_profiles) / sizeof(*stlink_profiles);
+
+/* Find the profile for a bootloader. Before its version is known, pass 0 to get the first for the product ID */
+const stlink_profile_s *stlink_profile_find(const uint16_t product_id, const uint16_t loader_version)
+{
+	const stlink_profile_s *fallback = NULL;
+	for (size_t i = 0U; i < stlink_profile_count; ++i) {
+		const stlink_profile_s *const profile = &stlink_profiles[i];
+		if (profile->product_id != product_id)
+			continue;
+		if (loader_version >= profile->loader_min && loader_version <= profile->loader_max)
+			return profile;
+		if (!fallback)
+			fallback = profile;
+	}
+	return fallback;
+}
+
+/* Map a flash address onto the erase unit containing it, clamping anything outside the flash to its ends */
+size_t stlink_profile_erase_unit(const stlink_profile_s *const profile, const uint32_t address)
+{
+	const uint32_t offset = address > profile->flash_base ? address - profile->flash_base : 0U;
+	if (!profile->sector_count)
+		return offset >> profile->page_shift;
+	const size_t granule = offset >> profile->granule_shift;
+	return profile->sector_index[granule < profile->granule_count ? granule : profile->granule_count - 1U];
+}
+
+uint32_t stlink_profile_erase_unit_address(const stlink_profile_s *const profile, const size_t unit)
+{
+	if (!profile->sector_count)
+		return profile->flash_base + (uint32_t)(unit << profile->page_shift);
+	return profile->sector_start[unit];
+}
+
+/* How many erase units there are up to end_address - all of them where the flash is divided into sectors */
+size_t stlink_profile_erase_unit_count(const stlink_profile_s *const profile, const uint32_t end_address)
+{
+	if (!profile->sector_count)
+		return stlink_profile_erase_unit(profile, end_address - 1U) + 1U;
+	return profile->sector_count;
+}
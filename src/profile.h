@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Which fixed keys the loader's firmware encryption uses, and whether it adds the V3 transport layer */
+typedef enum stlink_aes_mode {
+	STLINK_AES_V2,
+	STLINK_AES_V3,
+} stlink_aes_mode_e;
+
+/*
+ * Everything that differs between one bootloader and the next: where it sits on the bus, how its flash
+ * is laid out and what it'll take. Flash is erased either in uniform pages (sector_count == 0) or in
+ * the sectors listed in sector_start. To map an address onto its sector without searching, the flash
+ * is split into granules the size of the smallest sector and sector_index gives the sector of each.
+ */
+typedef struct stlink_profile {
+	const char *name;
+	uint16_t product_id;
+	/* Range of loader versions (inclusive) the profile applies to */
+	uint16_t loader_min;
+	uint16_t loader_max;
+	bootloader_types_e type;
+	uint8_t ep_in;
+	uint8_t ep_out;
+	stlink_aes_mode_e aes;
+	uint32_t flash_base;
+	/* The largest flash the adapter's microcontroller comes with, which bounds what a read-out covers */
+	uint32_t flash_size;
+	/* Where the application area (and so a raw binary) starts, just past the loader */
+	uint32_t app_base;
+	size_t max_chunk_size;
+	/* Whether the loader honours DfuSe-style wBlockNum addressing (address = pointer + (wBlockNum - 2) * size) */
+	bool block_addressing;
+	uint8_t page_shift;
+	const uint32_t *sector_start;
+	size_t sector_count;
+	uint8_t granule_shift;
+	const uint8_t *sector_index;
+	size_t granule_count;
+} stlink_profile_s;
+
+extern const stlink_profile_s stlink_profiles[];
+extern const size_t stlink_profile_count;
+
+const stlink_profile_s *stlink_profile_find(uint16_t product_id, uint16_t loader_version);
+
+size_t stlink_profile_erase_unit(const stlink_profile_s *profile, uint32_t address);
+uint32_t stlink_profile_erase_unit_address(const stlink_profile_s *profile, size_t unit);
+size_t stlink_profile_erase_unit_count(const stlink_profile_s *profile, uint32_t end_address);
+
+#endif /*PROFILE_H*/
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "buffer_utils.h"
+#include "timing.h"
+#include "profile.h"
+#include "record.h"
+
+/* Devices get a number each, which is all a record has room for */
+#define RECORD_MAX_DEVICES 256U
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *record_file = NULL;
+static uint64_t record_epoch = 0U;
+/*
+ * Devices are told apart by their info rather than by thread, as a batch of transfers completes on whichever
+ * thread happens to be handling libusb's events at the time
+ */
+static const stlink_info_s *record_devices[RECORD_MAX_DEVICES];
+static size_t record_device_count = 0U;
+static bool record_failed = false;
+
+/* Must be called before any flashing starts, as the sink isn't locked against being swapped out */
+bool stlink_record_open(const char *const path, const size_t chunk_size, const uint8_t flags)
+{
+	FILE *const file = fopen(path, "wb");
+	if (!file) {
+		const int error = errno;
+		fprintf(stderr, "Opening USB recording %s failed (%d): %s\n", path, error, strerror(error));
+		return false;
+	}
+	uint8_t header[STLINK_RECORD_HEADER_SIZE] = {0};
+	memcpy(header, STLINK_RECORD_MAGIC, 7U);
+	header[7] = STLINK_RECORD_VERSION;
+	write_le4(header, 8, (uint32_t)chunk_size);
+	header[12] = flags;
+	if (fwrite(header, sizeof(header), 1U, file) != 1U) {
+		fprintf(stderr, "Writing USB recording %s failed\n", path);
+		fclose(file);
+		return false;
+	}
+	record_epoch = time_us();
+	record_device_count = 0U;
+	record_failed = false;
+	record_file = file;
+	return true;
+}
+
+void stlink_record_close(void)
+{
+	if (!record_file)
+		return;
+	if (fclose(record_file) != 0 || record_failed)
+		fprintf(stderr, "USB recording is incomplete, not everything could be written out\n");
+	record_file = NULL;
+}
+
+bool stlink_record_enabled(void)
+{
+	return record_file != NULL;
+}
+
+/* Find the device's number, giving it the next one (and writing out its device record) if it's new */
+static bool stlink_record_device(const stlink_info_s *const info, uint8_t *const device)
+{
+	for (size_t i = 0U; i < record_device_count; ++i) {
+		if (record_devices[i] == info) {
+			*device = (uint8_t)i;
+			return true;
+		}
+	}
+	if (record_device_count == RECORD_MAX_DEVICES)
+		return false;
+	*device = (uint8_t)record_device_count;
+	record_devices[record_device_count++] = info;
+	uint8_t record[STLINK_RECORD_DEVICE_SIZE] = {
+		'D',
+		*device,
+	};
+	write_le2(record, 2, info->stinfo_profile ? info->stinfo_profile->product_id : 0U);
+	record[4] = info->stinfo_ep_in;
+	record[5] = info->stinfo_ep_out;
+	record_failed |= fwrite(record, sizeof(record), 1U, record_file) != 1U;
+	return true;
+}
+
+/*
+ * Log one bulk transfer that ran from start_us to end_us. A transfer that never got as far as the bus
+ * (because the device had been told to stop) is left out, as replaying it would only wait for nothing.
+ */
+void stlink_record_transfer(const stlink_info_s *const info, const uint8_t endpoint, const uint8_t *const data,
+	const int length, const int actual_length, const int result, const uint64_t start_us, const uint64_t end_us)
+{
+	if (!record_file)
+		return;
+	const bool in = endpoint & LIBUSB_ENDPOINT_IN;
+	const int kept = in ? actual_length : length;
+	const size_t data_length =
+		!in && kept > (int)STLINK_RECORD_OUT_BYTES ? STLINK_RECORD_OUT_BYTES : (size_t)(kept > 0 ? kept : 0);
+	uint8_t record[STLINK_RECORD_TRANSFER_SIZE] = {
+		'T',
+		0U,
+		endpoint,
+		(uint8_t)(int8_t)result,
+	};
+	/* Write the timestamp as two halves, there being no 8 byte helper */
+	const uint64_t start = start_us > record_epoch ? start_us - record_epoch : 0U;
+	write_le4(record, 4, (uint32_t)start);
+	write_le4(record, 8, (uint32_t)(start >> 32U));
+	write_le4(record, 12, (uint32_t)(end_us - start_us));
+	write_le2(record, 16, (uint16_t)length);
+	write_le2(record, 18, (uint16_t)(actual_length > 0 ? actual_length : 0));
+	write_le2(record, 20, (uint16_t)data_length);
+
+	pthread_mutex_lock(&record_lock);
+	if (stlink_record_device(info, &record[1])) {
+		record_failed |= fwrite(record, sizeof(record), 1U, record_file) != 1U;
+		if (data_length)
+			record_failed |= fwrite(data, data_length, 1U, record_file) != 1U;
+	} else
+		record_failed = true;
+	pthread_mutex_unlock(&record_lock);
+}
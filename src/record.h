@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct stlink_info;
+
+/*
+ * USB transaction recordings: every bulk transfer on a bootloader's endpoints, with when it started,
+ * how long it took, what came of it, the first STLINK_RECORD_OUT_BYTES of what was sent (the whole of
+ * any command, but only the start of a payload) and all of what was received (status, bwPollTimeout
+ * and read-back data included). A recording of a real device can then be replayed in its place
+ * (stlink_replay_bulk()), to measure the host side of the protocol against real device timing.
+ *
+ * The file is a header followed by records, all little endian:
+ *
+ *   header:   "STLKREC" version:u8 chunk_size:u32 flags:u8 (bit 0 block addressing, bit 1 verify) reserved:u8[3]
+ *   device:   'D' device:u8 product_id:u16 ep_in:u8 ep_out:u8
+ *   transfer: 'T' device:u8 endpoint:u8 result:i8 start_us:u64 duration_us:u32 length:u16 actual:u16
+ *             data_length:u16 data:u8[data_length]
+ *
+ * Devices are numbered in the order they first make a transfer, and each gets a device record then.
+ */
+#define STLINK_RECORD_MAGIC       "STLKREC"
+#define STLINK_RECORD_VERSION     1U
+#define STLINK_RECORD_HEADER_SIZE 16U
+#define STLINK_RECORD_OUT_BYTES   16U
+/* Fixed part of each record, up to (for a transfer) its data */
+#define STLINK_RECORD_DEVICE_SIZE   6U
+#define STLINK_RECORD_TRANSFER_SIZE 22U
+
+#define STLINK_RECORD_BLOCK_ADDRESSING 0x01U
+#define STLINK_RECORD_VERIFY           0x02U
+
+bool stlink_record_open(const char *path, size_t chunk_size, uint8_t flags);
+void stlink_record_close(void);
+bool stlink_record_enabled(void);
+void stlink_record_transfer(const struct stlink_info *info, uint8_t endpoint, const uint8_t *data, int length,
+	int actual_length, int result, uint64_t start_us, uint64_t end_us);
+
+/* One transfer from a recording, pointing into the loaded file for its data */
+typedef struct stlink_replay_transfer {
+	uint8_t endpoint;
+	int8_t result;
+	uint64_t start_us;
+	uint32_t duration_us;
+	uint16_t length;
+	uint16_t actual_length;
+	uint16_t data_length;
+	const uint8_t *data;
+} stlink_replay_transfer_s;
+
+/*
+ * Stands in for one recorded device through stlink_transport_s. Each transfer gets the recorded answer after
+ * the recorded delay (scaled by time_scale). Status polls are matched by time rather than one for one, so
+ * a host polling more or less often than the recorded one sees the device finish when it really did.
+ * Anything else not going as recorded ends the replay, with every transfer after it failing.
+ */
+typedef struct stlink_replay {
+	uint8_t *file;
+	stlink_replay_transfer_s *transfers;
+	size_t count;
+	size_t next;
+	/* As recorded for the device */
+	uint16_t product_id;
+	uint8_t ep_in;
+	uint8_t ep_out;
+	size_t chunk_size;
+	uint8_t flags;
+	/* Scales every recorded delay, as a percentage - 100 for real time */
+	uint32_t time_scale;
+
+	/*
+	 * The recorded status request that started the operation being polled (a download only begins with the
+	 * first one after it), and when it was replayed. With no command since the last one, started is false.
+	 */
+	size_t trigger;
+	uint64_t trigger_us;
+	bool started;
+	/* The last busy status answered, to answer polls the recording doesn't have with */
+	uint8_t busy_status[6];
+	bool busy_seen;
+	bool busy_pending;
+	bool diverged;
+	/* How far sleeps have overshot the recorded delays, to be taken off the ones still to come */
+	uint64_t slack_us;
+
+	/* Counters for the benchmark to report */
+	size_t served;
+	size_t polls_skipped;
+	size_t polls_added;
+} stlink_replay_s;
+
+bool stlink_replay_open(const char *path, uint8_t device, uint32_t time_scale, stlink_replay_s *replay);
+int stlink_replay_bulk(void *data, uint8_t endpoint, uint8_t *buffer, int length, int *actual_length);
+uint64_t stlink_replay_recorded_us(const stlink_replay_s *replay);
+bool stlink_replay_finished(const stlink_replay_s *replay);
+void stlink_replay_free(stlink_replay_s *replay);
+
+#endif /*RECORD_H*/
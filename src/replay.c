@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libusb.h>
+
+#include "buffer_utils.h"
+#include "timing.h"
+#include "record.h"
+
+#define REPLAY_DFU_MAGIC     0xF3U
+#define REPLAY_DFU_GETSTATUS 0x03U
+#define REPLAY_COMMAND_SIZE  16U
+#define REPLAY_STATUS_SIZE   6U
+#define REPLAY_DFU_DNBUSY    4U
+#define REPLAY_NO_TRIGGER    SIZE_MAX
+
+static bool stlink_replay_load(const char *const path, uint8_t **const file, size_t *const size)
+{
+	FILE *const stream = fopen(path, "rb");
+	if (!stream) {
+		const int error = errno;
+		fprintf(stderr, "Opening USB recording %s failed (%d): %s\n", path, error, strerror(error));
+		return false;
+	}
+	size_t capacity = 65536U;
+	size_t length = 0U;
+	uint8_t *buffer = malloc(capacity);
+	while (buffer) {
+		length += fread(buffer + length, 1U, capacity - length, stream);
+		if (length < capacity)
+			break;
+		uint8_t *const grown = realloc(buffer, capacity * 2U);
+		if (!grown) {
+			free(buffer);
+			buffer = NULL;
+			break;
+		}
+		buffer = grown;
+		capacity *= 2U;
+	}
+	const bool failed = ferror(stream) != 0;
+	fclose(stream);
+	if (!buffer || failed) {
+		fprintf(stderr, "Reading USB recording %s failed\n", path);
+		free(buffer);
+		return false;
+	}
+	*file = buffer;
+	*size = length;
+	return true;
+}
+
+/*
+ * Load the recording at path and pick out everything that happened to one of the devices in it, to be
+ * replayed at time_scale percent of the recorded speed
+ */
+bool stlink_replay_open(const char *const path, const uint8_t device, const uint32_t time_scale,
+	stlink_replay_s *const replay)
+{
+	memset(replay, 0, sizeof(*replay));
+	replay->time_scale = time_scale;
+	replay->trigger = REPLAY_NO_TRIGGER;
+	replay->started = true;
+	size_t size = 0U;
+	if (!stlink_replay_load(path, &replay->file, &size))
+		return false;
+	const uint8_t *const file = replay->file;
+	if (size < STLINK_RECORD_HEADER_SIZE || memcmp(file, STLINK_RECORD_MAGIC, 7U) != 0 ||
+		file[7] != STLINK_RECORD_VERSION) {
+		fprintf(stderr, "%s is not a USB recording this version can replay\n", path);
+		stlink_replay_free(replay);
+		return false;
+	}
+	replay->chunk_size = read_le4(file, 8);
+	replay->flags = file[12];
+
+	/* Count the device's transfers first so they can be indexed in one go */
+	bool found = false;
+	size_t capacity = 0U;
+	for (size_t pass = 0U; pass < 2U; ++pass) {
+		size_t offset = STLINK_RECORD_HEADER_SIZE;
+		replay->count = 0U;
+		while (offset < size) {
+			if (file[offset] == 'D' && size - offset >= STLINK_RECORD_DEVICE_SIZE) {
+				if (file[offset + 1U] == device) {
+					replay->product_id = read_le2(file, offset + 2U);
+					replay->ep_in = file[offset + 4U];
+					replay->ep_out = file[offset + 5U];
+					found = true;
+				}
+				offset += STLINK_RECORD_DEVICE_SIZE;
+				continue;
+			}
+			/* Neither the data kept nor the count reported may exceed the length the transfer was made with */
+			if (file[offset] != 'T' || size - offset < STLINK_RECORD_TRANSFER_SIZE ||
+				size - offset - STLINK_RECORD_TRANSFER_SIZE < read_le2(file, offset + 20U) ||
+				read_le2(file, offset + 20U) > read_le2(file, offset + 16U) ||
+				read_le2(file, offset + 18U) > read_le2(file, offset + 16U)) {
+				fprintf(stderr, "USB recording %s is damaged or cut short at offset %zu\n", path, offset);
+				stlink_replay_free(replay);
+				return false;
+			}
+			const uint16_t data_length = read_le2(file, offset + 20U);
+			if (file[offset + 1U] == device) {
+				if (pass) {
+					stlink_replay_transfer_s *const transfer = &replay->transfers[replay->count];
+					transfer->endpoint = file[offset + 2U];
+					transfer->result = (int8_t)file[offset + 3U];
+					transfer->start_us = read_le4(file, offset + 4U) | ((uint64_t)read_le4(file, offset + 8U) << 32U);
+					transfer->duration_us = read_le4(file, offset + 12U);
+					transfer->length = read_le2(file, offset + 16U);
+					transfer->actual_length = read_le2(file, offset + 18U);
+					transfer->data_length = data_length;
+					transfer->data = file + offset + STLINK_RECORD_TRANSFER_SIZE;
+				}
+				++replay->count;
+			}
+			offset += STLINK_RECORD_TRANSFER_SIZE + data_length;
+		}
+		if (!found || !replay->count) {
+			fprintf(stderr, "USB recording %s has nothing from device %u\n", path, device);
+			stlink_replay_free(replay);
+			return false;
+		}
+		if (!pass) {
+			capacity = replay->count;
+			replay->transfers = malloc(capacity * sizeof(stlink_replay_transfer_s));
+			if (!replay->transfers) {
+				fprintf(stderr, "Failed to allocate USB recording index\n");
+				stlink_replay_free(replay);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void stlink_replay_free(stlink_replay_s *const replay)
+{
+	free(replay->transfers);
+	free(replay->file);
+	replay->transfers = NULL;
+	replay->file = NULL;
+	replay->count = 0U;
+}
+
+static bool stlink_replay_status_request(const uint8_t *const data, const size_t length)
+{
+	return length >= 2U && data[0] == REPLAY_DFU_MAGIC && data[1] == REPLAY_DFU_GETSTATUS;
+}
+
+static bool stlink_replay_status_pair(const stlink_replay_s *const replay, const size_t index)
+{
+	if (index + 1U >= replay->count)
+		return false;
+	const stlink_replay_transfer_s *const request = &replay->transfers[index];
+	const stlink_replay_transfer_s *const response = &replay->transfers[index + 1U];
+	return request->endpoint == replay->ep_out && request->length == REPLAY_COMMAND_SIZE &&
+		stlink_replay_status_request(request->data, request->data_length) && !request->result &&
+		response->endpoint == replay->ep_in && response->data_length == REPLAY_STATUS_SIZE && !response->result;
+}
+
+/* How long after the start of the operation being polled the device got a recorded transfer, scaled for replay */
+static uint64_t stlink_replay_offset_us(const stlink_replay_s *const replay, const size_t index)
+{
+	const uint64_t start = replay->transfers[replay->trigger].start_us;
+	const uint64_t at = replay->transfers[index].start_us;
+	return ((at > start ? at - start : 0U) * replay->time_scale) / 100U;
+}
+
+/*
+ * Take as long over a transfer as the device did. Most take a few microseconds, which no sleep is that
+ * precise about, so overshooting is made up for on later transfers rather than adding up over thousands.
+ */
+static void stlink_replay_wait(stlink_replay_s *const replay, const stlink_replay_transfer_s *const transfer)
+{
+	const uint64_t us = ((uint64_t)transfer->duration_us * replay->time_scale) / 100U;
+	if (replay->slack_us >= us) {
+		replay->slack_us -= us;
+		return;
+	}
+	const uint64_t wanted = us - replay->slack_us;
+	const uint64_t start = time_us();
+	sleep_us(wanted);
+	const uint64_t slept = time_us() - start;
+	replay->slack_us = slept > wanted ? slept - wanted : 0U;
+}
+
+/*
+ * Line a status request up with the recording. Going by how long the operation it's polling has been
+ * running, skip past any polls the recorded host made that this one didn't, or, if this one is polling
+ * sooner than the device answered anything but busy, answer it busy again without moving on.
+ * Returns false if the request is to be answered busy.
+ */
+static bool stlink_replay_status(stlink_replay_s *const replay)
+{
+	if (!stlink_replay_status_pair(replay, replay->next))
+		return true;
+	/* The request that starts the operation is always answered as recorded, and the rest are timed from it */
+	if (!replay->started) {
+		replay->started = true;
+		replay->trigger = replay->next;
+		replay->trigger_us = time_us();
+		return true;
+	}
+	if (replay->trigger == REPLAY_NO_TRIGGER)
+		return true;
+	size_t last = replay->next;
+	while (stlink_replay_status_pair(replay, last + 2U))
+		last += 2U;
+	const uint64_t elapsed = time_us() - replay->trigger_us;
+	size_t poll = replay->next;
+	while (poll < last && stlink_replay_offset_us(replay, poll + 2U) <= elapsed)
+		poll += 2U;
+	/* Only the final answer is left, and it isn't due yet */
+	const uint64_t due = stlink_replay_offset_us(replay, last);
+	if (poll == last && elapsed < due) {
+		/* Nothing busy recorded for this operation to repeat, so make it up from the final answer */
+		if (!replay->busy_seen) {
+			const uint64_t left_ms = (due - elapsed + 999U) / 1000U;
+			memcpy(replay->busy_status, replay->transfers[last + 1U].data, REPLAY_STATUS_SIZE);
+			replay->busy_status[0] = 0U;
+			write_le2(replay->busy_status, 1, (uint16_t)(left_ms > UINT16_MAX ? UINT16_MAX : left_ms));
+			replay->busy_status[3] = 0U;
+			replay->busy_status[4] = REPLAY_DFU_DNBUSY;
+		}
+		++replay->polls_added;
+		return false;
+	}
+	replay->polls_skipped += (poll - replay->next) / 2U;
+	replay->next = poll;
+	return true;
+}
+
+static int stlink_replay_diverged(
+	stlink_replay_s *const replay, const uint8_t endpoint, const int length, int *const actual_length)
+{
+	if (replay->next < replay->count) {
+		const stlink_replay_transfer_s *const expected = &replay->transfers[replay->next];
+		if (expected->endpoint == endpoint && expected->length == length)
+			fprintf(stderr, "Replay diverged at record %zu: a different request on endpoint %02x than recorded\n",
+				replay->next, endpoint);
+		else
+			fprintf(stderr,
+				"Replay diverged at record %zu: expected %u bytes on endpoint %02x, got a %d byte transfer on %02x\n",
+				replay->next, expected->length, expected->endpoint, length, endpoint);
+	} else
+		fprintf(stderr, "Replay diverged: a %d byte transfer on endpoint %02x after the end of the recording\n",
+			length, endpoint);
+	replay->diverged = true;
+	*actual_length = 0;
+	return LIBUSB_ERROR_IO;
+}
+
+/* As the device's timing is scaled, so is how long it asks to be left alone for in a status response */
+static void stlink_replay_scale_status(const stlink_replay_s *const replay, uint8_t *const status)
+{
+	const uint32_t poll_timeout_ms = status[1] | ((uint32_t)status[2] << 8U) | ((uint32_t)status[3] << 16U);
+	const uint64_t scaled_ms = (((uint64_t)poll_timeout_ms * replay->time_scale) + 99U) / 100U;
+	const uint32_t value = scaled_ms > 0xffffffU ? 0xffffffU : (uint32_t)scaled_ms;
+	status[1] = value & 0xffU;
+	status[2] = (value >> 8U) & 0xffU;
+	status[3] = (value >> 16U) & 0xffU;
+}
+
+/* stlink_transport_s bulk callback answering for the recorded device */
+int stlink_replay_bulk(
+	void *const data, const uint8_t endpoint, uint8_t *const buffer, const int length, int *const actual_length)
+{
+	stlink_replay_s *const replay = (stlink_replay_s *)data;
+	if (replay->diverged) {
+		*actual_length = 0;
+		return LIBUSB_ERROR_IO;
+	}
+	const bool in = endpoint & LIBUSB_ENDPOINT_IN;
+	const size_t out_length = in ? 0U : (size_t)length;
+
+	/* A poll answered busy that the recording doesn't have, against the device's real next answer */
+	if (replay->busy_pending) {
+		if (!in || length < (int)REPLAY_STATUS_SIZE)
+			return stlink_replay_diverged(replay, endpoint, length, actual_length);
+		replay->busy_pending = false;
+		stlink_replay_wait(replay, &replay->transfers[replay->next + 1U]);
+		memcpy(buffer, replay->busy_status, REPLAY_STATUS_SIZE);
+		*actual_length = REPLAY_STATUS_SIZE;
+		++replay->served;
+		return LIBUSB_SUCCESS;
+	}
+	if (!in && length == (int)REPLAY_COMMAND_SIZE && stlink_replay_status_request(buffer, out_length) &&
+		!stlink_replay_status(replay)) {
+		replay->busy_pending = true;
+		stlink_replay_wait(replay, &replay->transfers[replay->next]);
+		*actual_length = length;
+		++replay->served;
+		return LIBUSB_SUCCESS;
+	}
+
+	if (replay->next >= replay->count)
+		return stlink_replay_diverged(replay, endpoint, length, actual_length);
+	const stlink_replay_transfer_s *const transfer = &replay->transfers[replay->next];
+	/*
+	 * Requests have to match as far as which one it is, and the short payloads carrying a download command
+	 * (set address, erase) exactly, but block payloads (which depend on the image) are let be
+	 */
+	const size_t compare = out_length == REPLAY_COMMAND_SIZE ? 2U : out_length < REPLAY_COMMAND_SIZE ? out_length : 0U;
+	if (transfer->endpoint != endpoint || transfer->length != length ||
+		(!in && transfer->data_length >= compare && memcmp(transfer->data, buffer, compare) != 0))
+		return stlink_replay_diverged(replay, endpoint, length, actual_length);
+
+	/* Any other command sets up an operation, which the next status request will start */
+	if (!in && out_length == REPLAY_COMMAND_SIZE && buffer[0] == REPLAY_DFU_MAGIC &&
+		!stlink_replay_status_request(buffer, out_length)) {
+		replay->trigger = REPLAY_NO_TRIGGER;
+		replay->started = false;
+		replay->busy_seen = false;
+	}
+	stlink_replay_wait(replay, transfer);
+	if (in) {
+		memcpy(buffer, transfer->data, transfer->data_length);
+		const bool status = replay->next && stlink_replay_status_pair(replay, replay->next - 1U);
+		if (status)
+			stlink_replay_scale_status(replay, buffer);
+		if (status && buffer[4] == REPLAY_DFU_DNBUSY) {
+			memcpy(replay->busy_status, buffer, REPLAY_STATUS_SIZE);
+			replay->busy_seen = true;
+		}
+	}
+	*actual_length = transfer->actual_length;
+	++replay->next;
+	++replay->served;
+	return transfer->result;
+}
+
+/* How long the device's part of the recording took, from its first transfer to the end of its last */
+uint64_t stlink_replay_recorded_us(const stlink_replay_s *const replay)
+{
+	if (!replay->count)
+		return 0U;
+	const stlink_replay_transfer_s *const last = &replay->transfers[replay->count - 1U];
+	return last->start_us + last->duration_us - replay->transfers[0].start_us;
+}
+
+/* Whether the replay went as recorded all the way to the end, saying where not */
+bool stlink_replay_finished(const stlink_replay_s *const replay)
+{
+	if (replay->diverged)
+		return false;
+	if (replay->next < replay->count) {
+		fprintf(stderr, "Replay stopped %zu records short of the end of the recording\n",
+			replay->count - replay->next);
+		return false;
+	}
+	return true;
+}
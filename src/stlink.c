@@ -24,32 +24,38 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#ifdef _WIN32
-#define NOMINMAX
-#define WIN32_MEAN_AND_LEAN
-#include <io.h>
-#include <windows.h>
-#define mssleep(ms) Sleep(ms)
-#else
-#include <sys/mman.h>
-#include <unistd.h>
-#define O_BINARY O_NOCTTY
-#define mssleep(ms) usleep(ms * 1000U)
-#endif
+#include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 #include <libusb.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "crypto.h"
 #include "stlink.h"
 #include "buffer_utils.h"
+#include "timing.h"
+#include "image.h"
+#include "buffer_pool.h"
+#include "topology.h"
+#include "profile.h"
+#include "cache.h"
+#include "manifest.h"
+#include "stream.h"
+#include "layout.h"
+#include "trace.h"
+#include "record.h"
+#include "discovery.h"
 
 #define USB_TIMEOUT 5000U
+/* Status requests are answered straight away, even while the device is busy with an operation */
+#define STATUS_TIMEOUT 1000U
 
 #define DFU_DETACH    0x00U
 #define DFU_DNLOAD    0x01U
@@ -68,10 +74,291 @@
 #define ERASE_SECTOR_COMMAND        0x42U
 #define READ_UNPROTECT_COMMAND      0x92U
 
+#define DFU_STATUS_LENGTH 6U
+#define BULK_BATCH_MAX    4U
+
+#define POLL_BACKOFF_MIN_US 250U
+#define POLL_BACKOFF_MAX_US 8000U
+
+#define RETRY_BACKOFF_MIN_US 10000U
+
+/* How often a sleep or a wait on the bus wakes to check whether it's been told to stop */
+#define STOP_CHECK_US 20000U
+
+/* A single bulk transfer in a batch submitted through stlink_bulk_batch_submit() */
+typedef struct stlink_bulk_op {
+	uint8_t endpoint;
+	uint8_t *data;
+	int length;
+	int actual_length;
+} stlink_bulk_op_s;
+
+typedef struct stlink_bulk_batch {
+	stlink_info_s *info;
+	struct libusb_transfer *transfers[BULK_BATCH_MAX];
+	stlink_bulk_op_s *ops;
+	size_t op_count;
+	libusb_context *ctx;
+	size_t count;
+	size_t pending;
+	bool failed;
+	int completed;
+	/* When the last transfer in the batch completed (or the batch went out), for recording how long each took */
+	uint64_t last_us;
+} stlink_bulk_batch_s;
+
+/* Indexed by stlink_dfu_op_e */
+static const char *const stlink_op_names[STLINK_OP_COUNT] = {
+	"program",
+	"page erase",
+	"sector erase",
+	"set address",
+};
+
+/*
+ * The longest each kind of operation gets to finish in, whatever bwPollTimeout the device asks for. These are
+ * a few times what the slowest loader should take: programming a 16 KiB block or erasing a 1 KiB page on the
+ * F1, a 128 KiB sector erase on the F7 (up to 2s by the datasheet), and an address change, which is immediate.
+ */
+static const uint32_t stlink_op_budget_ms[STLINK_OP_COUNT] = {
+	1000U,
+	500U,
+	8000U,
+	500U,
+};
+
 static int stlink_erase(stlink_info_s *info, uint32_t address);
 static int stlink_set_address(stlink_info_s *info, uint32_t address);
 static bool stlink_dfu_status(stlink_info_s *info, dfu_status_s *status);
 
+/*
+ * Give the job running on the device timeout_ms from now to finish, or no limit at all for 0. Once the
+ * deadline passes, everything the device is doing gives up at the next transfer or wait, as for stlink_cancel().
+ */
+void stlink_set_deadline(stlink_info_s *const info, const uint32_t timeout_ms)
+{
+	info->stinfo_deadline_us = timeout_ms ? time_us() + ((uint64_t)timeout_ms * 1000U) : 0U;
+}
+
+/*
+ * Stop whatever the device is doing, from any thread. Transfers in flight are cancelled and nothing more is
+ * sent, so the job fails promptly and whoever's running it can let go of the device.
+ */
+void stlink_cancel(stlink_info_s *const info)
+{
+	atomic_store(&info->stinfo_cancelled, true);
+}
+
+/* Whether the job on the device has been cancelled or has run out of time */
+bool stlink_stopped(const stlink_info_s *const info)
+{
+	return atomic_load(&info->stinfo_cancelled) || (info->stinfo_deadline_us && time_us() >= info->stinfo_deadline_us);
+}
+
+/* How long something may take: limit_ms, or whatever's left of the job's time if that's less (at least 1ms) */
+uint32_t stlink_time_left_ms(const stlink_info_s *const info, const uint32_t limit_ms)
+{
+	if (!info->stinfo_deadline_us)
+		return limit_ms;
+	const uint64_t now = time_us();
+	if (now >= info->stinfo_deadline_us)
+		return 1U;
+	const uint64_t left_ms = ((info->stinfo_deadline_us - now) + 999U) / 1000U;
+	return left_ms < limit_ms ? (uint32_t)left_ms : limit_ms;
+}
+
+/* Sleep for up to us microseconds, returning false (possibly early) if the device has been told to stop */
+static bool stlink_sleep(const stlink_info_s *const info, uint64_t us)
+{
+	while (us && !stlink_stopped(info)) {
+		const uint64_t step = us < STOP_CHECK_US ? us : STOP_CHECK_US;
+		sleep_us(step);
+		us -= step;
+	}
+	return !stlink_stopped(info);
+}
+
+/* A single blocking transfer, to the device or whatever transport is standing in for it */
+static int stlink_bulk_transfer(
+	stlink_info_s *const info, const uint8_t endpoint, uint8_t *const data, const int length, int *const actual_length)
+{
+	if (stlink_stopped(info)) {
+		*actual_length = 0;
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+	const uint64_t start = stlink_record_enabled() ? time_us() : 0U;
+	const int res = info->stinfo_transport ?
+		info->stinfo_transport->bulk(info->stinfo_transport->data, endpoint, data, length, actual_length) :
+		libusb_bulk_transfer(
+			info->stinfo_dev_handle, endpoint, data, length, actual_length, stlink_time_left_ms(info, USB_TIMEOUT));
+	if (start)
+		stlink_record_transfer(info, endpoint, data, length, *actual_length, res, start, time_us());
+	return res;
+}
+
+/* What libusb_bulk_transfer() would have returned for a transfer that completed asynchronously */
+static int stlink_transfer_result(const enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Clear the halt a stall leaves an endpoint in, which otherwise fails every transfer on it until it's cleared */
+static int stlink_clear_halt(stlink_info_s *const info, const uint8_t endpoint)
+{
+	if (info->stinfo_transport)
+		return info->stinfo_transport->clear_halt ?
+			info->stinfo_transport->clear_halt(info->stinfo_transport->data, endpoint) :
+			LIBUSB_SUCCESS;
+	return libusb_clear_halt(info->stinfo_dev_handle, endpoint);
+}
+
+static void LIBUSB_CALL stlink_bulk_batch_callback(struct libusb_transfer *const transfer)
+{
+	stlink_bulk_batch_s *const batch = (stlink_bulk_batch_s *)transfer->user_data;
+	/* Transfers are run one after another, so each is taken to have started as the one before it finished */
+	if (stlink_record_enabled()) {
+		const uint64_t now = time_us();
+		stlink_record_transfer(batch->info, transfer->endpoint, transfer->buffer, transfer->length,
+			transfer->actual_length, stlink_transfer_result(transfer->status), batch->last_us, now);
+		batch->last_us = now;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED && !batch->failed) {
+		/* Something went wrong, so make sure nothing queued behind this transfer goes out */
+		batch->failed = true;
+		for (size_t i = 0U; i < batch->count; ++i) {
+			if (batch->transfers[i] != transfer)
+				libusb_cancel_transfer(batch->transfers[i]);
+		}
+	}
+	if (--batch->pending == 0U)
+		batch->completed = 1;
+}
+
+/*
+ * Submit a sequence of bulk transfers all at once, without waiting for them. Transfers on the same
+ * endpoint are run by the host controller in submission order, so this lets us queue up an entire
+ * command/payload/status exchange without a trip back through userspace between each stage. Each
+ * transfer gets timeout_ms (or what's left of the job's time). The batch must always be finished off
+ * with stlink_bulk_batch_wait(), even if submission failed.
+ */
+static void stlink_bulk_batch_submit(stlink_info_s *const info, stlink_bulk_op_s *const ops, const size_t count,
+	const uint32_t timeout_ms, stlink_bulk_batch_s *const batch)
+{
+	/* Wait our turn on a crowded hub before putting anything on the bus */
+	stlink_link_acquire(info);
+	batch->info = info;
+	batch->ops = ops;
+	batch->op_count = count;
+	batch->ctx = info->stinfo_usb_ctx;
+	batch->count = 0U;
+	batch->pending = 0U;
+	batch->failed = count > BULK_BATCH_MAX || stlink_stopped(info);
+	batch->completed = 0;
+
+	/* A stand-in transport just gets each transfer in turn, so the batch is already complete on return */
+	if (info->stinfo_transport) {
+		for (size_t i = 0U; i < count && !batch->failed; ++i)
+			batch->failed = stlink_bulk_transfer(info, ops[i].endpoint, ops[i].data, ops[i].length,
+				&ops[i].actual_length) != LIBUSB_SUCCESS;
+		batch->completed = 1;
+		return;
+	}
+
+	const uint32_t timeout = stlink_time_left_ms(info, timeout_ms);
+	for (size_t i = 0U; i < count && !batch->failed; ++i) {
+		struct libusb_transfer *const transfer = libusb_alloc_transfer(0);
+		if (!transfer) {
+			batch->failed = true;
+			break;
+		}
+		libusb_fill_bulk_transfer(transfer, info->stinfo_dev_handle, ops[i].endpoint, ops[i].data, ops[i].length,
+			stlink_bulk_batch_callback, batch, timeout);
+		batch->transfers[batch->count++] = transfer;
+	}
+
+	for (size_t i = 0U; i < batch->count && !batch->failed; ++i) {
+		if (libusb_submit_transfer(batch->transfers[i]) != LIBUSB_SUCCESS) {
+			batch->failed = true;
+			for (size_t j = 0U; j < i; ++j)
+				libusb_cancel_transfer(batch->transfers[j]);
+			break;
+		}
+		++batch->pending;
+	}
+	batch->last_us = time_us();
+	batch->completed = batch->pending ? 0 : 1;
+}
+
+/*
+ * Wait for every transfer in a submitted batch to complete, cancelling what's left of it if the device
+ * is told to stop in the meantime. Returns false if any of them failed
+ */
+static bool stlink_bulk_batch_wait(stlink_bulk_batch_s *const batch)
+{
+	while (!batch->completed) {
+		struct timeval check = {
+			.tv_sec = 0,
+			.tv_usec = STOP_CHECK_US,
+		};
+		const int res = libusb_handle_events_timeout_completed(batch->ctx, &check, &batch->completed);
+		if ((res != LIBUSB_SUCCESS || stlink_stopped(batch->info)) && !batch->failed) {
+			batch->failed = true;
+			for (size_t i = 0U; i < batch->count; ++i)
+				libusb_cancel_transfer(batch->transfers[i]);
+		}
+	}
+
+	for (size_t i = 0U; i < batch->count; ++i) {
+		batch->ops[i].actual_length = batch->transfers[i]->actual_length;
+		libusb_free_transfer(batch->transfers[i]);
+	}
+	batch->count = 0U;
+	size_t bytes = 0U;
+	for (size_t i = 0U; i < batch->op_count && i < BULK_BATCH_MAX; ++i)
+		bytes += (size_t)batch->ops[i].actual_length;
+	stlink_link_release(batch->info, bytes);
+	return !batch->failed;
+}
+
+static bool stlink_bulk_batch(
+	stlink_info_s *const info, stlink_bulk_op_s *const ops, const size_t count, const uint32_t timeout_ms)
+{
+	stlink_bulk_batch_s batch;
+	stlink_bulk_batch_submit(info, ops, count, timeout_ms, &batch);
+	return stlink_bulk_batch_wait(&batch);
+}
+
+static void stlink_dfu_status_request(uint8_t *const request)
+{
+	memset(request, 0, 16U);
+	request[0] = ST_DFU_MAGIC;
+	request[1] = DFU_GETSTATUS;
+	request[6] = DFU_STATUS_LENGTH; /* wLength */
+}
+
+static void stlink_dfu_status_decode(const uint8_t *const data, dfu_status_s *const status)
+{
+	status->bStatus = data[0];
+	status->bwPollTimeout = data[1] | ((uint32_t)data[2] << 8U) | ((uint32_t)data[3] << 16U);
+	status->bState = data[4];
+	status->iString = data[5];
+}
+
 uint16_t stlink_dfu_mode(libusb_device_handle *const dev_handle, const bool trigger)
 {
 	uint8_t data[16] = {0xf9U};
@@ -98,6 +385,7 @@ uint16_t stlink_dfu_mode(libusb_device_handle *const dev_handle, const bool trig
 
 bool stlink_read_info(stlink_info_s *info)
 {
+	const uint64_t start = time_us();
 	uint8_t data[20] = {
 		ST_DFU_INFO,
 		0x80U,
@@ -105,14 +393,14 @@ bool stlink_read_info(stlink_info_s *info)
 
 	int rw_bytes = 0;
 	/* Write */
-	int res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, 16, &rw_bytes, USB_TIMEOUT);
+	int res = stlink_bulk_transfer(info, info->stinfo_ep_out, data, 16, &rw_bytes);
 	if (res) {
 		fprintf(stderr, "stlink_read_info out transfer failure\n");
 		return false;
 	}
 
 	/* Read */
-	res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_in, data, 6, &rw_bytes, USB_TIMEOUT);
+	res = stlink_bulk_transfer(info, info->stinfo_ep_in, data, 6, &rw_bytes);
 	if (res) {
 		fprintf(stderr, "stlink_read_info in transfer failure\n");
 		return false;
@@ -134,14 +422,14 @@ bool stlink_read_info(stlink_info_s *info)
 		data[1] = 0x80U;
 
 		/* Write */
-		res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, 16, &rw_bytes, USB_TIMEOUT);
+		res = stlink_bulk_transfer(info, info->stinfo_ep_out, data, 16, &rw_bytes);
 		if (res) {
 			fprintf(stderr, "USB transfer failure\n");
 			return false;
 		}
 
 		/* Read */
-		res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_in, data, 12, &rw_bytes, USB_TIMEOUT);
+		res = stlink_bulk_transfer(info, info->stinfo_ep_in, data, 12, &rw_bytes);
 		if (res) {
 			fprintf(stderr, "USB transfer failure\n");
 			return false;
@@ -158,14 +446,14 @@ bool stlink_read_info(stlink_info_s *info)
 	data[1] = 0x08U;
 
 	/* Write */
-	res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, 16, &rw_bytes, USB_TIMEOUT);
+	res = stlink_bulk_transfer(info, info->stinfo_ep_out, data, 16, &rw_bytes);
 	if (res) {
 		fprintf(stderr, "USB transfer failure\n");
 		return false;
 	}
 
 	/* Read */
-	libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_in, data, 20, &rw_bytes, USB_TIMEOUT);
+	stlink_bulk_transfer(info, info->stinfo_ep_in, data, 20, &rw_bytes);
 	if (res) {
 		fprintf(stderr, "USB transfer failure\n");
 		return false;
@@ -176,10 +464,21 @@ bool stlink_read_info(stlink_info_s *info)
 	/* Firmware encryption key generation */
 	memcpy(info->firmware_key, data, 4);
 	memcpy(info->firmware_key + 4, data + 8, 12);
-	if (info->stlink_version < 3)
+	/* Some loader versions may need a different profile to the one picked from the product ID alone */
+	const stlink_profile_s *const profile =
+		stlink_profile_find(info->stinfo_profile->product_id, info->loader_version);
+	if (profile)
+		info->stinfo_profile = profile;
+	if (info->stinfo_profile->aes == STLINK_AES_V2)
 		stlink_aes((unsigned char *)"I am key, wawawa", info->firmware_key, 16);
 	else
 		stlink_aes((unsigned char *)" found...STlink ", info->firmware_key, 16);
+	stlink_aes_init(&info->stinfo_firmware_aes, info->firmware_key);
+	/* V3 loaders additionally wrap the firmware in a layer keyed on a fixed string */
+	stlink_aes_init(&info->stinfo_transport_aes, " .ST-Link.ver.3.");
+	memset(info->stinfo_poll_stats, 0, sizeof(info->stinfo_poll_stats));
+	stlink_trace_event(info, "read_info", start, "\"stlink_version\":%u,\"loader_version\":%u",
+		info->stlink_version, info->loader_version);
 	return true;
 }
 
@@ -189,15 +488,14 @@ uint16_t stlink_current_mode(stlink_info_s *info)
 
 	int rw_bytes = 0;
 	/* Write */
-	int res =
-		libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, sizeof(data), &rw_bytes, USB_TIMEOUT);
+	int res = stlink_bulk_transfer(info, info->stinfo_ep_out, data, sizeof(data), &rw_bytes);
 	if (res) {
 		fprintf(stderr, "USB transfer failure\n");
 		return UINT16_MAX;
 	}
 
 	/* Read */
-	res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_in, data, 2, &rw_bytes, USB_TIMEOUT);
+	res = stlink_bulk_transfer(info, info->stinfo_ep_in, data, 2, &rw_bytes);
 	if (res) {
 		fprintf(stderr, "stlink_read_info() failure\n");
 		return UINT16_MAX;
@@ -206,46 +504,163 @@ uint16_t stlink_current_mode(stlink_info_s *info)
 	return read_be2(data, 0);
 }
 
+/* The download checksum is the 16-bit sum of the bytes, worked out 16 at a time where there's a vector unit */
 uint16_t stlink_checksum(const uint8_t *const firmware, const size_t len)
 {
+	size_t offset = 0U;
 	uint16_t ret = 0;
-	for (size_t offset = 0; offset < len; ++offset)
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sums = zero;
+	for (; offset + 16U <= len; offset += 16U)
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(firmware + offset)), zero));
+	sums = _mm_add_epi64(sums, _mm_unpackhi_epi64(sums, sums));
+	ret = (uint16_t)_mm_cvtsi128_si32(sums);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint32x4_t sums = vdupq_n_u32(0U);
+	for (; offset + 16U <= len; offset += 16U)
+		sums = vpadalq_u16(sums, vpaddlq_u8(vld1q_u8(firmware + offset)));
+	ret = (uint16_t)vaddvq_u32(sums);
+#endif
+	for (; offset < len; ++offset)
 		ret += firmware[offset];
 	return ret;
 }
 
-int stlink_dfu_download(stlink_info_s *info, unsigned char *data, const size_t data_len, const uint16_t wBlockNum)
+uint16_t stlink_encrypt_chunk(const stlink_info_s *const info, uint8_t *const data, const size_t data_len)
+{
+	/* The checksum covers the data as it is after the transport layer, but before the firmware key layer */
+	const stlink_aes_ctx_s *const transport =
+		info->stinfo_profile->aes == STLINK_AES_V3 ? &info->stinfo_transport_aes : NULL;
+	return stlink_aes_encrypt_chunk(transport, &info->stinfo_firmware_aes, data, data_len);
+}
+
+int stlink_dfu_download(stlink_info_s *info, unsigned char *data, const size_t data_len, const uint16_t wBlockNum,
+	const stlink_dfu_op_e op)
+{
+	const uint16_t checksum =
+		wBlockNum >= 2 ? stlink_encrypt_chunk(info, data, data_len) : stlink_checksum(data, data_len);
+	return stlink_dfu_download_raw(info, data, data_len, wBlockNum, checksum, op);
+}
+
+/*
+ * Wait for an operation the device has reported as busy to complete. Rather than sleeping through
+ * the whole (conservative) bwPollTimeout, poll a little ahead of how long this kind of operation has
+ * actually been taking, then back off in short steps while the device still says it's busy. Once past
+ * the advertised time, fall back to polling at whatever interval the device asks for - but never past
+ * the operation's budget, as a device that's wedged can ask for minutes. The budget is all that bounds
+ * the number of polls, as a 128 KiB sector erase can take a few hundred of them.
+ */
+static bool stlink_dfu_wait(stlink_info_s *const info, const stlink_dfu_op_e op, dfu_status_s *const status)
+{
+	stlink_poll_stats_s *const stats = &info->stinfo_poll_stats[op];
+	const uint64_t start = time_us();
+	const uint64_t advertised_us = (uint64_t)status->bwPollTimeout * 1000U;
+	const uint64_t budget_us = (uint64_t)stlink_op_budget_ms[op] * 1000U;
+	stats->advertised_ms = status->bwPollTimeout;
+
+	uint64_t wait_us = stats->samples ? ((uint64_t)stats->estimate_us * 3U) / 4U : advertised_us / 4U;
+	if (wait_us > advertised_us)
+		wait_us = advertised_us;
+	uint64_t backoff_us = POLL_BACKOFF_MIN_US;
+	size_t polls = 0U;
+	bool overran = false;
+	for (;; ++polls) {
+		if (wait_us > budget_us)
+			wait_us = budget_us;
+		if (wait_us && !stlink_sleep(info, wait_us))
+			return false;
+		if (!stlink_dfu_status(info, status))
+			return false;
+		if (status->bState != dfuDNBUSY) {
+			++polls;
+			break;
+		}
+
+		const uint64_t elapsed_us = time_us() - start;
+		if (elapsed_us >= budget_us) {
+			overran = true;
+			++polls;
+			break;
+		}
+		if (elapsed_us < advertised_us) {
+			wait_us = advertised_us - elapsed_us < backoff_us ? advertised_us - elapsed_us : backoff_us;
+			if (backoff_us < POLL_BACKOFF_MAX_US)
+				backoff_us *= 2U;
+		} else {
+			wait_us = (uint64_t)status->bwPollTimeout * 1000U;
+			if (wait_us < POLL_BACKOFF_MIN_US)
+				wait_us = POLL_BACKOFF_MIN_US;
+		}
+		if (wait_us > budget_us - elapsed_us)
+			wait_us = budget_us - elapsed_us;
+	}
+
+	if (status->bState != dfuDNBUSY) {
+		const uint32_t busy_us = (uint32_t)(time_us() - start);
+		/* Exponentially weighted moving average, so the estimate tracks the device without jumping about */
+		stats->estimate_us = stats->samples ? ((stats->estimate_us * 7U) + busy_us) / 8U : busy_us;
+		if (busy_us > stats->max_us)
+			stats->max_us = busy_us;
+		stats->total_us += busy_us;
+		++stats->samples;
+	}
+	stlink_trace_event(info, "poll", start,
+		"\"op\":\"%s\",\"poll_timeout_ms\":%" PRIu32 ",\"polls\":%zu,\"state\":%d", stlink_op_names[op],
+		stats->advertised_ms, polls, status->bState);
+	if (overran) {
+		fprintf(stderr, "Device still busy with %s after %" PRIu32 "ms, giving up on it\n", stlink_op_names[op],
+			stlink_op_budget_ms[op]);
+		return false;
+	}
+	return true;
+}
+
+void stlink_print_poll_stats(const stlink_info_s *const info)
 {
-	if (wBlockNum >= 2 && info->stlink_version == 3)
-		stlink_aes((uint8_t *)" .ST-Link.ver.3.", data, data_len);
+	for (size_t op = 0U; op < STLINK_OP_COUNT; ++op) {
+		const stlink_poll_stats_s *const stats = &info->stinfo_poll_stats[op];
+		if (!stats->samples)
+			continue;
+		printf("Busy time for %s: %" PRIu32 " samples, average %" PRIu64 "us, max %" PRIu32
+			   "us (advertised %" PRIu32 "ms)\n",
+			stlink_op_names[op], stats->samples, stats->total_us / stats->samples, stats->max_us, stats->advertised_ms);
+	}
+}
 
+static int stlink_dfu_download_exchange(stlink_info_s *const info, uint8_t *const data, const size_t data_len,
+	const uint16_t wBlockNum, const uint16_t checksum, const stlink_dfu_op_e op)
+{
 	uint8_t download_request[16] = {
 		ST_DFU_MAGIC,
 		DFU_DNLOAD,
 	};
-	write_le2(download_request, 2, wBlockNum);                       /* wValue */
-	write_le2(download_request, 4, stlink_checksum(data, data_len)); /* wIndex */
-	write_le2(download_request, 6, data_len);                        /* wLength */
+	write_le2(download_request, 2, wBlockNum); /* wValue */
+	write_le2(download_request, 4, checksum);  /* wIndex */
+	write_le2(download_request, 6, data_len);  /* wLength */
 
-	if (wBlockNum >= 2)
-		stlink_aes(info->firmware_key, data, data_len);
-
-	int rw_bytes = 0;
-	int res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, download_request,
-		sizeof(download_request), &rw_bytes, USB_TIMEOUT);
-	if (res || rw_bytes != sizeof(download_request)) {
+	/*
+	 * Queue the request, its payload and the first status poll (which triggers the operation) in one go,
+	 * so the device never idles waiting for the host to get round to sending the next stage
+	 */
+	uint8_t status_request[16];
+	stlink_dfu_status_request(status_request);
+	uint8_t status_response[DFU_STATUS_LENGTH];
+	stlink_bulk_op_s ops[4] = {
+		{info->stinfo_ep_out, download_request, sizeof(download_request), 0},
+		{info->stinfo_ep_out, data, (int)data_len, 0},
+		{info->stinfo_ep_out, status_request, sizeof(status_request), 0},
+		{info->stinfo_ep_in, status_response, sizeof(status_response), 0},
+	};
+	if (!stlink_bulk_batch(info, ops, 4U, USB_TIMEOUT) || ops[0].actual_length != sizeof(download_request) ||
+		ops[1].actual_length != (int)data_len || ops[2].actual_length != sizeof(status_request) ||
+		ops[3].actual_length != sizeof(status_response)) {
 		fprintf(stderr, "USB transfer failure\n");
 		return -1;
 	}
-	res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, data_len, &rw_bytes, USB_TIMEOUT);
-	if (res || rw_bytes != (int)data_len) {
-		fprintf(stderr, "USB transfer failure 1\n");
-		return -1;
-	}
 
 	dfu_status_s dfu_status;
-	if (!stlink_dfu_status(info, &dfu_status))
-		return -1;
+	stlink_dfu_status_decode(status_response, &dfu_status);
 
 	if (dfu_status.bState != dfuDNBUSY) {
 		fprintf(stderr, "Unexpected DFU state : %d\n", dfu_status.bState);
@@ -257,9 +672,7 @@ int stlink_dfu_download(stlink_info_s *info, unsigned char *data, const size_t d
 		return -3;
 	}
 
-	mssleep(dfu_status.bwPollTimeout);
-
-	if (!stlink_dfu_status(info, &dfu_status))
+	if (!stlink_dfu_wait(info, op, &dfu_status))
 		return -1;
 
 	if (dfu_status.bState == dfuDNLOAD_IDLE)
@@ -274,38 +687,115 @@ int stlink_dfu_download(stlink_info_s *info, unsigned char *data, const size_t d
 	return -3;
 }
 
+int stlink_dfu_download_raw(stlink_info_s *const info, uint8_t *const data, const size_t data_len,
+	const uint16_t wBlockNum, const uint16_t checksum, const stlink_dfu_op_e op)
+{
+	const uint64_t start = time_us();
+	const int res = stlink_dfu_download_exchange(info, data, data_len, wBlockNum, checksum, op);
+	/* Erases and address changes are recorded by their callers, which know what they were aimed at */
+	if (op == STLINK_OP_PROGRAM)
+		stlink_trace_event(info, "download", start, "\"block\":%u,\"length\":%zu,\"result\":%d", wBlockNum,
+			data_len, res);
+	return res;
+}
+
 bool stlink_dfu_status(stlink_info_s *const info, dfu_status_s *const status)
+{
+	uint8_t request[16];
+	stlink_dfu_status_request(request);
+	uint8_t response[DFU_STATUS_LENGTH];
+	stlink_bulk_op_s ops[2] = {
+		{info->stinfo_ep_out, request, sizeof(request), 0},
+		{info->stinfo_ep_in, response, sizeof(response), 0},
+	};
+	if (!stlink_bulk_batch(info, ops, 2U, STATUS_TIMEOUT) || ops[0].actual_length != sizeof(request) ||
+		ops[1].actual_length != sizeof(response)) {
+		fprintf(stderr, "USB transfer failure\n");
+		return false;
+	}
+
+	stlink_dfu_status_decode(response, status);
+	return true;
+}
+
+/*
+ * Put the device back in dfuIDLE. Reads (DFU UPLOAD) can only be started from there, and leave the
+ * device in dfuUPLOAD_IDLE, which has to be aborted out of before any further download commands.
+ */
+bool stlink_dfu_abort(stlink_info_s *const info)
 {
 	uint8_t data[16] = {
 		ST_DFU_MAGIC,
-		DFU_GETSTATUS,
+		DFU_ABORT,
 	};
-	data[6] = 0x06; /* wLength */
 
 	int rw_bytes = 0;
-	int res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, 16, &rw_bytes, USB_TIMEOUT);
+	const int res = stlink_bulk_transfer(info, info->stinfo_ep_out, data, 16, &rw_bytes);
 	if (res || rw_bytes != 16) {
 		fprintf(stderr, "USB transfer failure\n");
 		return false;
 	}
-	res = libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_in, data, 6, &rw_bytes, USB_TIMEOUT);
-	if (res || rw_bytes != 6) {
+	return true;
+}
+
+/* A DFU UPLOAD in flight, so the next can be queued up behind it before it's collected */
+typedef struct stlink_upload {
+	const stlink_info_s *info;
+	uint64_t start_us;
+	uint8_t request[16];
+	stlink_bulk_op_s ops[2];
+	stlink_bulk_batch_s batch;
+} stlink_upload_s;
+
+/* Read a block back from the address pointer, offset (as for downloads) by wBlockNum - 2 blocks */
+static void stlink_dfu_upload_submit(stlink_info_s *const info, stlink_upload_s *const upload, uint8_t *const data,
+	const size_t data_len, const uint16_t wBlockNum)
+{
+	upload->info = info;
+	upload->start_us = time_us();
+	memset(upload->request, 0, sizeof(upload->request));
+	upload->request[0] = ST_DFU_MAGIC;
+	upload->request[1] = DFU_UPLOAD;
+	write_le2(upload->request, 2, wBlockNum); /* wValue */
+	write_le2(upload->request, 6, data_len);  /* wLength */
+	upload->ops[0] = (stlink_bulk_op_s){info->stinfo_ep_out, upload->request, sizeof(upload->request), 0};
+	upload->ops[1] = (stlink_bulk_op_s){info->stinfo_ep_in, data, (int)data_len, 0};
+	stlink_bulk_batch_submit(info, upload->ops, 2U, USB_TIMEOUT, &upload->batch);
+}
+
+/* Collect a queued upload. A loader that refuses reads either stalls or comes back short */
+static int stlink_dfu_upload_finish(stlink_upload_s *const upload)
+{
+	const bool transferred = stlink_bulk_batch_wait(&upload->batch);
+	stlink_trace_event(upload->info, "upload", upload->start_us, "\"length\":%d,\"received\":%d",
+		upload->ops[1].length, upload->ops[1].actual_length);
+	if (!transferred || upload->ops[0].actual_length != upload->ops[0].length) {
 		fprintf(stderr, "USB transfer failure\n");
-		return false;
+		return -1;
+	}
+	if (upload->ops[1].actual_length != upload->ops[1].length) {
+		fprintf(stderr, "Short read (%d of %d bytes), bootloader may not support read-back\n",
+			upload->ops[1].actual_length, upload->ops[1].length);
+		return -2;
 	}
+	return 0;
+}
 
-	status->bStatus = data[0];
-	status->bwPollTimeout = data[1] | ((uint32_t)data[2] << 8U) | ((uint32_t)data[3] << 16U);
-	status->bState = data[4];
-	status->iString = data[5];
-	return true;
+int stlink_dfu_upload(stlink_info_s *const info, uint8_t *const data, const size_t data_len, const uint16_t wBlockNum)
+{
+	stlink_upload_s upload;
+	stlink_dfu_upload_submit(info, &upload, data, data_len, wBlockNum);
+	return stlink_dfu_upload_finish(&upload);
 }
 
 int stlink_erase(stlink_info_s *const info, const uint32_t address)
 {
+	const uint64_t start = time_us();
 	uint8_t command[5] = {ERASE_COMMAND};
 	write_le4(command, 1, address);
-	return stlink_dfu_download(info, command, sizeof(command), 0);
+	const int res = stlink_dfu_download(info, command, sizeof(command), 0, STLINK_OP_ERASE);
+	stlink_trace_event(info, "erase", start, "\"address\":%" PRIu32 ",\"result\":%d", address, res);
+	return res;
 }
 
 int stlink_sector_erase(stlink_info_s *const info, const uint32_t sector)
@@ -314,128 +804,740 @@ int stlink_sector_erase(stlink_info_s *const info, const uint32_t sector)
 		ERASE_SECTOR_COMMAND,
 		sector & 0xffU,
 	};
-	return stlink_dfu_download(info, command, sizeof(command), 0);
+	const uint64_t start = time_us();
+	const int res = stlink_dfu_download(info, command, sizeof(command), 0, STLINK_OP_SECTOR_ERASE);
+	stlink_trace_event(info, "sector_erase", start, "\"sector\":%" PRIu32 ",\"result\":%d", sector, res);
+	return res;
 }
 
 int stlink_set_address(stlink_info_s *const info, const uint32_t address)
 {
+	const uint64_t start = time_us();
 	uint8_t command[5] = {SET_ADDRESS_POINTER_COMMAND};
 	write_le4(command, 1, address);
-	return stlink_dfu_download(info, command, sizeof(command), 0);
+	const int res = stlink_dfu_download(info, command, sizeof(command), 0, STLINK_OP_SET_ADDRESS);
+	stlink_trace_event(info, "set_address", start, "\"address\":%" PRIu32 ",\"result\":%d", address, res);
+	return res;
 }
 
-int stlink_flash(stlink_info_s *info, const char *filename)
+size_t stlink_max_chunk_size(const stlink_info_s *const info)
 {
-	const int fd = open(filename, O_RDONLY | O_BINARY);
-	if (fd == -1) {
-		const int error = errno;
-		fprintf(stderr, "Opening file failed (%d): %s\n", error, strerror(error));
-		return -1;
+	return info->stinfo_profile->max_chunk_size;
+}
+
+/* Map a flash address onto the erase unit containing it: a page or a sector, depending on the loader */
+static size_t stlink_erase_unit(const stlink_info_s *const info, const uint32_t address)
+{
+	return stlink_profile_erase_unit(info->stinfo_profile, address);
+}
+
+static uint32_t stlink_erase_unit_address(const stlink_info_s *const info, const size_t unit)
+{
+	return stlink_profile_erase_unit_address(info->stinfo_profile, unit);
+}
+
+static size_t stlink_erase_unit_count(const stlink_info_s *const info, const uint32_t end_address)
+{
+	return stlink_profile_erase_unit_count(info->stinfo_profile, end_address);
+}
+
+/* Check if any of the erase units covered by a block are marked for (re)writing */
+static bool stlink_chunk_dirty(
+	const stlink_info_s *const info, const bool *const dirty, const uint32_t address, const size_t length)
+{
+	if (!dirty)
+		return true;
+	const size_t last = stlink_erase_unit(info, address + (uint32_t)length - 1U);
+	for (size_t unit = stlink_erase_unit(info, address); unit <= last; ++unit) {
+		if (dirty[unit])
+			return true;
 	}
+	return false;
+}
 
-	struct stat file_stat;
-	if (fstat(fd, &file_stat) < 0 || file_stat.st_size <= 0) {
-		const int error = errno;
-		fprintf(stderr, "Failed to get firmware file length (%d): %s\n", error, strerror(error));
-		return -1;
+static void stlink_mark_dirty(
+	const stlink_info_s *const info, bool *const dirty, const uint32_t address, const size_t length)
+{
+	const size_t last = stlink_erase_unit(info, address + (uint32_t)length - 1U);
+	for (size_t unit = stlink_erase_unit(info, address); unit <= last; ++unit)
+		dirty[unit] = true;
+}
+
+/*
+ * Compare the image we're about to write against the manifest of what was last written to the device,
+ * and work out which erase units differ. Returns an array indexed by erase unit, true meaning "must be
+ * rewritten", or NULL if the comparison couldn't be done (in which case everything gets written).
+ */
+static bool *stlink_flash_plan_differential(
+	const stlink_info_s *const info, const stlink_manifest_s *const current, const stlink_manifest_s *const previous)
+{
+	const size_t chunk_size = current->chunk_size;
+	size_t chunk_count = current->chunk_count;
+	if (previous->chunk_count > chunk_count)
+		chunk_count = previous->chunk_count;
+	const uint32_t end_address = current->base_address + (uint32_t)(chunk_count * chunk_size);
+	bool *const dirty = calloc(stlink_erase_unit_count(info, end_address), sizeof(bool));
+	if (!dirty)
+		return NULL;
+
+	for (size_t i = 0U; i < current->chunk_count; ++i) {
+		const uint32_t address = current->base_address + (uint32_t)(i * chunk_size);
+		if (i >= previous->chunk_count || current->hashes[i] != previous->hashes[i])
+			stlink_mark_dirty(info, dirty, address, chunk_size);
+	}
+	/*
+	 * Anything left over from a longer previous image would survive in a skipped erase unit shared with
+	 * the new image, so catch that. Units wholly past the end of the new image are never touched anyway.
+	 */
+	for (size_t i = current->chunk_count; i < previous->chunk_count; ++i) {
+		const uint32_t address = previous->base_address + (uint32_t)(i * chunk_size);
+		stlink_mark_dirty(info, dirty, address, chunk_size);
 	}
-	const size_t file_size = (size_t)file_stat.st_size;
+	return dirty;
+}
 
-#ifdef _WIN32
-	const HANDLE file_handle = (HANDLE)_get_osfhandle(fd);
-	HANDLE mapping =
-		CreateFileMappingA(file_handle, NULL, PAGE_READONLY, file_size >> 32U, file_size & UINT32_MAX, NULL);
-	if (mapping == INVALID_HANDLE_VALUE) {
-		DWORD error = GetLastError();
-		fprintf(stderr, "Failed to memory map firmware (%lu)\n", error);
-		return -1;
+/*
+ * Get the device back to dfuIDLE after a command failed, so it can be retried, backing off for longer
+ * with each consecutive failure. Returns false once out of retries, if the device has stopped answering,
+ * or if it's been told to stop.
+ */
+static bool stlink_flash_recover(stlink_info_s *const info, size_t *const retries)
+{
+	if (*retries >= STLINK_FLASH_RETRIES || !stlink_sleep(info, (uint64_t)RETRY_BACKOFF_MIN_US << *retries))
+		return false;
+	++*retries;
+	fprintf(stderr, "Retrying (attempt %zu of %u)\n", *retries, STLINK_FLASH_RETRIES);
+
+	uint8_t request[16] = {
+		ST_DFU_MAGIC,
+		DFU_CLRSTATUS,
+	};
+	int rw_bytes = 0;
+	dfu_status_s status;
+	/* The device refusing a request stalls the endpoint carrying it, so both have to be cleared before anything */
+	if (stlink_clear_halt(info, info->stinfo_ep_out) || stlink_clear_halt(info, info->stinfo_ep_in) ||
+		stlink_bulk_transfer(info, info->stinfo_ep_out, request, sizeof(request), &rw_bytes) ||
+		!stlink_dfu_abort(info) || !stlink_dfu_status(info, &status))
+		return false;
+	return status.bState == dfuIDLE;
+}
+
+/* Transfer failures and lost status replies are worth retrying. Errors the device reports (-3) aren't */
+static bool stlink_flash_transient(const int res)
+{
+	return res == -1 || res == -2;
+}
+
+static int stlink_flash_erase_unit(stlink_info_s *const info, const size_t unit)
+{
+	const uint32_t unit_address = stlink_erase_unit_address(info, unit);
+	if (info->stinfo_profile->sector_count) {
+		const int res = stlink_sector_erase(info, unit);
+		if (res) {
+			fprintf(stderr, "Erase sector %zu failed\n", unit);
+			return res;
+		}
+		char id[STLINK_ID_LENGTH];
+		stlink_format_id(info->id, id);
+		fprintf(stderr, "%s: erased sector %zu\n", id, unit);
+	} else {
+		const int res = stlink_erase(info, unit_address);
+		if (res) {
+			fprintf(stderr, "Erase error at 0x%08" PRIx32 "\n", unit_address);
+			return res;
+		}
 	}
+	return 0;
+}
 
-	const uint8_t *const firmware = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0U, 0U, 0U);
-	if (firmware == NULL) {
-		DWORD error = GetLastError();
-		fprintf(stderr, "Failed to memory map firmware (%lu)\n", error);
-		return -1;
+/*
+ * Erase every page or sector the block at `address` touches that hasn't been erased already.
+ * Blocks must come in address order, with `next_unit` (starting at 0) tracking how far erasing has got.
+ * Mass erase is deliberately never used as the bootloaders don't guarantee it leaves themselves intact.
+ * Erasing is idempotent, so when `retry` is set a failed erase is just tried again.
+ */
+static int stlink_flash_erase_block(stlink_info_s *const info, const uint32_t address, const size_t chunk_size,
+	const bool *const dirty, size_t *const next_unit, const bool retry)
+{
+	const uint32_t end_address = address + (uint32_t)chunk_size;
+	const size_t last = stlink_erase_unit(info, end_address - 1U);
+	size_t unit = stlink_erase_unit(info, address);
+	if (unit < *next_unit)
+		unit = *next_unit;
+	for (; unit <= last; ++unit) {
+		*next_unit = unit + 1U;
+		if (dirty && !dirty[unit])
+			continue;
+		size_t retries = 0U;
+		int res = stlink_flash_erase_unit(info, unit);
+		while (retry && stlink_flash_transient(res) && stlink_flash_recover(info, &retries))
+			res = stlink_flash_erase_unit(info, unit);
+		if (res)
+			return res;
 	}
-#else
-	const uint8_t *const firmware = (const uint8_t *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (firmware == MAP_FAILED) {
-		const int error = errno;
-		fprintf(stderr, "Failed to memory map firmware (%d): %s\n", error, strerror(error));
-		return -1;
+	return 0;
+}
+
+/*
+ * Plan and issue every erase blocks [from, to) of the image need, in one run ahead of programming them.
+ * Sparse images only have erased what their blocks touch, leaving the gaps between them alone.
+ */
+static int stlink_flash_erase(stlink_info_s *const info, const stlink_image_s *const image, const size_t from,
+	const size_t to, const bool *const dirty)
+{
+	size_t next_unit = 0U;
+	for (size_t i = from; i < to; ++i) {
+		const int res =
+			stlink_flash_erase_block(info, image->chunks[i].address, image->chunk_size, dirty, &next_unit, true);
+		if (res)
+			return res;
 	}
-#endif
+	return 0;
+}
+
+/*
+ * Find the first block sharing an erase unit with the start of the given block. That's where programming
+ * has to go back to if the block is in doubt, as the unit has to be erased again to rewrite any of it.
+ */
+static size_t stlink_flash_unit_start(const stlink_info_s *const info, const stlink_image_s *const image, size_t index)
+{
+	const size_t unit = stlink_erase_unit(info, image->chunks[index].address);
+	while (index &&
+		stlink_erase_unit(info, image->chunks[index - 1U].address + (uint32_t)image->chunk_size - 1U) >= unit)
+		--index;
+	return index;
+}
+
+/*
+ * With block addressing, the address pointer only needs setting at the start of each contiguous run
+ * of blocks - the block number then selects where in the run each one goes. Otherwise every block
+ * gets its own pointer and is sent as block 2.
+ */
+typedef struct stlink_programmer {
+	bool block_addressing;
+	uint32_t next_address;
+	uint16_t block;
+} stlink_programmer_s;
+
+static void stlink_programmer_init(
+	stlink_programmer_s *const programmer, const stlink_info_s *const info, const stlink_flash_options_s *const options)
+{
+	programmer->block_addressing = options->block_addressing || info->stinfo_profile->block_addressing;
+	programmer->next_address = 0U;
+	programmer->block = UINT16_MAX;
+}
+
+static int stlink_program_block(stlink_info_s *const info, stlink_programmer_s *const programmer,
+	const uint32_t address, uint8_t *const data, const size_t length, const uint16_t checksum)
+{
+	if (programmer->block_addressing && programmer->block != UINT16_MAX && address == programmer->next_address)
+		++programmer->block;
+	else {
+		const int res = stlink_set_address(info, address);
+		if (res) {
+			fprintf(stderr, "set address error at 0x%08" PRIx32 "\n", address);
+			return res;
+		}
+		programmer->block = 2U;
+	}
+	programmer->next_address = address + (uint32_t)length;
+	const int res = stlink_dfu_download_raw(info, data, length, programmer->block, checksum, STLINK_OP_PROGRAM);
+	if (res)
+		fprintf(stderr, "Download error at 0x%08" PRIx32 "\n", address);
+	return res;
+}
+
+/* Check a block read back from the device against the plaintext it was prepared from, 0xff padding and all */
+static int stlink_verify_block(
+	const stlink_layout_s *const layout, const uint32_t address, const uint8_t *const actual, const size_t length)
+{
+	const size_t offset = address - layout->address;
+	const size_t amount = layout->length - offset < length ? layout->length - offset : length;
+	if (!memcmp(layout->data + offset, actual, amount) && stlink_block_blank(actual + amount, length - amount))
+		return 0;
 
-	printf("Type %s\n", info->stinfo_bl_type == STLINK_BL_V3 ? "V3" : "V2");
-	uint32_t base_offset = info->stinfo_bl_type == STLINK_BL_V3 ? 0x08020000U : 0x08004000U;
-	const size_t chunk_size = 1U << 10U;
-	uint8_t chunk_buffer[1024U];
-	size_t amount = chunk_size;
-	for (size_t flashed_bytes = 0; flashed_bytes < file_size; flashed_bytes += amount) {
-		if (flashed_bytes + chunk_size > file_size)
-			amount = file_size - flashed_bytes;
-
-		if (info->stinfo_bl_type == STLINK_BL_V3) {
-			uint32_t address = base_offset + flashed_bytes;
-			static const uint32_t sector_start[8] = {
-				0x08000000U,
-				0x08004000U,
-				0x08008000U,
-				0x0800C000U,
-				0x08010000U,
-				0x08020000U,
-				0x08040000U,
-				0x08060000U,
-			};
-			size_t sector = SIZE_MAX;
-			size_t i;
-			for (i = 0; i < 8; i++) {
-				if (sector_start[i] == address) {
-					sector = i;
+	size_t mismatch = 0U;
+	while (mismatch < length && actual[mismatch] == (mismatch < amount ? layout->data[offset + mismatch] : 0xffU))
+		++mismatch;
+	fprintf(stderr, "Verify failed at 0x%08" PRIx32 "\n", address + (uint32_t)mismatch);
+	return -4;
+}
+
+/* Which blocks to read back: those of an image if there is one, otherwise count blocks on from base_address */
+typedef struct stlink_read_plan {
+	const stlink_image_s *image;
+	uint32_t base_address;
+	size_t count;
+	size_t chunk_size;
+	bool block_addressing;
+} stlink_read_plan_s;
+
+static uint32_t stlink_read_address(const stlink_read_plan_s *const plan, const size_t index)
+{
+	if (plan->image)
+		return plan->image->chunks[index].address;
+	return plan->base_address + (uint32_t)(index * plan->chunk_size);
+}
+
+/* Collect a queued read-back and hand it on */
+static int stlink_read_collect(stlink_upload_s *const upload, const stlink_read_plan_s *const plan,
+	const size_t index, const uint8_t *const block, const stlink_block_sink_t sink, void *const data)
+{
+	const int res = stlink_dfu_upload_finish(upload);
+	if (res)
+		return res;
+	return sink(data, stlink_read_address(plan, index), block, plan->chunk_size);
+}
+
+/*
+ * Read back blocks through DFU UPLOAD and hand them to a sink. Each upload is queued before the previous
+ * one is handed over, so the sink gets on with it while the next block is on the wire. Only runs of blocks
+ * the block number can address get queued back to back like this though, as moving the address pointer
+ * means dropping out of upload mode first.
+ */
+static int stlink_read_blocks(stlink_info_s *const info, const stlink_read_plan_s *const plan,
+	const stlink_block_sink_t sink, void *const data)
+{
+	const size_t chunk_size = plan->chunk_size;
+	/* Read straight into the device's transfer buffers where they've room, so the kernel needn't copy */
+	uint8_t fallback[2][STLINK_MAX_CHUNK_SIZE];
+	uint8_t *buffers[2];
+	buffers[0] = stlink_buffer_pool_alloc(&info->stinfo_buffers, chunk_size);
+	buffers[1] = stlink_buffer_pool_alloc(&info->stinfo_buffers, chunk_size);
+	if (!buffers[0] || !buffers[1]) {
+		buffers[0] = fallback[0];
+		buffers[1] = fallback[1];
+	}
+	stlink_upload_s uploads[2];
+	size_t pending = SIZE_MAX;
+	uint32_t next_address = 0U;
+	uint16_t block = 0U;
+	int res = 0;
+	for (size_t i = 0U; !res && i < plan->count; ++i) {
+		const uint32_t address = stlink_read_address(plan, i);
+		if (plan->block_addressing && block && address == next_address && block < UINT16_MAX)
+			++block;
+		else {
+			if (pending != SIZE_MAX) {
+				res = stlink_read_collect(&uploads[pending & 1U], plan, pending, buffers[pending & 1U], sink, data);
+				pending = SIZE_MAX;
+				if (res)
 					break;
-				}
 			}
-			if (i < 8) {
-				const int res = stlink_sector_erase(info, sector);
-				if (res) {
-					fprintf(stderr, "Erase sector %zu failed\n", sector);
-					return res;
-				}
-				printf("Erase sector %zu done\n", sector);
-			}
-		} else {
-			const int res = stlink_erase(info, base_offset + flashed_bytes);
+			/*
+			 * Moving the address pointer is a download, which can't be issued from dfuUPLOAD_IDLE, and
+			 * uploads can't be started from the dfuDNLOAD_IDLE that leaves behind, so abort either side
+			 */
+			if (!stlink_dfu_abort(info))
+				return -1;
+			res = stlink_set_address(info, address);
 			if (res) {
-				fprintf(stderr, "Erase error at 0x%08zx\n", base_offset + flashed_bytes);
-				return res;
+				fprintf(stderr, "set address error at 0x%08" PRIx32 "\n", address);
+				break;
 			}
+			if (!stlink_dfu_abort(info))
+				return -1;
+			block = 2U;
 		}
-		int res = stlink_set_address(info, base_offset + flashed_bytes);
-		if (res) {
-			fprintf(stderr, "set address error at 0x%08zx\n", base_offset + flashed_bytes);
-			return res;
+		next_address = address + (uint32_t)chunk_size;
+		stlink_dfu_upload_submit(info, &uploads[i & 1U], buffers[i & 1U], chunk_size, block);
+		if (pending != SIZE_MAX)
+			res = stlink_read_collect(&uploads[pending & 1U], plan, pending, buffers[pending & 1U], sink, data);
+		pending = i;
+	}
+	/* Whatever happened, the last upload queued still has to be collected */
+	if (pending != SIZE_MAX) {
+		const int last = stlink_read_collect(&uploads[pending & 1U], plan, pending, buffers[pending & 1U], sink, data);
+		if (!res)
+			res = last;
+	}
+	/* Leave the device ready for whatever comes next, including clearing the halt a refused read leaves behind */
+	if (res) {
+		stlink_clear_halt(info, info->stinfo_ep_out);
+		stlink_clear_halt(info, info->stinfo_ep_in);
+	}
+	if (!stlink_dfu_abort(info) && !res)
+		res = -1;
+	return res;
+}
+
+/* Read count blocks of flash back from address on, handing each to sink in turn */
+int stlink_read_flash(stlink_info_s *const info, const uint32_t address, const size_t count, const size_t chunk_size,
+	const bool block_addressing, const stlink_block_sink_t sink, void *const data)
+{
+	const stlink_read_plan_s plan = {
+		.image = NULL,
+		.base_address = address,
+		.count = count,
+		.chunk_size = chunk_size,
+		.block_addressing = block_addressing || info->stinfo_profile->block_addressing,
+	};
+	return stlink_read_blocks(info, &plan, sink, data);
+}
+
+typedef struct stlink_verify {
+	const stlink_layout_s *layout;
+	size_t verified;
+} stlink_verify_s;
+
+static int stlink_verify_sink(void *const data, const uint32_t address, const uint8_t *const block, const size_t length)
+{
+	stlink_verify_s *const verify = (stlink_verify_s *)data;
+	const int res = stlink_verify_block(verify->layout, address, block, length);
+	if (!res)
+		++verify->verified;
+	return res;
+}
+
+/* Read back every block of the image and compare it against the plaintext, counting those that match */
+static int stlink_flash_verify(stlink_info_s *const info, const stlink_image_s *const image,
+	const stlink_layout_s *const layout, const stlink_flash_options_s *const options, size_t *const verified)
+{
+	const stlink_read_plan_s plan = {
+		.image = image,
+		.base_address = 0U,
+		.count = image->chunk_count,
+		.chunk_size = image->chunk_size,
+		.block_addressing = options->block_addressing || info->stinfo_profile->block_addressing,
+	};
+	stlink_verify_s verify = {
+		.layout = layout,
+		.verified = 0U,
+	};
+	const int res = stlink_read_blocks(info, &plan, stlink_verify_sink, &verify);
+	*verified = verify.verified;
+	return res;
+}
+
+/*
+ * Check a job can go through before anything gets erased: that the image lines up with the device's blocks
+ * and fits its flash, and that the loader will take the addresses it covers. Setting the address pointer
+ * is the cheapest command the loader checks - it's refused (errVENDOR) with read-out protection active, or
+ * (errTARGET) for an address the flash doesn't have - so a bad job fails in milliseconds rather than after
+ * the first erase. A device left in dfuERROR (or with a stalled endpoint) by an earlier job or an interrupted
+ * run is recovered and probed again, as the flash itself would. A job turned away isn't worth resuming
+ * either. Returns 0 if flashing can go ahead.
+ */
+static int stlink_flash_preflight(
+	stlink_info_s *const info, const uint32_t address, const size_t length, const size_t chunk_size)
+{
+	const stlink_profile_s *const profile = info->stinfo_profile;
+	const uint64_t flash_end = (uint64_t)profile->flash_base + profile->flash_size;
+	const uint64_t end = (uint64_t)address + (((uint64_t)length + chunk_size - 1U) / chunk_size) * chunk_size;
+	int res = -1;
+	bool rejected = true;
+	if (chunk_size < 16U || chunk_size > STLINK_MAX_CHUNK_SIZE || (chunk_size & (chunk_size - 1U)))
+		fprintf(stderr, "Invalid block size %zu, must be a power of 2 from 16 to %u\n", chunk_size,
+			STLINK_MAX_CHUNK_SIZE);
+	else if (address < profile->app_base || (address - profile->app_base) % chunk_size)
+		fprintf(stderr, "Image at 0x%08" PRIx32 " doesn't start on a block boundary in the application area\n",
+			address);
+	else if (end > flash_end)
+		fprintf(stderr, "Image runs to 0x%08" PRIx64 ", past the end of the %s's flash at 0x%08" PRIx64 "\n", end,
+			profile->name, flash_end);
+	else {
+		const uint64_t start = time_us();
+		size_t retries = 0U;
+		do {
+			res = stlink_set_address(info, address);
+			if (!res && end - address > chunk_size)
+				res = stlink_set_address(info, (uint32_t)(end - chunk_size));
+		} while (stlink_flash_transient(res) && stlink_flash_recover(info, &retries));
+		stlink_trace_event(info, "preflight", start, "\"address\":%" PRIu32 ",\"length\":%zu,\"result\":%d",
+			address, length, res);
+		/* Only the device saying no is a verdict on the job - a link that failed is left to be resumed */
+		rejected = res && !stlink_flash_transient(res);
+		if (rejected)
+			fprintf(stderr, "Loader turned down the image's address range, nothing has been erased\n");
+	}
+	if (rejected)
+		info->stinfo_session.active = false;
+	return res;
+}
+
+int stlink_flash(stlink_info_s *info, const char *filename, const stlink_flash_options_s *const options)
+{
+	/* Streams and compressed images are flashed as they're read (and decompressed), rather than mapped */
+	if (stlink_stream_wanted(filename)) {
+		stlink_stream_s stream;
+		if (!stlink_stream_open(filename, &stream))
+			return -1;
+		const int res = stlink_flash_stream(info, &stream, options);
+		stlink_stream_close(&stream);
+		return res;
+	}
+	stlink_firmware_s firmware;
+	if (!stlink_firmware_open(filename, &firmware))
+		return -1;
+	const int res = stlink_flash_firmware(info, &firmware, options);
+	stlink_firmware_close(&firmware);
+	return res;
+}
+
+int stlink_flash_firmware(
+	stlink_info_s *const info, const stlink_firmware_s *const firmware, const stlink_flash_options_s *const options)
+{
+	const uint32_t base_offset = info->stinfo_profile->app_base;
+	const size_t chunk_size = options->chunk_size ? options->chunk_size : stlink_max_chunk_size(info);
+	const uint64_t start = time_us();
+	/* Work out where the image goes - ELF and Intel HEX images may only cover parts of the flash */
+	stlink_layout_s layout;
+	if (!stlink_layout_load(firmware->data, firmware->size, base_offset, chunk_size, &layout))
+		return -1;
+	const int preflight = stlink_flash_preflight(info, layout.address, layout.length, chunk_size);
+	if (preflight) {
+		stlink_layout_free(&layout);
+		return preflight;
+	}
+	/* Do all the encryption and checksumming before touching the flash, so the loop below is pure USB traffic */
+	stlink_image_s prepared_image;
+	const stlink_image_s *image = NULL;
+	stlink_cache_key_s cache_key;
+	/* The layout comes entirely from the file's contents, so keying on those covers it too (and a resume) */
+	stlink_cache_key(info, firmware->data, firmware->size, base_offset, chunk_size, &cache_key);
+	if (options->image_pool)
+		image = stlink_image_pool_find(options->image_pool, &cache_key, base_offset, chunk_size);
+	/*
+	 * Build the image in the device's transfer buffers so the blocks go out without another copy, along with
+	 * room for verify to read back into. Pooled images outlive this flash though, so those stay on the heap.
+	 */
+	const size_t image_chunks = stlink_image_chunk_count(layout.length, chunk_size, layout.populated);
+	stlink_buffer_pool_s *buffers = NULL;
+	if (!options->image_pool && stlink_buffer_pool_reserve(info, (image_chunks + 2U) * chunk_size))
+		buffers = &info->stinfo_buffers;
+	if (!image) {
+		bool prepared = false;
+		bool from_disk = false;
+		if (options->cache_dir)
+			prepared = from_disk = stlink_cache_load(
+				options->cache_dir, &cache_key, base_offset, chunk_size, buffers, &prepared_image);
+		if (!prepared)
+			prepared = stlink_image_prepare(info, layout.data, layout.length, layout.address, chunk_size,
+				layout.populated, buffers, &prepared_image);
+		if (prepared && !from_disk && options->cache_dir)
+			stlink_cache_store(options->cache_dir, &cache_key, &prepared_image, options->cache_max_size);
+		/* Once in the pool the image belongs to it, otherwise it's ours to free when done */
+		if (prepared && options->image_pool)
+			image = stlink_image_pool_insert(options->image_pool, &cache_key, base_offset, &prepared_image);
+		if (prepared && !image)
+			image = &prepared_image;
+	}
+	const bool owned = image == &prepared_image;
+
+	/* Keep a manifest of what we write so a later differential flash knows what's already on the device */
+	stlink_manifest_s manifest = {0};
+	const bool have_manifest = image && options->cache_dir &&
+		stlink_manifest_build(
+			layout.data, layout.length, layout.address, chunk_size, layout.populated, &manifest);
+	if (!image) {
+		stlink_buffer_pool_reset(&info->stinfo_buffers);
+		stlink_layout_free(&layout);
+		return -1;
+	}
+	stlink_trace_event(info, "prepare", start, "\"blocks\":%zu", image->chunk_count);
+
+	bool *dirty = NULL;
+	if (have_manifest) {
+		stlink_manifest_s previous;
+		if (options->differential && stlink_manifest_load(options->cache_dir, info->id, &previous)) {
+			if (previous.base_address == manifest.base_address && previous.chunk_size == chunk_size)
+				dirty = stlink_flash_plan_differential(info, &manifest, &previous);
+			stlink_manifest_free(&previous);
 		}
-		memcpy(chunk_buffer, firmware + flashed_bytes, chunk_size);
-		res = stlink_dfu_download(info, chunk_buffer, chunk_size, 2U);
-		if (res) {
-			fprintf(stderr, "Download error at 0x%08zx\n", base_offset + flashed_bytes);
-			return res;
+		/* From here on the device contents no longer match any manifest until we're done */
+		stlink_manifest_remove(options->cache_dir, info->id);
+	}
+
+	/* Pick up where an interrupted flash of this image left off, redoing the erase unit it stopped in */
+	stlink_flash_session_s *const session = &info->stinfo_session;
+	size_t start_chunk = 0U;
+	if (session->active && session->image_hash == cache_key.image_hash &&
+		session->device_hash == cache_key.device_hash && session->address == layout.address &&
+		session->chunk_size == chunk_size && session->chunk_count == image->chunk_count &&
+		session->confirmed < image->chunk_count) {
+		start_chunk = stlink_flash_unit_start(info, image, session->confirmed);
+		char id[STLINK_ID_LENGTH];
+		stlink_format_id(info->id, id);
+		fprintf(stderr, "%s: resuming flash from block %zu of %zu\n", id, start_chunk, image->chunk_count);
+	}
+	session->active = true;
+	session->image_hash = cache_key.image_hash;
+	session->device_hash = cache_key.device_hash;
+	session->address = layout.address;
+	session->chunk_size = chunk_size;
+	session->chunk_count = image->chunk_count;
+	session->confirmed = start_chunk;
+
+	/* Erase everything the image covers in one tight run of commands, then stream the programming */
+	int res = stlink_flash_erase(info, image, start_chunk, image->chunk_count, dirty);
+	stlink_progress_s progress = {
+		.blocks_written = 0U,
+		/* Anything before a resume point is already on the device */
+		.blocks_skipped = start_chunk,
+		.blocks_blank = 0U,
+		.blocks_verified = 0U,
+		.blocks_total = image->chunk_count,
+		.finished = false,
+	};
+	stlink_programmer_s programmer;
+	stlink_programmer_init(&programmer, info, options);
+	/* Retries count consecutive failures at the furthest block to have failed, so rewinding can't loop forever */
+	size_t retries = 0U;
+	size_t failed_chunk = 0U;
+	bool in_doubt = false;
+	for (size_t i = start_chunk; !res && i < image->chunk_count;) {
+		stlink_chunk_s *const chunk = &image->chunks[i];
+		if (!stlink_chunk_dirty(info, dirty, chunk->address, image->chunk_size)) {
+			++progress.blocks_skipped;
+			session->confirmed = ++i;
+			continue;
+		}
+		/* The erase already left blank blocks as they should be, and the next block sets its own address */
+		if (chunk->blank) {
+			++progress.blocks_blank;
+			session->confirmed = ++i;
+			continue;
+		}
+		res = stlink_program_block(info, &programmer, chunk->address, chunk->data, image->chunk_size, chunk->checksum);
+		if (res && i > failed_chunk)
+			failed_chunk = i;
+		/*
+		 * A lost transfer leaves it unclear whether the block made it, so first just send it again (setting the
+		 * address pointer afresh). If the device then refuses it as landing on programmed flash, it did, and
+		 * the only way to be sure of its contents is to erase and rewrite its whole unit.
+		 */
+		if (stlink_flash_transient(res) && stlink_flash_recover(info, &retries)) {
+			programmer.block = UINT16_MAX;
+			in_doubt = true;
+			res = 0;
+			continue;
 		}
+		if (res && in_doubt && stlink_flash_recover(info, &retries)) {
+			const size_t rewind = stlink_flash_unit_start(info, image, i);
+			res = stlink_flash_erase(info, image, rewind, i + 1U, dirty);
+			programmer.block = UINT16_MAX;
+			in_doubt = false;
+			session->confirmed = i = rewind;
+			continue;
+		}
+		if (res)
+			break;
 
-		printf(".");
-		fflush(stdout); /* Flush stdout buffer */
+		if (i >= failed_chunk)
+			retries = 0U;
+		in_doubt = false;
+		++progress.blocks_written;
+		session->confirmed = ++i;
+		if (options->progress)
+			options->progress(info, &progress, options->progress_data);
+	}
+	/* Skipped and blank blocks are read back too, as the device should hold those just the same */
+	if (!res && options->verify) {
+		const uint64_t verify_start = time_us();
+		res = stlink_flash_verify(info, image, &layout, options, &progress.blocks_verified);
+		stlink_trace_event(info, "verify", verify_start, "\"blocks\":%zu,\"result\":%d", progress.blocks_verified, res);
 	}
+	/*
+	 * Only an incomplete programming run cut short by the link is worth resuming - the device refusing a block
+	 * or verify failing isn't something that would fix
+	 */
+	session->active = stlink_flash_transient(res) && session->confirmed < image->chunk_count;
+	stlink_layout_free(&layout);
+	if (owned)
+		stlink_image_free(&prepared_image);
+	stlink_buffer_pool_reset(&info->stinfo_buffers);
+	free(dirty);
 
-#ifdef _WIN32
-	UnmapViewOfFile(firmware);
-	CloseHandle(mapping);
-#else
-	munmap((void *)firmware, file_size);
-#endif
-	close(fd);
+	progress.finished = true;
+	if (options->progress)
+		options->progress(info, &progress, options->progress_data);
+	if (have_manifest) {
+		if (!res)
+			stlink_manifest_store(options->cache_dir, info->id, &manifest);
+		stlink_manifest_free(&manifest);
+	}
+	return res;
+}
 
-	printf("\n");
-	return 0;
+/*
+ * Flash an image as it arrives from a stream. Each block is encrypted as it comes in, and the erase
+ * units it starts are erased just ahead of programming it, so nothing waits for the whole image.
+ * With no complete image up front there's nothing to cache or compare, so the device's manifest is
+ * just dropped to keep later differential flashes honest.
+ */
+int stlink_flash_stream(
+	stlink_info_s *const info, stlink_stream_s *const stream, const stlink_flash_options_s *const options)
+{
+	const uint32_t base_offset = info->stinfo_profile->app_base;
+	const size_t chunk_size = options->chunk_size ? options->chunk_size : stlink_max_chunk_size(info);
+	/* How big the image is isn't known until it's all arrived, so each block is checked as it comes in instead */
+	const int preflight = stlink_flash_preflight(info, base_offset, chunk_size, chunk_size);
+	if (preflight)
+		return preflight;
+	/* A stream can't be resumed, and what it writes leaves nothing of an earlier flash to resume either */
+	info->stinfo_session.active = false;
+	const uint64_t flash_end = (uint64_t)info->stinfo_profile->flash_base + info->stinfo_profile->flash_size;
+	if (options->cache_dir)
+		stlink_manifest_remove(options->cache_dir, info->id);
+
+	/* Each block is read from the stream straight into the transfer buffer it goes out from */
+	uint8_t fallback[STLINK_MAX_CHUNK_SIZE];
+	uint8_t *chunk = NULL;
+	if (stlink_buffer_pool_reserve(info, chunk_size))
+		chunk = stlink_buffer_pool_alloc(&info->stinfo_buffers, chunk_size);
+	if (!chunk)
+		chunk = fallback;
+	stlink_progress_s progress = {
+		.blocks_written = 0U,
+		.blocks_skipped = 0U,
+		.blocks_blank = 0U,
+		.blocks_verified = 0U,
+		/* Not known until the stream ends */
+		.blocks_total = 0U,
+		.finished = false,
+	};
+	stlink_programmer_s programmer;
+	stlink_programmer_init(&programmer, info, options);
+	size_t next_unit = 0U;
+	int res = 0;
+	for (uint32_t address = base_offset; !res; address += (uint32_t)chunk_size) {
+		const size_t length = stlink_stream_read(stream, chunk, chunk_size);
+		if (!length)
+			break;
+		if ((uint64_t)address + chunk_size > flash_end) {
+			fprintf(stderr, "Firmware stream is larger than the %s's flash\n", info->stinfo_profile->name);
+			res = -1;
+			break;
+		}
+		memset(chunk + length, 0xff, chunk_size - length);
+		res = stlink_flash_erase_block(info, address, chunk_size, NULL, &next_unit, false);
+		if (res)
+			break;
+		if (stlink_block_blank(chunk, chunk_size)) {
+			++progress.blocks_blank;
+			continue;
+		}
+		const uint16_t checksum = stlink_encrypt_chunk(info, chunk, chunk_size);
+		res = stlink_program_block(info, &programmer, address, chunk, chunk_size, checksum);
+		if (res)
+			break;
+		++progress.blocks_written;
+		if (options->progress)
+			options->progress(info, &progress, options->progress_data);
+	}
+	if (!res && stream->error) {
+		fprintf(stderr, "Reading firmware stream failed (%d): %s\n", stream->error, strerror(stream->error));
+		res = -1;
+	} else if (!res && !progress.blocks_written && !progress.blocks_blank) {
+		fprintf(stderr, "Firmware stream was empty\n");
+		res = -1;
+	}
+	stlink_buffer_pool_reset(&info->stinfo_buffers);
+	progress.blocks_total = progress.blocks_written + progress.blocks_blank;
+	progress.finished = true;
+	if (options->progress)
+		options->progress(info, &progress, options->progress_data);
+	return res;
 }
 
 bool stlink_exit_dfu(stlink_info_s *const info)
@@ -446,8 +1548,7 @@ bool stlink_exit_dfu(stlink_info_s *const info)
 	};
 
 	int rw_bytes = 0;
-	const int res =
-		libusb_bulk_transfer(info->stinfo_dev_handle, info->stinfo_ep_out, data, 16, &rw_bytes, USB_TIMEOUT);
+	const int res = stlink_bulk_transfer(info, info->stinfo_ep_out, data, 16, &rw_bytes);
 	if (res || rw_bytes != 16) {
 		fprintf(stderr, "USB transfer failure\n");
 		return false;
@@ -24,6 +24,8 @@
 #ifndef STLINK_H
 #define STLINK_H
 
+#include "flash_options.h"
+
 enum DeviceStatus {
 	OK = 0x00,
 	errTARGET = 0x01,
@@ -62,6 +64,71 @@ typedef enum bootloader_types {
 	STLINK_BL_V3
 } bootloader_types_e;
 
+/* The kinds of operation a DFU download can trigger, which each keep their own busy time statistics */
+typedef enum stlink_dfu_op {
+	STLINK_OP_PROGRAM,
+	STLINK_OP_ERASE,
+	STLINK_OP_SECTOR_ERASE,
+	STLINK_OP_SET_ADDRESS,
+	STLINK_OP_COUNT
+} stlink_dfu_op_e;
+
+/* How long the device has actually been taking to complete one kind of operation, versus what it advertised */
+typedef struct stlink_poll_stats {
+	uint32_t samples;
+	uint32_t estimate_us;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t advertised_ms;
+} stlink_poll_stats_s;
+
+/*
+ * Stands in for libusb_bulk_transfer() on the bootloader's endpoints, so the flashing code can be driven
+ * against something other than a real device (such as a simulator). Returns a libusb error code.
+ */
+typedef int (*stlink_transport_bulk_t)(void *data, uint8_t endpoint, uint8_t *buffer, int length, int *actual_length);
+/* Stands in for libusb_clear_halt(), or may be NULL if the transport never leaves an endpoint halted */
+typedef int (*stlink_transport_clear_halt_t)(void *data, uint8_t endpoint);
+
+typedef struct stlink_transport {
+	stlink_transport_bulk_t bulk;
+	void *data;
+	stlink_transport_clear_halt_t clear_halt;
+} stlink_transport_s;
+
+/*
+ * How far a flash got, so one that was cut short can be picked up again (possibly after the device has
+ * dropped off the bus and been found again) rather than started over. Blocks are confirmed in image order
+ * once the device reports dfuDNLOAD_IDLE for them, and a resumed flash carries on from the first erase
+ * unit that wasn't completely confirmed. Only meaningful for another flash of the same image, which
+ * the image and device hashes (as for the image cache) and the image's address tell apart.
+ */
+typedef struct stlink_flash_session {
+	/* Set while there's an unfinished flash to resume */
+	bool active;
+	uint64_t image_hash;
+	uint64_t device_hash;
+	uint32_t address;
+	size_t chunk_size;
+	size_t chunk_count;
+	size_t confirmed;
+} stlink_flash_session_s;
+
+/*
+ * Per-device memory that transfers are made straight out of and into. Where libusb can give us memory
+ * mapped from the device's usbfs node (libusb_dev_mem_alloc()), the kernel uses it in place rather than
+ * copying every transfer into a buffer of its own; anywhere else it's just page-aligned heap. It's carved
+ * up by a flash as it needs and handed back in one go afterwards, but kept until the device is closed
+ * so the next flash needn't allocate again.
+ */
+typedef struct stlink_buffer_pool {
+	uint8_t *memory;
+	size_t capacity;
+	size_t used;
+	/* The handle device memory was mapped from, which it must be given back to - NULL for heap memory */
+	libusb_device_handle *dev_handle;
+} stlink_buffer_pool_s;
+
 typedef struct stlink_info {
 	uint8_t firmware_key[16];
 	uint8_t id[12];
@@ -73,7 +140,23 @@ typedef struct stlink_info {
 	libusb_device_handle *stinfo_dev_handle;
 	uint8_t stinfo_ep_in;
 	uint8_t stinfo_ep_out;
-	bootloader_types_e stinfo_bl_type;
+	/* The bootloader's geometry and quirks, from the registry in profile.c */
+	const struct stlink_profile *stinfo_profile;
+	/* Where bootloader traffic goes instead of stinfo_dev_handle, or NULL for the device itself */
+	const stlink_transport_s *stinfo_transport;
+	/* Key schedules set up by stlink_read_info() and reused for every chunk */
+	stlink_aes_ctx_s stinfo_firmware_aes;
+	stlink_aes_ctx_s stinfo_transport_aes;
+	stlink_poll_stats_s stinfo_poll_stats[STLINK_OP_COUNT];
+	stlink_flash_session_s stinfo_session;
+	stlink_buffer_pool_s stinfo_buffers;
+	/* The hub this device shares with others in a gang run (see topology.h), or NULL if it has the bus to itself */
+	struct stlink_link *stinfo_link;
+	size_t stinfo_link_held;
+	/* When the job running on the device has to be done by (in time_us() terms), or 0 for no limit */
+	uint64_t stinfo_deadline_us;
+	/* Set from any thread by stlink_cancel(), and only ever cleared again by whoever starts the next job */
+	atomic_bool stinfo_cancelled;
 } stlink_info_s;
 
 typedef struct dfu_status {
@@ -83,11 +166,42 @@ typedef struct dfu_status {
 	uint32_t bwPollTimeout;
 } dfu_status_s;
 
+struct stlink_firmware;
+struct stlink_stream;
+
+/* How many times a flash retries failed transfers in place before giving up, and how many times it's resumed */
+#define STLINK_FLASH_RETRIES 4U
+#define STLINK_FLASH_RESUMES 2U
+
+/* Upper bound on user-requested block sizes: the smallest V3 sector, and well inside DFU's 16-bit wLength */
+#define STLINK_MAX_CHUNK_SIZE 16384U
+
+/* Receives each block stlink_read_flash() reads back, in order. A non-zero return stops the read there */
+typedef int (*stlink_block_sink_t)(void *data, uint32_t address, const uint8_t *block, size_t length);
+
+void stlink_set_deadline(stlink_info_s *info, uint32_t timeout_ms);
+void stlink_cancel(stlink_info_s *info);
+bool stlink_stopped(const stlink_info_s *info);
+uint32_t stlink_time_left_ms(const stlink_info_s *info, uint32_t limit_ms);
 uint16_t stlink_dfu_mode(libusb_device_handle *dev_handle, bool trigger);
 bool stlink_read_info(stlink_info_s *info);
 uint16_t stlink_current_mode(stlink_info_s *info);
-int stlink_dfu_download(stlink_info_s *stlink_info, uint8_t *data, size_t data_len, uint16_t wBlockNum);
-int stlink_flash(stlink_info_s *stlink_info, const char *filename);
+uint16_t stlink_checksum(const uint8_t *firmware, size_t len);
+uint16_t stlink_encrypt_chunk(const stlink_info_s *info, uint8_t *data, size_t data_len);
+int stlink_dfu_download(
+	stlink_info_s *stlink_info, uint8_t *data, size_t data_len, uint16_t wBlockNum, stlink_dfu_op_e op);
+int stlink_dfu_download_raw(stlink_info_s *stlink_info, uint8_t *data, size_t data_len, uint16_t wBlockNum,
+	uint16_t checksum, stlink_dfu_op_e op);
+int stlink_dfu_upload(stlink_info_s *info, uint8_t *data, size_t data_len, uint16_t wBlockNum);
+int stlink_read_flash(stlink_info_s *info, uint32_t address, size_t count, size_t chunk_size, bool block_addressing,
+	stlink_block_sink_t sink, void *data);
+bool stlink_dfu_abort(stlink_info_s *info);
+void stlink_print_poll_stats(const stlink_info_s *info);
+size_t stlink_max_chunk_size(const stlink_info_s *info);
+int stlink_flash(stlink_info_s *stlink_info, const char *filename, const stlink_flash_options_s *options);
+int stlink_flash_firmware(
+	stlink_info_s *info, const struct stlink_firmware *firmware, const stlink_flash_options_s *options);
+int stlink_flash_stream(stlink_info_s *info, struct stlink_stream *stream, const stlink_flash_options_s *options);
 bool stlink_exit_dfu(stlink_info_s *info);
 
 /* J-Link (converted ST-Link) to ST-Link bootloader switch */
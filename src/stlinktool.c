@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "discovery.h"
+#include "buffer_pool.h"
+#include "profile.h"
+#include "stlinktool.h"
+
+struct stlink_device {
+	stlink_info_s info;
+	/* The request being run, copied so the caller's needn't outlive the submission */
+	stlink_request_s request;
+	pthread_t thread;
+	/* Guards the state below, which the caller polls while the worker runs */
+	pthread_mutex_t lock;
+	bool running;
+	/* Whether there's a worker thread that has yet to be joined */
+	bool joinable;
+	/* The application has been started, so the device has gone and won't take more requests */
+	bool detached;
+	int result;
+};
+
+/*
+ * Claim an opened bootloader and read out its information, checking it's the device that was asked for.
+ * On success the interface is left claimed for the lifetime of the device.
+ */
+static bool stlink_device_attach(stlink_info_s *const info, const stlink_device_filter_s *const filter)
+{
+	if (libusb_claim_interface(info->stinfo_dev_handle, 0)) {
+		fprintf(stderr,
+			"Unable to claim USB interface ! Please close all programs that "
+			"may communicate with an ST-Link dongle.\n");
+		return false;
+	}
+	if (!stlink_read_info(info) || !stlink_filter_match_id(filter, info->id)) {
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		return false;
+	}
+	const uint16_t mode = stlink_current_mode(info);
+	if (mode == UINT16_MAX || (mode & ~3U)) {
+		libusb_release_interface(info->stinfo_dev_handle, 0);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Find and open the first ST-Link matching the filter (which may be NULL to take any), switching it into
+ * its bootloader first if needed. Returns NULL if no such device could be found and opened.
+ */
+stlink_device_s *stlink_device_open(libusb_context *const ctx, const stlink_device_filter_s *const filter)
+{
+	stlink_device_s *const device = calloc(1U, sizeof(stlink_device_s));
+	if (!device)
+		return NULL;
+	/* Bootloaders only reveal which device they are once opened, so a serial filter means opening them all */
+	const stlink_discovery_options_s discovery = {
+		.all = filter && filter->serial,
+		.jlink_switch = false,
+		.filter = filter,
+		.skip = NULL,
+		.skip_data = NULL,
+	};
+	stlink_device_list_s list = {0};
+	bool found = false;
+	if (stlink_discover(ctx, &discovery, &list)) {
+		for (size_t i = 0U; i < list.count && !found; ++i) {
+			if (!stlink_device_attach(&list.devices[i], filter))
+				continue;
+			device->info = list.devices[i];
+			/* Take the device out of the list so closing the rest leaves it open */
+			list.devices[i] = list.devices[--list.count];
+			found = true;
+		}
+	}
+	stlink_device_list_free(&list);
+	if (!found) {
+		free(device);
+		return NULL;
+	}
+	pthread_mutex_init(&device->lock, NULL);
+	return device;
+}
+
+const stlink_info_s *stlink_device_info(const stlink_device_s *const device)
+{
+	return &device->info;
+}
+
+void stlink_info_id(const stlink_info_s *const info, char *const buffer)
+{
+	stlink_format_id(info->id, buffer);
+}
+
+const char *stlink_info_name(const stlink_info_s *const info)
+{
+	return info->stinfo_profile->name;
+}
+
+static void *stlink_device_worker(void *const arg)
+{
+	stlink_device_s *const device = (stlink_device_s *)arg;
+	const stlink_request_s *const request = &device->request;
+	stlink_set_deadline(&device->info, request->timeout_ms);
+	int result = EXIT_SUCCESS;
+	if (request->firmware_file && stlink_flash(&device->info, request->firmware_file, &request->flash_options))
+		result = EXIT_FAILURE;
+	/* A request that was given up on doesn't get to start the application either */
+	const bool stopped = stlink_stopped(&device->info);
+	if (stopped)
+		result = EXIT_FAILURE;
+	else if (request->start_application)
+		stlink_exit_dfu(&device->info);
+
+	pthread_mutex_lock(&device->lock);
+	device->result = result;
+	device->detached = request->start_application && !stopped;
+	device->running = false;
+	pthread_mutex_unlock(&device->lock);
+	if (request->complete)
+		request->complete(device, result, request->complete_data);
+	return NULL;
+}
+
+/*
+ * Start running a request on the device in the background, returning straight away. Only one request
+ * can be in flight per device - returns false if the device is still busy, has started its application,
+ * or the worker could not be started.
+ */
+bool stlink_device_submit(stlink_device_s *const device, const stlink_request_s *const request)
+{
+	pthread_mutex_lock(&device->lock);
+	const bool available = !device->running && !device->detached;
+	pthread_mutex_unlock(&device->lock);
+	if (!available)
+		return false;
+	/* Reap the last request's worker before reusing the device for another */
+	if (device->joinable)
+		pthread_join(device->thread, NULL);
+	device->joinable = false;
+
+	device->request = *request;
+	atomic_store(&device->info.stinfo_cancelled, false);
+	/* Requests are independent, so one that failed partway leaves nothing for the next to resume */
+	device->info.stinfo_session.active = false;
+	pthread_mutex_lock(&device->lock);
+	device->running = true;
+	pthread_mutex_unlock(&device->lock);
+	if (pthread_create(&device->thread, NULL, stlink_device_worker, device) != 0) {
+		fprintf(stderr, "Failed to start worker for device\n");
+		pthread_mutex_lock(&device->lock);
+		device->running = false;
+		pthread_mutex_unlock(&device->lock);
+		return false;
+	}
+	device->joinable = true;
+	return true;
+}
+
+bool stlink_device_busy(stlink_device_s *const device)
+{
+	pthread_mutex_lock(&device->lock);
+	const bool running = device->running;
+	pthread_mutex_unlock(&device->lock);
+	return running;
+}
+
+/* Wait for the request in flight (if any) to finish, returning its result. Call from the submitting thread */
+int stlink_device_wait(stlink_device_s *const device)
+{
+	if (device->joinable)
+		pthread_join(device->thread, NULL);
+	device->joinable = false;
+	return device->result;
+}
+
+/*
+ * Give up on the request in flight, if any, from any thread (callbacks included). It fails, without starting
+ * the application, as soon as the transfer or wait it's in the middle of is cut short, and the device is
+ * then free for another request.
+ */
+void stlink_device_cancel(stlink_device_s *const device)
+{
+	stlink_cancel(&device->info);
+}
+
+/* Wait for any request still running, then let go of the device. Must not be called from a callback */
+void stlink_device_close(stlink_device_s *const device)
+{
+	if (!device)
+		return;
+	stlink_device_wait(device);
+	if (!device->detached)
+		libusb_release_interface(device->info.stinfo_dev_handle, 0);
+	stlink_buffer_pool_free(&device->info.stinfo_buffers);
+	libusb_close(device->info.stinfo_dev_handle);
+	pthread_mutex_destroy(&device->lock);
+	free(device);
+}
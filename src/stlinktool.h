@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef STLINKTOOL_H
+#define STLINKTOOL_H
+
+/*
+ * Public interface to libstlinktool, for driving ST-Links from inside another program rather than
+ * through the stlink-tool command line. Unlike the rest of the headers this one pulls in everything
+ * it needs, so it can be included on its own.
+ *
+ * Devices are opened individually and each runs its flash on a worker thread of its own, reporting
+ * back through callbacks, so any number of them can be driven at once from a single thread.
+ * The caller owns the libusb context, which must outlive every device opened on it. What's known
+ * about a device is opaque, and read through the stlink_info_*() accessors.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <libusb.h>
+
+#include "flash_options.h"
+#include "discovery.h"
+
+/* An ST-Link opened in bootloader mode, ready to take requests */
+typedef struct stlink_device stlink_device_s;
+
+/* Called from the device's worker thread once a request has finished, with EXIT_SUCCESS or EXIT_FAILURE */
+typedef void (*stlink_complete_cb_t)(stlink_device_s *device, int result, void *data);
+
+typedef struct stlink_request {
+	/* Firmware to flash, or NULL to skip straight to starting the application */
+	const char *firmware_file;
+	/* How to flash it, including progress reporting (copied on submission) */
+	stlink_flash_options_s flash_options;
+	/* Leave the bootloader and start the application afterwards, which ends the device's session */
+	bool start_application;
+	/* How long the request gets before it's given up on as if cancelled, in milliseconds (0 for no limit) */
+	uint32_t timeout_ms;
+	stlink_complete_cb_t complete;
+	void *complete_data;
+} stlink_request_s;
+
+stlink_device_s *stlink_device_open(libusb_context *ctx, const stlink_device_filter_s *filter);
+const struct stlink_info *stlink_device_info(const stlink_device_s *device);
+bool stlink_device_submit(stlink_device_s *device, const stlink_request_s *request);
+bool stlink_device_busy(stlink_device_s *device);
+int stlink_device_wait(stlink_device_s *device);
+void stlink_device_cancel(stlink_device_s *device);
+void stlink_device_close(stlink_device_s *device);
+
+/* Which device a callback is about: its ST-Link ID (into STLINK_ID_LENGTH bytes) and bootloader profile name */
+void stlink_info_id(const struct stlink_info *info, char *buffer);
+const char *stlink_info_name(const struct stlink_info *info);
+
+#endif /*STLINKTOOL_H*/
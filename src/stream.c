@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <signal.h>
+#endif
+
+#include "stream.h"
+#include "decompress.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+
+static bool stlink_stream_is_url(const char *const source)
+{
+	return strncmp(source, "http://", 7U) == 0 || strncmp(source, "https://", 8U) == 0;
+}
+
+/*
+ * Whether a file holds a compressed image, going by the first few bytes of it. Only regular files are looked
+ * at - reading from stdin, a URL or a pipe would eat the start of the stream (or wait on a pipe's writer), so
+ * those are taken to be plain streams, which are checked for compression as they're opened instead.
+ */
+bool stlink_stream_compressed(const char *const path)
+{
+	if (strcmp(path, "-") == 0 || stlink_stream_is_url(path))
+		return false;
+	/* Opening a pipe would otherwise wait for a writer before we could see it's not a file */
+	const int fd = open(path, O_RDONLY | O_BINARY | O_NONBLOCK);
+	if (fd < 0)
+		return false;
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+		close(fd);
+		return false;
+	}
+	uint8_t magic[STLINK_CODEC_MAGIC_LENGTH];
+	const ssize_t length = read(fd, magic, sizeof(magic));
+	close(fd);
+	return length > 0 && stlink_codec_detect(magic, (size_t)length) != STLINK_CODEC_NONE;
+}
+
+/*
+ * Whether a firmware source has to be streamed rather than mapped: stdin ("-"), a URL, anything not a file,
+ * or a compressed file (which is decompressed as it's flashed rather than all at once up front)
+ */
+bool stlink_stream_wanted(const char *const source)
+{
+	if (strcmp(source, "-") == 0 || stlink_stream_is_url(source))
+		return true;
+	struct stat file_stat;
+	if (stat(source, &file_stat) != 0)
+		return false;
+	return !S_ISREG(file_stat.st_mode) || stlink_stream_compressed(source);
+}
+
+#ifndef _WIN32
+/* Have curl fetch the URL for us, handing back the read end of its output */
+static int stlink_stream_fetch(const char *const url, pid_t *const child)
+{
+	int pipe_fds[2];
+	if (pipe(pipe_fds) < 0)
+		return -1;
+	const pid_t pid = fork();
+	if (pid < 0) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(pipe_fds[1], STDOUT_FILENO);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		execlp("curl", "curl", "--fail", "--silent", "--show-error", "--location", "--", url, (char *)NULL);
+		fprintf(stderr, "Failed to run curl to fetch %s\n", url);
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	*child = pid;
+	return pipe_fds[0];
+}
+#endif
+
+#ifndef _WIN32
+/* Collect the fetcher's exit status - a failed download must not pass for a short image */
+static int stlink_stream_reap(stlink_stream_s *const stream)
+{
+	int status = 0;
+	const pid_t child = stream->child;
+	stream->child = -1;
+	if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return EIO;
+	return 0;
+}
+#endif
+
+static void *stlink_stream_reader(void *const arg)
+{
+	stlink_stream_s *const stream = (stlink_stream_s *)arg;
+	/* Only allow cancellation while blocked reading, so it never happens holding the lock */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&stream->lock);
+	while (!stream->closing) {
+		while (stream->count == STLINK_STREAM_BUFFER_SIZE && !stream->closing)
+			pthread_cond_wait(&stream->writable, &stream->lock);
+		if (stream->closing)
+			break;
+		/* Read straight into the free space after the data, which may stop short at the end of the ring */
+		const size_t tail = (stream->head + stream->count) % STLINK_STREAM_BUFFER_SIZE;
+		size_t space = STLINK_STREAM_BUFFER_SIZE - stream->count;
+		if (tail + space > STLINK_STREAM_BUFFER_SIZE)
+			space = STLINK_STREAM_BUFFER_SIZE - tail;
+		pthread_mutex_unlock(&stream->lock);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		const ssize_t res = stlink_decompressor_read(stream->decompressor, stream->ring + tail, space);
+		const int error = errno;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+#ifndef _WIN32
+		const int fetch_error = res == 0 && stream->child > 0 ? stlink_stream_reap(stream) : 0;
+#else
+		const int fetch_error = 0;
+#endif
+		pthread_mutex_lock(&stream->lock);
+		if (res < 0 && error == EINTR)
+			continue;
+		if (res <= 0) {
+			stream->error = res < 0 ? error : fetch_error;
+			break;
+		}
+		stream->count += (size_t)res;
+		stream->received += (size_t)res;
+		pthread_cond_signal(&stream->readable);
+	}
+	stream->eof = true;
+	pthread_cond_signal(&stream->readable);
+	pthread_mutex_unlock(&stream->lock);
+	return NULL;
+}
+
+bool stlink_stream_open(const char *const source, stlink_stream_s *const stream)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->child = -1;
+	if (strcmp(source, "-") == 0)
+		stream->fd = STDIN_FILENO;
+	else if (stlink_stream_is_url(source)) {
+#ifndef _WIN32
+		stream->fd = stlink_stream_fetch(source, &stream->child);
+#else
+		fprintf(stderr, "Fetching firmware from a URL is not supported on this platform\n");
+		return false;
+#endif
+	} else
+		stream->fd = open(source, O_RDONLY | O_BINARY);
+	if (stream->fd < 0) {
+		const int error = errno;
+		fprintf(stderr, "Opening firmware stream failed (%d): %s\n", error, strerror(error));
+		return false;
+	}
+
+	stream->decompressor = stlink_decompressor_open(stream->fd);
+	stream->ring = malloc(STLINK_STREAM_BUFFER_SIZE);
+	if (!stream->decompressor || !stream->ring) {
+		fprintf(stderr, "Failed to allocate firmware stream buffer\n");
+		stlink_stream_close(stream);
+		return false;
+	}
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->readable, NULL);
+	pthread_cond_init(&stream->writable, NULL);
+	if (pthread_create(&stream->thread, NULL, stlink_stream_reader, stream) != 0) {
+		fprintf(stderr, "Failed to start firmware stream reader\n");
+		pthread_mutex_destroy(&stream->lock);
+		pthread_cond_destroy(&stream->readable);
+		pthread_cond_destroy(&stream->writable);
+		free(stream->ring);
+		stream->ring = NULL;
+		stlink_stream_close(stream);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Take the next `length` bytes of the image, waiting for them to arrive. Returns fewer only at the
+ * end of the image, and 0 once it's all been read or if the stream failed (check stream->error).
+ */
+size_t stlink_stream_read(stlink_stream_s *const stream, uint8_t *const buffer, const size_t length)
+{
+	size_t offset = 0U;
+	pthread_mutex_lock(&stream->lock);
+	while (offset < length) {
+		while (!stream->count && !stream->eof)
+			pthread_cond_wait(&stream->readable, &stream->lock);
+		if (!stream->count)
+			break;
+		size_t amount = length - offset;
+		if (amount > stream->count)
+			amount = stream->count;
+		if (stream->head + amount > STLINK_STREAM_BUFFER_SIZE)
+			amount = STLINK_STREAM_BUFFER_SIZE - stream->head;
+		memcpy(buffer + offset, stream->ring + stream->head, amount);
+		stream->head = (stream->head + amount) % STLINK_STREAM_BUFFER_SIZE;
+		stream->count -= amount;
+		offset += amount;
+		pthread_cond_signal(&stream->writable);
+	}
+	const bool failed = stream->eof && stream->error;
+	pthread_mutex_unlock(&stream->lock);
+	return failed ? 0U : offset;
+}
+
+/* Stop reading (if still going), reap any fetcher and release the stream */
+void stlink_stream_close(stlink_stream_s *const stream)
+{
+	if (stream->ring) {
+		pthread_mutex_lock(&stream->lock);
+		stream->closing = true;
+		const bool finished = stream->eof;
+		pthread_cond_signal(&stream->writable);
+		pthread_mutex_unlock(&stream->lock);
+		/* If we're giving up part way, the reader may be stuck waiting on a pipe that isn't done with us */
+		if (!finished)
+			pthread_cancel(stream->thread);
+		pthread_join(stream->thread, NULL);
+		pthread_mutex_destroy(&stream->lock);
+		pthread_cond_destroy(&stream->readable);
+		pthread_cond_destroy(&stream->writable);
+		free(stream->ring);
+		stream->ring = NULL;
+	}
+	stlink_decompressor_close(stream->decompressor);
+	stream->decompressor = NULL;
+	if (stream->fd > STDIN_FILENO)
+		close(stream->fd);
+	stream->fd = -1;
+#ifndef _WIN32
+	if (stream->child > 0) {
+		kill(stream->child, SIGTERM);
+		stlink_stream_reap(stream);
+	}
+#endif
+}
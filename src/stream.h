@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* How much of a streamed image may be buffered ahead of the flashing */
+#define STLINK_STREAM_BUFFER_SIZE (256U * 1024U)
+
+struct stlink_decompressor;
+
+/*
+ * Firmware read from a pipe, stdin or an HTTP(S) URL as it arrives. A reader thread keeps a bounded
+ * ring buffer topped up so fetching the image overlaps with erasing and programming it. Compressed
+ * images (gzip, zstd or lz4) are decompressed by the reader on the way into the ring.
+ */
+typedef struct stlink_stream {
+	int fd;
+	struct stlink_decompressor *decompressor;
+	/* The curl process fetching a URL for us, or -1 */
+	pid_t child;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t readable;
+	pthread_cond_t writable;
+	uint8_t *ring;
+	size_t head;
+	size_t count;
+	/* Total (decompressed) bytes received so far, which is the image length once eof is set */
+	size_t received;
+	bool eof;
+	bool closing;
+	int error;
+} stlink_stream_s;
+
+bool stlink_stream_compressed(const char *path);
+bool stlink_stream_wanted(const char *source);
+bool stlink_stream_open(const char *source, stlink_stream_s *stream);
+size_t stlink_stream_read(stlink_stream_s *stream, uint8_t *buffer, size_t length);
+void stlink_stream_close(stlink_stream_s *stream);
+
+#endif /*STREAM_H*/
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_MEAN_AND_LEAN
+#include <windows.h>
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+
+/* Monotonic timestamp in microseconds, for measuring how long operations take */
+static inline uint64_t time_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000U) +
+		(uint64_t)(((counter.QuadPart % frequency.QuadPart) * 1000000U) / frequency.QuadPart);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000U) + ((uint64_t)now.tv_nsec / 1000U);
+#endif
+}
+
+/* Sleep for (at least) the given number of microseconds - Windows can only manage whole milliseconds */
+static inline void sleep_us(const uint64_t us)
+{
+#ifdef _WIN32
+	Sleep((DWORD)((us + 999U) / 1000U));
+#else
+	struct timespec duration = {
+		.tv_sec = (time_t)(us / 1000000U),
+		.tv_nsec = (long)((us % 1000000U) * 1000U),
+	};
+	while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+		continue;
+#endif
+}
+
+#endif /*TIMING_H*/
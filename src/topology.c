@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "discovery.h"
+#include "topology.h"
+#include "timing.h"
+#include "trace.h"
+
+/* Find the link a device shares with its neighbours, being the port path of the hub it hangs off */
+static stlink_link_s *stlink_topology_link(
+	stlink_topology_s *const topology, const uint8_t bus, const uint8_t *const ports, const uint8_t depth)
+{
+	for (size_t i = 0U; i < topology->count; ++i) {
+		stlink_link_s *const link = &topology->links[i];
+		if (link->bus == bus && link->depth == depth && memcmp(link->ports, ports, depth) == 0)
+			return link;
+	}
+
+	stlink_link_s *const link = &topology->links[topology->count++];
+	memset(link, 0, sizeof(*link));
+	link->bus = bus;
+	link->depth = depth;
+	memcpy(link->ports, ports, depth);
+	int offset = snprintf(link->path, sizeof(link->path), "%u", bus);
+	for (uint8_t i = 0U; i < depth && offset > 0 && (size_t)offset < sizeof(link->path); ++i)
+		offset += snprintf(link->path + offset, sizeof(link->path) - (size_t)offset, "%c%u", i ? '.' : '-', ports[i]);
+	pthread_mutex_init(&link->lock, NULL);
+	pthread_cond_init(&link->available, NULL);
+	return link;
+}
+
+/*
+ * Group the devices of a gang run by the hub each one is plugged into, and hand each device its link.
+ * Hubs get hub_limit slots (0 for no limit). Root ports don't share a transaction translator with
+ * anything, so devices there only share their host controller, which isn't limited.
+ */
+bool stlink_topology_build(stlink_topology_s *const topology, stlink_device_list_s *const list, const size_t hub_limit)
+{
+	topology->count = 0U;
+	/* At worst every device is on a hub of its own, and links mustn't move once devices point at them */
+	topology->links = calloc(list->count ? list->count : 1U, sizeof(stlink_link_s));
+	if (!topology->links) {
+		fprintf(stderr, "Failed to allocate memory for the bus topology\n");
+		return false;
+	}
+
+	for (size_t i = 0U; i < list->count; ++i) {
+		stlink_info_s *const info = &list->devices[i];
+		libusb_device *const dev = libusb_get_device(info->stinfo_dev_handle);
+		uint8_t ports[7U];
+		const int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+		/* The device's own port isn't part of the link - everything above it is */
+		const uint8_t hub_depth = depth > 0 ? (uint8_t)(depth - 1) : 0U;
+		stlink_link_s *const link = stlink_topology_link(topology, libusb_get_bus_number(dev), ports, hub_depth);
+		link->limit = hub_depth ? hub_limit : 0U;
+		++link->devices;
+		info->stinfo_link = link;
+		info->stinfo_link_held = 0U;
+	}
+	return true;
+}
+
+/* Report how each hub (and root hub) fared, so a crowded one holding up the run shows up */
+void stlink_topology_report(const stlink_topology_s *const topology)
+{
+	for (size_t i = 0U; i < topology->count; ++i) {
+		const stlink_link_s *const link = &topology->links[i];
+		const uint64_t elapsed_us = link->last_us - link->first_us;
+		const double rate = elapsed_us ? (double)link->bytes / 1024.0 / ((double)elapsed_us / 1000000.0) : 0.0;
+		printf("Hub %s: %zu devices, %" PRIu64 " KiB in %.3fs (%.1f KiB/s), %.3fs waiting for a slot\n", link->path,
+			link->devices, link->bytes / 1024U, (double)elapsed_us / 1000000.0, rate,
+			(double)link->waited_us / 1000000.0);
+	}
+}
+
+void stlink_topology_free(stlink_topology_s *const topology, stlink_device_list_s *const list)
+{
+	for (size_t i = 0U; i < list->count; ++i)
+		list->devices[i].stinfo_link = NULL;
+	for (size_t i = 0U; i < topology->count; ++i) {
+		pthread_cond_destroy(&topology->links[i].available);
+		pthread_mutex_destroy(&topology->links[i].lock);
+	}
+	free(topology->links);
+	topology->links = NULL;
+	topology->count = 0U;
+}
+
+/*
+ * Take a slot on the device's link before putting transfers on the bus, waiting for one if its hub is
+ * full. A device only ever needs the one slot, however many of its own batches it has queued up.
+ */
+void stlink_link_acquire(stlink_info_s *const info)
+{
+	stlink_link_s *const link = info->stinfo_link;
+	if (!link || info->stinfo_link_held++)
+		return;
+	const uint64_t start = time_us();
+	pthread_mutex_lock(&link->lock);
+	if (!link->first_us)
+		link->first_us = start;
+	bool waited = false;
+	while (link->limit && link->in_flight >= link->limit) {
+		waited = true;
+		pthread_cond_wait(&link->available, &link->lock);
+	}
+	++link->in_flight;
+	const uint64_t now = time_us();
+	if (waited)
+		link->waited_us += now - start;
+	pthread_mutex_unlock(&link->lock);
+	if (waited)
+		stlink_trace_event(info, "hub_wait", start, "\"hub\":\"%s\"", link->path);
+}
+
+/* Give the slot back once the device's last batch in flight is done, accounting for what it moved */
+void stlink_link_release(stlink_info_s *const info, const size_t bytes)
+{
+	stlink_link_s *const link = info->stinfo_link;
+	if (!link)
+		return;
+	const bool last = --info->stinfo_link_held == 0U;
+	pthread_mutex_lock(&link->lock);
+	link->bytes += bytes;
+	link->last_us = time_us();
+	if (last) {
+		--link->in_flight;
+		pthread_cond_signal(&link->available);
+	}
+	pthread_mutex_unlock(&link->lock);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "discovery.h"
+
+/*
+ * How many devices behind one hub may have transfers in flight at once by default. ST-Link bootloaders
+ * are full speed, so behind a high speed hub they all share its transaction translator; a couple of
+ * them is enough to keep it busy, as the rest of each device's time goes on programming rather than USB.
+ */
+#define STLINK_HUB_IN_FLIGHT_DEFAULT 2U
+
+/*
+ * A stretch of bus that several devices have to share: the hub they're plugged into, or for devices on
+ * a root port, just the host controller. Devices take a slot on it for each batch of transfers they run.
+ */
+typedef struct stlink_link {
+	/* "bus-port.port..." of the hub, or just the bus for the root hub */
+	char path[STLINK_PORT_PATH_LENGTH];
+	uint8_t bus;
+	uint8_t depth;
+	uint8_t ports[7U];
+	/* Slots for devices with transfers in flight, with 0 meaning no limit */
+	size_t limit;
+	size_t in_flight;
+	size_t devices;
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	/* Throughput accounting: payload moved, and when it was first asked for and last finished with */
+	uint64_t bytes;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint64_t waited_us;
+} stlink_link_s;
+
+/* Every link the devices of a gang run are spread across */
+typedef struct stlink_topology {
+	stlink_link_s *links;
+	size_t count;
+} stlink_topology_s;
+
+bool stlink_topology_build(stlink_topology_s *topology, stlink_device_list_s *list, size_t hub_limit);
+void stlink_topology_report(const stlink_topology_s *topology);
+void stlink_topology_free(stlink_topology_s *topology, stlink_device_list_s *list);
+
+void stlink_link_acquire(stlink_info_s *info);
+void stlink_link_release(stlink_info_s *info, size_t bytes);
+
+#endif /*TOPOLOGY_H*/
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "crypto.h"
+#include "stlink.h"
+#include "discovery.h"
+#include "trace.h"
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = NULL;
+static bool trace_chrome = false;
+static bool trace_first = true;
+static uint64_t trace_epoch = 0U;
+static uint32_t trace_next_tid = 0U;
+/* Each thread flashing a device gets its own track, numbered in the order they first report in */
+static _Thread_local uint32_t trace_tid = 0U;
+
+/* Must be called before any flashing starts, as the sink isn't locked against being swapped out */
+bool stlink_trace_open(const char *const path)
+{
+	FILE *const file = fopen(path, "w");
+	if (!file) {
+		const int error = errno;
+		fprintf(stderr, "Opening trace file %s failed (%d): %s\n", path, error, strerror(error));
+		return false;
+	}
+	const size_t length = strlen(path);
+	trace_chrome = length >= 5U && strcmp(path + length - 5U, ".json") == 0;
+	trace_first = true;
+	trace_epoch = time_us();
+	if (trace_chrome)
+		fputs("[\n", file);
+	trace_file = file;
+	return true;
+}
+
+void stlink_trace_close(void)
+{
+	if (!trace_file)
+		return;
+	if (trace_chrome)
+		fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+bool stlink_trace_enabled(void)
+{
+	return trace_file != NULL;
+}
+
+void stlink_trace_event(
+	const stlink_info_s *const info, const char *const name, const uint64_t start_us, const char *const args_fmt, ...)
+{
+	if (!trace_file)
+		return;
+	const uint64_t end_us = time_us();
+	/* Build the whole record first so the lock only covers writing it out */
+	char args[256] = "";
+	size_t length = 0U;
+	if (info) {
+		char id[STLINK_ID_LENGTH];
+		stlink_format_id(info->id, id);
+		length = (size_t)snprintf(args, sizeof(args), ",\"device\":\"%s\"", id);
+	}
+	if (args_fmt && length < sizeof(args) - 1U) {
+		args[length++] = ',';
+		va_list ap;
+		va_start(ap, args_fmt);
+		vsnprintf(args + length, sizeof(args) - length, args_fmt, ap);
+		va_end(ap);
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_tid)
+		trace_tid = ++trace_next_tid;
+	const uint64_t ts = start_us > trace_epoch ? start_us - trace_epoch : 0U;
+	const uint64_t dur = end_us - start_us;
+	if (trace_chrome) {
+		/* Complete ("X") events, with the extra members (less their leading comma) as the event's args */
+		fprintf(trace_file,
+			"%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":1,\"tid\":%" PRIu32
+			",\"args\":{%s}}",
+			trace_first ? "" : ",\n", name, ts, dur, trace_tid, args[0] ? args + 1 : "");
+	} else
+		fprintf(trace_file, "{\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"phase\":\"%s\",\"thread\":%" PRIu32 "%s}\n",
+			ts, dur, name, trace_tid, args);
+	trace_first = false;
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2026 The stlink-tool contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timing.h"
+
+struct stlink_info;
+
+/*
+ * Timing telemetry for every phase of a run, from enumeration down to individual status polls.
+ * Events go to a file as JSON lines, or as a Chrome trace (chrome://tracing, Perfetto) when the
+ * file name ends in ".json". The sink is process-wide, so gang and daemon runs all land in one file,
+ * each device on its own track.
+ */
+bool stlink_trace_open(const char *path);
+void stlink_trace_close(void);
+bool stlink_trace_enabled(void);
+
+/*
+ * Record a phase that started at start_us (from time_us()) and has just finished. info may be NULL
+ * for phases not tied to one device. args_fmt, if not NULL, gives extra JSON members ("key":value,...)
+ */
+void stlink_trace_event(const struct stlink_info *info, const char *name, uint64_t start_us, const char *args_fmt, ...)
+#if defined(__GNUC__)
+	__attribute__((format(printf, 4, 5)))
+#endif
+	;
+
+#endif /*TRACE_H*/